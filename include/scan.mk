@@ -11,6 +11,14 @@ SCAN_DIR ?= package
 TARGET_STAMP:=$(TMP_DIR)/info/.files-$(SCAN_TARGET).stamp
 FILELIST:=$(TMP_DIR)/info/.files-$(SCAN_TARGET)-$(SCAN_COOKIE)
 
+# DUMP=1 output by the md5 of everything it is made from, so a Makefile that
+# was only touched (checkout, feeds update) doesn't have to be dumped again.
+# That includes what the dumps get from outside the files: the release and
+# revision exported by toplevel.mk (base-files' version) and, for targets,
+# the host from .host.mk.
+SCAN_CACHE:=$(TMP_DIR)/info/.cache-$(SCAN_TARGET)
+SCAN_CACHE_SALT:=$(shell { echo '$(RELEASE) $(REVISION)'; cat $(TOPDIR)/rules.mk $(TOPDIR)/include/*.mk $(wildcard $(TMP_DIR)/.host.mk); } | (md5sum || md5) 2>/dev/null | awk '{print $$1}') $(SCAN_MAKEOPTS)
+
 ifeq ($(IS_TTY),1)
   define progress
 	printf "\033[M\r$(1)" >&2;
@@ -27,12 +35,23 @@ define PackageDir
 	{ \
 		$$(call progress,Collecting $(SCAN_NAME) info: $(SCAN_DIR)/$(2)) \
 		echo Source-Makefile: $(SCAN_DIR)/$(2)/Makefile; \
-		$(NO_TRACE_MAKE) --no-print-dir -r DUMP=1 -C $(SCAN_DIR)/$(2) $(SCAN_MAKEOPTS) 2>/dev/null || { \
+		KEY=$$$$( { \
+			echo "$(SCAN_DIR)/$(2) $(SCAN_CACHE_SALT)"; \
+			cat $$^ $$$$(find $(SCAN_DIR)/$(2)/ -maxdepth 2 -type f -name '*.mk' | sort); \
+		} | (md5sum || md5) 2>/dev/null | awk '{print $$$$1}'); \
+		if [ -f "$(SCAN_CACHE)/$$$$KEY" ]; then \
+			touch "$(SCAN_CACHE)/$$$$KEY"; \
+		elif $(NO_TRACE_MAKE) --no-print-dir -r DUMP=1 -C $(SCAN_DIR)/$(2) $(SCAN_MAKEOPTS) > $$@.dump 2>/dev/null; then \
+			mkdir -p "$(SCAN_CACHE)"; \
+			mv $$@.dump "$(SCAN_CACHE)/$$$$KEY"; \
+		else \
+			rm -f $$@.dump; \
 			mkdir -p "$(TOPDIR)/logs/$(SCAN_DIR)/$(2)"; \
 			$(NO_TRACE_MAKE) --no-print-dir -r DUMP=1 -C $(SCAN_DIR)/$(2) $(SCAN_MAKEOPTS) > $(TOPDIR)/logs/$(SCAN_DIR)/$(2)/dump.txt 2>&1; \
 			$$(call progress,ERROR: please fix $(SCAN_DIR)/$(2)/Makefile - see logs/$(SCAN_DIR)/$(2)/dump.txt for details\n) \
 			rm -f $$@; \
-		}; \
+		fi; \
+		cat "$(SCAN_CACHE)/$$$$KEY" 2>/dev/null; \
 		echo; \
 	} > $$@ || true
 endef
@@ -68,9 +87,9 @@ $(TARGET_STAMP)::
 $(TMP_DIR)/.$(SCAN_TARGET): $(TARGET_STAMP) $(SCAN_STAMP)
 	$(call progress,Collecting $(SCAN_NAME) info: merging...)
 	-cat $(FILELIST) | awk '{gsub(/\//, "_", $$0);print "$(TMP_DIR)/info/.$(SCAN_TARGET)-" $$0}' | xargs cat > $@ 2>/dev/null
+	-find $(SCAN_CACHE) -type f -mtime +30 -exec rm -f {} + 2>/dev/null
 	$(call progress,Collecting $(SCAN_NAME) info: done)
 	echo
 
 FORCE:
 .PHONY: FORCE
-.NOTPARALLEL:
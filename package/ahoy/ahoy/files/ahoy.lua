@@ -10,7 +10,7 @@ local codec = require "codec"
 local leds = require "leds"
 local buttons = require "buttons"
 local opus = require "opus"
-local spi = require "spi"
+local mcu = require "mcu"
 
 debug_on(true)
 
@@ -117,11 +117,12 @@ function checkSetup()
     leds.set({red=1,blue=0,green=0,time=0.5,},{red=0,blue=0,green=0,time=1,fade=1})
     audio.playFile("setup-on.opus")
        
-    while (buttons.state("setup")) do
-    end
+    buttons.waitfor("setup", false)
     
+    -- wake for presses, and often enough to repeat a held volume button
     while (not buttons.state("setup")) do
       checkVolume()
+      buttons.wait(0.2)
     end
     
     debug("Setup off")
@@ -135,8 +136,11 @@ end
 ------------------------------------------------------------------------------
 -- RECORDING
 ------------------------------------------------------------------------------
+-- one store, reused by every recording so long ones don't churn the heap
+local opusdata = opus.newstore()
+
 function checkRecording()
-  local opusdata = {}
+  opusdata:clear()
   
   if (buttons.state("main")) then  
     debug("starting recording")
@@ -151,41 +155,33 @@ function checkRecording()
   
     debug("reading audio frames of size:" .. opus_frame_size)
     while (buttons.state("main")) do
-      local pcmframe  = audio.read(opus_frame_size)
-      local opusframe = enc:encode(pcmframe)
-      debug('opusframe length ' .. #opusframe)
+      local pcmframe  = audio.readFrame(opus_frame_size)
+      local opusbytes = opusdata:encode(enc, pcmframe)
+      debug('opusframe length ' .. opusbytes)
 
       if (pcmframe) then
         recfile:write(pcmframe)
       end
       
-      opusdata[#opusdata+1] = opusframe
-      
     end  
-    debug("opus frames: " .. #opusdata)
+    debug("opus frames: " .. opusdata:count())
     audio.stop()
 
     assert(recfile:close())
     
     -- remove the last 0.1 second to hide the click from the button
-    local i
-    for i = 1, opus_frames_per_second/10 do
-      if (#opusdata > 0) then
-        opusdata[#opusdata] = nil
-      end
-    end
+    opusdata:truncate(opus_frames_per_second/10)
 
     -- whistle if the recording is less than one second long
-    if (#opusdata < opus_frames_per_second * 1) then      
+    if (opusdata:count() < opus_frames_per_second * 1) then      
       whistle()
       -- throw out the short data
-      opusdata = {}
+      opusdata:clear()
     end                                                                                          
     
     -- if we are still holding down the button (i.e. maximum recording), wait until it's released
-    while (buttons.state("main")) do                                                             
-      leds.set(default_color)                                                                            
-    end  
+    leds.set(default_color)
+    buttons.waitfor("main", false)
   end
   return opusdata
 end
@@ -223,10 +219,11 @@ end
 
 codec.init()
 
-spi.open("/dev/spidev1.0")
+-- the MCU debounces the buttons at about 120Hz, so poll it at that rate
+local board = mcu.open("/dev/spidev1.0", 120)
 
-leds.init(spi)
-buttons.init(spi)
+leds.init(board)
+buttons.init(board)
 
 -- fade to white while starting up
 leds.set({red=1,green=1,blue=1,fade=1.0})
@@ -239,6 +236,9 @@ whistle()
 -- main loop
 for i=0,math.huge do
 
+  -- sleep until a button changes, waking to repeat a held volume button
+  buttons.wait(0.2)
+
   -- check the volume
   checkVolume()
   
@@ -249,27 +249,27 @@ for i=0,math.huge do
   local opusdata = checkRecording()
   
   -- if we have audio data, then play it.
-  if (#opusdata > 0) then
+  if (opusdata:count() > 0) then
     -- playback is blue
     leds.set(playback_color)
 
     audio.play()
       
     local index = 1
---    local dec = opus.newdecoder(48000, 1)
+    local dec = opus.newdecoder(48000, 1)
 
     while (not buttons.state("main")) do
   
       checkVolume()
-      local decodedframe = dec:decode(opusdata[index])
+      local decodedframe = opusdata:decode(dec, index)
       debug("decoded frame of length " .. #decodedframe)
-      audio.write(decodedframe)
+      audio.writeFrame(decodedframe)
 --      audio.write(opusdata[index])
       index = index + 1
     
       -- we've reached the end
       -- start over and show a blink
-      if (index > #opusdata) then 
+      if (index > opusdata:count()) then 
         index = 1
         leds.set({red=1,blue=1,green=1,time=0.1},playback_color)
         debug("repeat sound")
@@ -279,7 +279,7 @@ for i=0,math.huge do
   
     audio.stop()
     debug("stop playing")
-    opusdata = {}
+    opusdata:clear()
     
     leds.set(default_color)
     
@@ -1,4 +1,5 @@
 require "debug"
+require "socket"
 
 -- Audio lib inherits i2s functions
 audio = require("i2s")
@@ -11,18 +12,32 @@ audio.frame_time = (audio.frame_size/(audio.sample_rate*audio.sample_size))
 audio.frames_per_second = 1/audio.frame_time
 
 ------------------------------------------------------------------------------
-function audio.init()
+-- the recorder and player stay open for the life of the process, the driver
+-- takes one of each at once, so switching between recording and playback
+-- doesn't cost an open, ioctls and a close.
+-- pass true to open them non-blocking, for use with audio.wait()
+function audio.init(nonblocking)
+  audio.recorder = audio.open(16, audio.sample_rate, 1, nonblocking and "rn" or "r")
+  audio.player = audio.open(16, audio.sample_rate, 1, nonblocking and "wn" or "w")
+
+  -- preallocated frame rings, reused by every recording and playback so the
+  -- steady state audio path doesn't allocate
+  audio.recordring = audio.recorder:ring(16)
+  audio.playring = audio.player:ring(16)
+
   audio.hack()
 end
 
 function audio.hack()
   -- hack to reset audio input
-  audio.open(16, audio.sample_rate, 2, "r")
-  audio.read(768)
-  audio.pause()
-  audio.close()
+  audio.recorder:read(768)
+  audio.recorder:pause()
+  audio.recorder:flush()
 end
 
+-- cached sounds stay mapped between plays, by path
+audio.sounds = {}
+
 ------------------------------------------------------------------------------
 function audio.playFile(name)
 
@@ -32,89 +47,146 @@ function audio.playFile(name)
     name = "/ahoy/sounds/" .. name
   end
   
-  local suffix = string.match(name, ".*%.(%a+)")
-  
-  if (suffix == 'wav') then
-    local filehandle = assert(io.open(name, "r"))
-    local wav = filehandle:read("*a");
-  
-    local modulo = #wav % audio.frame_size
-  
-    -- pad to 768 bytes
-    if (modulo > 0) then
-      local tacked = string.rep (string.char(0), audio.frame_size - modulo)
-      wav = wav .. tacked
-    end
-  
-    -- saved files are all 44.1 wav
-    audio.open(16, 44100, 2, "w")
-    audio.write(wav)
-    sleep(#wav / (44100*4))
-    audio.pause()
-    audio.close()
-
-    -- the volume sound would cause the input out of sync without this hack
-    audio.hack()
-        
-  elseif (suffix == 'opus') then
-    local decoded = io.popen("opusdec --quiet " .. name .. " --no-dither -")
-    -- assume opus files are mono, 48k
-    audio.open(16, 48000, 1, "w")
-    
-    local starttime = 0
-    local pcmcount = 0
-    
-    repeat
-      local reqsize = math.ceil(audio.frames_per_second * 0.5) * audio.frame_size
-      
-      local pcm = decoded:read(reqsize)    
-
-      debug("requested: " .. reqsize .. " got: " .. (pcm and #pcm or 0) )
-
-      if (pcm and (#pcm ~= reqsize)) then
-        local modulo = #pcm % audio.frame_size
-
-        -- pad to 768 bytes
-        if (modulo > 0) then
-          local tacked = string.rep (string.char(0), audio.frame_size - modulo)
-          pcm = pcm .. tacked
-        end
-        debug("pcm len now: " .. #pcm)
-      end      
-      
-      if (starttime == 0) then
-        starttime = now()
-      end
-      
-      if (pcm) then
-        audio.write(pcm)
-        pcmcount = pcmcount + #pcm
-      end
-    until not pcm
-  
-    sleep(pcmcount / (48000 * 2) - (now() - starttime))
-    
-    audio.pause()
-    audio.close()
-      
+  -- decoded once into frames under /tmp, then played from the mapped cache file,
+  -- wav at its own rate, opus at 48k, always stereo
+  local sound = audio.sounds[name]
+  if (sound) then
+    sound:rewind()
+  else
+    sound = audio.cached(name)
+    audio.sounds[name] = sound
   end
 
+  audio.player:format(16, sound:rate(), 2)
+
+  repeat
+    local written, finished = sound:play(audio.player)
+    if (not finished) then
+      audio.wait("w")
+    end
+  until finished
 
+  audio.drain()
+  audio.player:flush()
+  audio.player:format(16, audio.sample_rate, 1)
 end
 
 
 ------------------------------------------------------------------------------
+-- the first read or write after a stop starts the DMA again
 function audio.record()
     debug("begin record")
-    audio.open(16, audio.sample_rate, 1, "r")
+    audio.recordring:reset()
     audio.recording = true
 end
 
 function audio.play()
-    audio.open(16, audio.sample_rate, 1, "w")
+    audio.playring:reset()
     audio.playing = true
 end
 
+-- read a block of recorded audio of the given size in bytes
+function audio.readFrame(size)
+    return audio.recordring:drain(size)
+end
+
+-- queue audio for playback, writing out any complete hardware frames
+function audio.writeFrame(pcm)
+    audio.playring:fill(pcm)
+    audio.playring:drain()
+end
+
+------------------------------------------------------------------------------
+-- non-blocking i/o
+
+-- stand in for sockets, so the i2s devices can be handed to socket.select()
+-- along with whatever else the main loop is waiting on
+audio.selectable = {
+  r = {
+    getfd = function() return audio.recorder:fd() end,
+    dirty = function() return false end
+  },
+  w = {
+    getfd = function() return audio.player:fd() end,
+    dirty = function() return false end
+  }
+}
+
+-- wait until the recorder ("r") or player ("w") is ready.
+-- inside a coroutine this yields the selectable and the direction to
+-- whoever resumed it, otherwise it just blocks.
+function audio.wait(mode)
+  if (coroutine.running()) then
+    coroutine.yield(audio.selectable[mode], mode)
+  elseif (mode == "r") then
+    audio.recorder:ready(-1)
+  else
+    audio.player:ready(-1)
+  end
+end
+
+-- write all of pcm, waiting whenever a non-blocking device is full
+function audio.writeAll(pcm)
+  local offset = 0
+  while (offset < #pcm) do
+    offset = offset + audio.player:write(pcm, offset)
+    if (offset < #pcm) then
+      audio.wait("w")
+    end
+  end
+end
+
+-- wait until everything written to the player has actually been played
+function audio.drain()
+  while (not audio.player:drain()) do
+    -- a non-blocking player can't wait in the driver, check back every hardware frame
+    socket.sleep(audio.frame_time)
+  end
+end
+
+-- read size bytes, waiting whenever a non-blocking device is empty
+function audio.readAll(size)
+  local pcm = audio.recordring:drain(size)
+  while (not pcm) do
+    audio.wait("r")
+    pcm = audio.recordring:drain(size)
+  end
+  return pcm
+end
+
+-- run an audio coroutine from an event loop: resume it if the device it
+-- last waited on is ready, waiting up to timeout seconds (default 0) for that.
+-- returns false once the coroutine has finished.
+local waiting = setmetatable({}, { __mode = "k" })
+
+function audio.service(co, timeout)
+  local wait = waiting[co]
+  
+  if (wait) then
+    local readable, writable = socket.select(
+      wait.mode == "r" and { wait.object } or {},
+      wait.mode == "w" and { wait.object } or {},
+      timeout or 0)
+    if (#readable == 0 and #writable == 0) then
+      return true
+    end
+  end
+  
+  local ok, object, mode = coroutine.resume(co)
+  if (not ok) then
+    error(object)
+  end
+  
+  if (coroutine.status(co) == "dead") then
+    waiting[co] = nil
+    return false
+  end
+  
+  waiting[co] = { object = object, mode = mode }
+  return true
+end
+
+------------------------------------------------------------------------------
 function audio.isPlaying()
     return audio.playing
 end
@@ -125,14 +197,37 @@ end
 
 function audio.stop()
 
-  -- if we're recording, pause first so the close happens quickly
+  -- throw away whatever is left of a recording
   if (audio.recording) then
-    audio.pause()
+    audio.recorder:pause()
+    audio.recorder:flush()
+  end
+
+  -- but let playback finish, like closing the device used to
+  if (audio.playing) then
+    audio.playring:drain(true)
+    audio.drain()
+    audio.player:flush()
   end
   
   audio.playing = false
   audio.recording = false 
-  audio.close()
+
+  local s = audio.stats()
+  debug(string.format("i2s underruns %d overruns %d write sleeps %d read sleeps %d max queued %d",
+                      s.underruns, s.overruns, s.play_sleeps, s.record_sleeps, s.outstanding_max))
+end
+
+------------------------------------------------------------------------------
+-- the driver's telemetry since it loaded or since audio.resetStats(). underruns
+-- with writes that never slept and a low max queued mean user space fell
+-- behind, underruns with plenty queued point at the driver
+function audio.stats()
+  return audio.player:stats()
+end
+
+function audio.resetStats()
+  return audio.player:resetStats()
 end
 
 return audio
\ No newline at end of file
@@ -1,35 +1,57 @@
 local buttons = {}
-local spi
+local mcu
 local buttonbits = { main=0, volup=1, voldown=2, setup=3 }
-local null = string.char(0)
-local laststate
+local buttonnames = { [0]="main", "volup", "voldown", "setup" }
 
 --------------------------------------------------------------------------------
-function buttons.init(spiport)
-  spi = spiport;
+-- board is an mcu.open() handle, which polls the buttons in the background
+function buttons.init(board)
+  mcu = board
 end
 
-function buttons.laststate(id)
-  if (not laststate) then
-    return buttons.state(id)
-  end
-  
-  local buttonvalue = math.floor(laststate / 2 ^ buttonbits[id]) % 2  -- shift down by the bit number, then mod 2 to get the single bit value
+local function isdown(state, id)
+  local buttonvalue = math.floor(state / 2 ^ buttonbits[id]) % 2  -- shift down by the bit number, then mod 2 to get the single bit value
   
   return buttonvalue == 1  -- result is a boolean, not a number
 end
+
+-- the buttons as of the last poll, no SPI traffic, so cheap to call
+function buttons.laststate(id)
+  return isdown(mcu:state(), id)
+end
  
 function buttons.state(id)
+  return buttons.laststate(id)
+end
 
-  laststate = string.byte(spi.rw(null,1)) -- get the button state byte
+-- block up to timeout seconds (forever if nil) for buttons to change, returns the
+-- changes as { name=, down=, time= } tables, empty if it timed out
+function buttons.wait(timeout)
+  local events = {}
   
-  return buttons.laststate(id)
+  if (mcu:wait(timeout)) then
+    events = mcu:events()
+    for i,event in ipairs(events) do
+      event.name = buttonnames[event.button]
+    end
+  end
+  
+  return events
+end
+
+-- block until the button is down (or up, if down is false)
+function buttons.waitfor(id, down)
+  if (down == nil) then down = true end
+  
+  while (buttons.state(id) ~= down) do
+    buttons.wait()
+  end
 end
 
 function buttons.down(id)
-  print("fix buttons.down!")
+  return buttons.state(id)
 end
 --------------------------------------------------------------------------------
 -- end of module
 
-return buttons
\ No newline at end of file
+return buttons
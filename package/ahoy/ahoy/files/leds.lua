@@ -1,10 +1,11 @@
 local leds = {}
-local spi
+local mcu
 
 local fps = 43.43  --  approximate update rate on led
 
-function leds.init(spiport)
-  spi = spiport
+-- board is an mcu.open() handle, commands go out with its next button poll
+function leds.init(board)
+  mcu = board
 end
 
 leds.lastcolor = nil
@@ -41,7 +42,7 @@ function leds.set(color1, color2)
       leds.lastcolor = color1
     end
     
-    spi.write(commandstring)
+    mcu:led(commandstring)
 
 end               
 
@@ -9,180 +9,267 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <assert.h>
 
 #include "i2sio.h"
+#include "pcmconv.h"
 
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
-#define I2S_FILE_KEY "i2s-file-key"
-static int gNumChannels = 0;
+#include "i2s.h"
+
+LUALIB_API int i2s_open(lua_State *L);
+LUALIB_API int i2s_close(lua_State *L);
+LUALIB_API int i2s_format(lua_State *L);
 
 LUALIB_API int i2s_write(lua_State *L);
 LUALIB_API int i2s_read(lua_State *L);
 
 LUALIB_API int i2s_pause(lua_State *L);
 LUALIB_API int i2s_resume(lua_State *L);
+LUALIB_API int i2s_flush(lua_State *L);
 
 LUALIB_API int i2s_sampleCount(lua_State *L);
+LUALIB_API int i2s_drain(lua_State *L);
+
+LUALIB_API int i2s_fd(lua_State *L);
+LUALIB_API int i2s_ready(lua_State *L);
+LUALIB_API int i2s_stats(lua_State *L);
+LUALIB_API int i2s_resetStats(lua_State *L);
 
 LUALIB_API int i2s_version(lua_State *L);
 
+LUALIB_API int i2s_ring_new(lua_State *L);
+LUALIB_API int i2s_ring_fill(lua_State *L);
+LUALIB_API int i2s_ring_drain(lua_State *L);
+LUALIB_API int i2s_ring_reset(lua_State *L);
+LUALIB_API int i2s_ring_frames(lua_State *L);
+LUALIB_API int i2s_ring_free(lua_State *L);
+
 // natural size for the AR9331 i2s driver
 #define READ_BUFFER_SIZE (NUM_DESC * I2S_BUF_SIZE)
 
+#define I2S_RING_DEFAULT_FRAMES 16
+#define I2S_RING_EMPTY_READS 4
+#define I2S_RING_KEY "i2s.ring"
+
+// A ring of preallocated, page aligned frames, always in the hardware's stereo format.
+// For a playback ring, fill() converts lua data into the frames and drain() hands whole
+// frames to the device.  For a record ring, fill() reads frames from the device and
+// drain() hands the data back to lua in the device's channel format.
+typedef struct {
+  i2s_device* device; // kept alive by the ring's environment table
+  char* frames;       // frameCount * I2S_FRAME_SIZE bytes, one allocation
+  size_t frameCount;
+  size_t head;        // oldest frame holding data
+  size_t used;        // number of frames holding data, including a partial one
+  size_t headOffset;  // bytes of the head frame already written or drained
+  size_t tailFill;    // bytes filled in the newest frame (playback)
+} i2s_ring;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int getI2SFile(lua_State *L) {
-  int* i2sfPtr;
-  int i2sf;
-  
-  lua_getfield(L, LUA_REGISTRYINDEX, I2S_FILE_KEY);
-  if (!lua_isuserdata (L, -1))
-    luaL_error(L, "No open i2s device");
-  
-  i2sfPtr = lua_touserdata(L, -1);
-  i2sf = *i2sfPtr;
-
-//  fprintf(stderr, "current i2s device file descriptor: %d\n", i2sf);
-  
-  lua_pop(L,1);
-  return i2sf;
-}  
+i2s_device* checkDevice(lua_State *L, int index) {
+  i2s_device* device = (i2s_device*)luaL_checkudata(L, index, I2S_DEVICE_KEY);
+
+  if (device->fd < 0)
+    luaL_error(L, "i2s device is closed");
+
+  return device;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void setFormat(lua_State *L, i2s_device* device, int sampleSize, int sampleRate, int sampleChannels) {
+
+    if (sampleSize == 0)
+      sampleSize = 16;
+
+    if (sampleRate == 0)
+      sampleRate = 44100;
+
+    if (sampleChannels == 0)
+      sampleChannels = 2;
+
+    if (sampleChannels < 1 || sampleChannels > 2) {
+      luaL_error(L, "Not a valid number of channels: %d", sampleChannels);
+    }
+
+    device->channels = sampleChannels;
+
+    if (sampleSize < 0 || ioctl(device->fd, I2S_DSIZE, sampleSize) < 0) {
+      luaL_error(L, "Failed to set I2S_DSIZE to %d: %s", sampleSize, strerror(errno));
+    }
+    device->sampleSize = sampleSize;
+
+    if (sampleRate < 0 || ioctl(device->fd, I2S_FREQ, sampleRate) < 0) {
+      luaL_error(L, "Failed to set I2S_FREQ to %d: %s", sampleRate, strerror(errno));
+    }
+    device->sampleRate = sampleRate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// i2s.open(size, rate, channels, [mode]) returns a device, mode is "w" (playback, default) or "r" (record)
+
 LUALIB_API int i2s_open(lua_State *L){
-    
+
     int sampleSize = lua_tointeger(L, 1);
-    int sampleRate = lua_tointeger(L, 2);  
+    int sampleRate = lua_tointeger(L, 2);
     int sampleChannels = lua_tointeger(L, 3);
     const char* mode = luaL_optstring(L, 4, "w");
     int modenum = O_WRONLY;
-    
-    int* i2sf = (int*)lua_newuserdata(L, sizeof(int));
-    
+
+    i2s_device* device = (i2s_device*)lua_newuserdata(L, sizeof(i2s_device));
+    memset(device, 0, sizeof(i2s_device));
+    device->fd = -1;
+    luaL_getmetatable(L, I2S_DEVICE_KEY);
+    lua_setmetatable(L, -2);
+
 //    fprintf(stderr, "opening with mode: %s\n", mode);
-    
-    if (strcmp(mode,"w") == 0) 
+
+    if (mode[0] == 'w')
         modenum = O_WRONLY;
-    else if (strcmp(mode, "r") == 0)
+    else if (mode[0] == 'r')
         modenum = O_RDONLY;
-    else 
+    else
+      luaL_error(L,"File mode %s is not supported in the i2s device, yet", mode);
+
+    // a trailing "n" opens the device non-blocking: reads and writes only move
+    // what the driver has ready, and the caller waits with device:ready()
+    if (strcmp(mode + 1, "n") == 0)
+        modenum |= O_NONBLOCK;
+    else if (mode[1] != 0)
       luaL_error(L,"File mode %s is not supported in the i2s device, yet", mode);
-        
-      
-    *i2sf = open ("/dev/i2s", modenum);
 
-    if (*i2sf == -1) {
+    device->fd = open ("/dev/i2s", modenum);
+
+    if (device->fd == -1) {
       luaL_error(L, "Failed to open /dev/i2s err: %s", strerror(errno));
     }
-  
-    lua_setfield(L, LUA_REGISTRYINDEX, I2S_FILE_KEY);
 
-//    fprintf(stderr, "i2s file opened: %d, mode: %d\n", *i2sf, modenum);
+    device->record = (modenum & O_ACCMODE) == O_RDONLY;
+    device->nonBlocking = (modenum & O_NONBLOCK) != 0;
 
-    if (sampleSize == 0) 
-      sampleSize = 16;
-      
-    if (sampleRate == 0)
-      sampleRate = 44100;
-      
-    if (sampleChannels == 0) 
-      sampleChannels = 2;
-      
-    if (sampleChannels < 1 || sampleChannels > 2) {
-      luaL_error(L, "Not a valid number of channels: %d", sampleChannels);
-    }
-    
-    gNumChannels = sampleChannels;
-      
-    if (sampleSize < 0 || ioctl(*i2sf, I2S_DSIZE, sampleSize) < 0) {
-      luaL_error(L, "Failed to set I2S_DSIZE to %d: %s", sampleSize, strerror(errno));
-    }
+//    fprintf(stderr, "i2s file opened: %d, mode: %d\n", device->fd, modenum);
 
-    if (sampleRate < 0 || ioctl(*i2sf, I2S_FREQ, sampleRate) < 0) {
-      luaL_error(L, "Failed to set I2S_FREQ to %d: %s", sampleRate, strerror(errno));
-    }
+    // a format error leaves the device to be closed by __gc
+    setFormat(L, device, sampleSize, sampleRate, sampleChannels);
 
-    return 0;
+    return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// also the __gc method, closing twice is harmless
 
 LUALIB_API int i2s_close(lua_State *L) {
-    int i2sf = getI2SFile(L);
-    close(i2sf);
-    lua_pushnil(L);
-    lua_setfield(L, LUA_REGISTRYINDEX, I2S_FILE_KEY);
+    i2s_device* device = (i2s_device*)luaL_checkudata(L, 1, I2S_DEVICE_KEY);
+
+    if (device->fd >= 0) {
+      close(device->fd);
+      device->fd = -1;
+    }
     return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// device:format([size, rate, channels]) changes the sample format without reopening,
+// returns the current size, rate and channels
 
+LUALIB_API int i2s_format(lua_State *L) {
+    i2s_device* device = checkDevice(L, 1);
+
+    if (lua_gettop(L) > 1) {
+      setFormat(L, device, lua_tointeger(L, 2), lua_tointeger(L, 3), lua_tointeger(L, 4));
+    }
+
+    lua_pushinteger(L, device->sampleSize);
+    lua_pushinteger(L, device->sampleRate);
+    lua_pushinteger(L, device->channels);
+    return 3;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// device:write(data, [offset]) returns the number of bytes of data written, starting
+// at offset.  Only a non-blocking device will write less than all of it.
 LUALIB_API int i2s_write(lua_State *L){
 	int		  writeResult=0;
 	const char	  *i2sData, *startPoint;
 	size_t  remainingBytes;
   size_t i2sDataLength;
+  size_t written;
+  int offset;
 
   uint16_t* stereoBuffer = NULL;
-  
-  int i2sf = getI2SFile(L);
-  
-  i2sData = lua_tolstring(L, -1, &i2sDataLength);
-  
+
+  i2s_device* device = checkDevice(L, 1);
+
+  i2sData = lua_tolstring(L, 2, &i2sDataLength);
+  offset = luaL_optint(L, 3, 0);
+
   if (i2sData == NULL || i2sDataLength == 0) {
     luaL_error(L, "No valid i2s data for write");
   }
 
+  if (offset < 0 || (size_t)offset >= i2sDataLength) {
+    luaL_error(L, "Write offset %d is outside of the i2s data", offset);
+  }
+
+  i2sData += offset;
+  i2sDataLength -= offset;
+
   // if we are getting mono data, we need to double it up
-  if (gNumChannels == 1) {
+  if (device->channels == 1) {
     int numSamples = i2sDataLength / 2;  // 16-bit samples of one channel each
 
     stereoBuffer = malloc(i2sDataLength*2);  // double the size, from one channel to two
 
-    int i;
-    for (i = 0; i < numSamples; i++) {
-        stereoBuffer[i*2] = stereoBuffer[i*2+1] = ((uint16_t*)i2sData)[i];
-    }
+    pcm_duplicate((int16_t*)stereoBuffer, (const int16_t*)i2sData, numSamples);
     i2sDataLength = i2sDataLength*2;
     i2sData = (const char*)stereoBuffer;
   }
-  
-// keep trying to write out until we are out of data.
-eagain:                                                         
-  remainingBytes = i2sDataLength;                                       
-  startPoint = i2sData;                                       
-  writeResult = 0; 
-                                                 
-  do {     
-      writeResult = write(i2sf, startPoint, remainingBytes);  
-        
-//      fprintf(stderr, "Wrote %d bytes of %d remaining\n", writeResult, remainingBytes);                   
-      if (writeResult < 0 && errno == EAGAIN) {                       
-          fprintf(stderr, "Goto eagain");
-          goto eagain;                                        
-      }                                      
-                       
+
+// keep trying to write out until we are out of data, or the device is full and non-blocking.
+  remainingBytes = i2sDataLength;
+  startPoint = i2sData;
+  writeResult = 0;
+
+  do {
+      writeResult = write(device->fd, startPoint, remainingBytes);
+
+//      fprintf(stderr, "Wrote %d bytes of %d remaining\n", writeResult, remainingBytes);
+      if (writeResult < 0 && (errno == EAGAIN || errno == EINTR)) {
+          if (device->nonBlocking && errno == EAGAIN)
+            break;
+          continue;
+      }
+
       if (writeResult >= 0) {
-        remainingBytes = remainingBytes - writeResult;                              
+        remainingBytes = remainingBytes - writeResult;
         startPoint += writeResult;
       } else {
 //        fprintf(stderr, "write failed %s\n",strerror(errno));
         // djb - This error doesn't get displayed when killing process with control-c/sigint, rather we get a segfault
+        free(stereoBuffer);
         luaL_error(L, "Failed to i2s_write: %s", strerror(errno));
-      }                                           
-      
-  } while (remainingBytes);                                      
+      }
+
+  } while (remainingBytes);
 
   if (stereoBuffer)
     free(stereoBuffer);
-        
-// djb: no result returned.  todo: non-blocking writes?  yield while blocked?
-  return 0;
+
+  // report progress in the caller's format, not the doubled up one
+  written = i2sDataLength - remainingBytes;
+  if (device->channels == 1)
+    written /= 2;
+
+  lua_pushinteger(L, written);
+  return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -192,35 +279,37 @@ LUALIB_API int i2s_read(lua_State *L){
   ssize_t readResult;
   luaL_Buffer b;
 
-  int i2sf = getI2SFile(L);
-  
-  size_t requestSize = lua_tonumber(L, -1);
+  i2s_device* device = checkDevice(L, 1);
+
+  size_t requestSize = luaL_optint(L, 2, 0);
 
   if (requestSize <= 0) {
     requestSize = READ_BUFFER_SIZE;
   }
-  
-  if (gNumChannels == 1) {
+
+  if (device->channels == 1) {
     requestSize = requestSize * 2;
   }
-  
+
   // sometimes we read more than we ask for!
   char* readBuf = malloc(requestSize + READ_BUFFER_SIZE);
 
   if (!readBuf) {
     luaL_error(L, "Failed to allocate read buffer size %d", requestSize + READ_BUFFER_SIZE);
   }
-  
+
   luaL_buffinit(L, &b);
-  do {  
-eagain:
-    readResult = read(i2sf, readBuf, requestSize);
+  do {
+    readResult = read(device->fd, readBuf, requestSize);
 
     if (readResult < 0) {
-      if (errno == EAGAIN) {
-        fprintf(stderr, "EAGAIN on i2s read\n"); 
-        goto eagain;
+      if (errno == EAGAIN && device->nonBlocking) {
+        // return what we have so far, possibly nothing
+        break;
+      } else if (errno == EAGAIN || errno == EINTR) {
+        continue;
       } else {
+        free(readBuf);
         luaL_error(L, "I2S read failed: %s", strerror(errno));
       }
     }
@@ -228,97 +317,567 @@ eagain:
     if (readResult > 0) {
       // the hardware gives us stereo always
       int numSamples = readResult/4;
-      
+
       // we'll go through each sample and skip over the alternate channels
-      if (gNumChannels == 1) {
-        int i;
-        for (i = 0; i<numSamples; i++) {
-          ((uint16_t*)readBuf)[i] = ((uint16_t*)readBuf)[i*2];
-        }
+      if (device->channels == 1) {
+        pcm_decimate((int16_t*)readBuf, (const int16_t*)readBuf, numSamples);
       }
-      
-      luaL_addlstring (&b, readBuf, numSamples * 2 * gNumChannels);
-      requestSize -= readResult;
+
+      luaL_addlstring (&b, readBuf, numSamples * 2 * device->channels);
+      requestSize = (size_t)readResult < requestSize ? requestSize - readResult : 0;
     }
-    
-    if (readResult == 0) {
-    
+
+    if (readResult == 0 && device->nonBlocking) {
+      break;
     }
-    
+
   } while (requestSize > 0);
-  
+
   luaL_pushresult(&b);
 
-  free(readBuf);    
+  free(readBuf);
 
     return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// pause, resume and flush only act on the device's own direction, so a recorder
+// can be stopped while a player keeps going
 LUALIB_API int i2s_pause(lua_State *L){
 
-  int i2sf = getI2SFile(L);
-  
-  if (ioctl(i2sf, I2S_PAUSE, 1) < 0) {
-    luaL_error(L, "Failed to pause recording i2s: %s", strerror(errno));
-  }
-  if (ioctl(i2sf, I2S_PAUSE, 0) < 0) {
-    luaL_error(L, "Failed to pause playback i2s: %s", strerror(errno));
+  i2s_device* device = checkDevice(L, 1);
+
+  if (ioctl(device->fd, I2S_PAUSE, device->record) < 0) {
+    luaL_error(L, "Failed to pause %s i2s: %s", device->record ? "recording" : "playback", strerror(errno));
   }
-  
+
   return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 LUALIB_API int i2s_resume(lua_State *L){
 
-  int i2sf = getI2SFile(L);
-    
-  if (ioctl(i2sf, I2S_RESUME, 1) < 0) {
-    luaL_error(L, "Failed to resume recording i2s: %s", strerror(errno));
+  i2s_device* device = checkDevice(L, 1);
+
+  if (ioctl(device->fd, I2S_RESUME, device->record) < 0) {
+    luaL_error(L, "Failed to resume %s i2s: %s", device->record ? "recording" : "playback", strerror(errno));
   }
-  if (ioctl(i2sf, I2S_RESUME, 0) < 0) {
-    luaL_error(L, "Failed to resume playback i2s: %s", strerror(errno));
+
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// reset the driver's queue, which used to take a close and reopen.  like close, playback
+// that isn't paused finishes what's queued first, pause it to throw that away.
+LUALIB_API int i2s_flush(lua_State *L){
+
+  i2s_device* device = checkDevice(L, 1);
+
+  if (ioctl(device->fd, I2S_FLUSH, device->record) < 0) {
+    luaL_error(L, "Failed to flush %s i2s: %s", device->record ? "recording" : "playback", strerror(errno));
   }
-  
+
   return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// player:sampleCount() returns the number of samples (per channel) the hardware
+// has played since the device was opened
 LUALIB_API int i2s_sampleCount(lua_State *L){
-    // djb: todo
-    lua_pushinteger(L,0);
+    i2s_device* device = checkDevice(L, 1);
+    uint32_t count = 0;
+
+    if (device->record)
+      luaL_error(L, "sampleCount is only kept for playback");
+
+    if (ioctl(device->fd, I2S_COUNT, &count) < 0) {
+      luaL_error(L, "Failed to get the i2s sample count: %s", strerror(errno));
+    }
+
+    lua_pushnumber(L, count);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// player:drain() waits until everything written has been played, returns true
+// once it has.  a non-blocking device returns false instead of waiting.
+LUALIB_API int i2s_drain(lua_State *L){
+    i2s_device* device = checkDevice(L, 1);
+    int result;
+
+    if (device->record)
+      luaL_error(L, "Only a playback device can be drained");
+
+    do {
+      result = ioctl(device->fd, I2S_DRAIN);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0 && errno == EAGAIN) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+    if (result < 0) {
+      luaL_error(L, "Failed to drain i2s: %s", strerror(errno));
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// the device's file descriptor, for polling alongside other sources
+LUALIB_API int i2s_fd(lua_State *L){
+    lua_pushinteger(L, checkDevice(L, 1)->fd);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// device:ready([timeout]) waits up to timeout seconds (default 0, negative waits forever)
+// for the device to have room for a write or data for a read, returns true if it does
+LUALIB_API int i2s_ready(lua_State *L){
+    i2s_device* device = checkDevice(L, 1);
+    struct pollfd pfd;
+    lua_Number timeout = luaL_optnumber(L, 2, 0);
+    int result;
+
+    pfd.fd = device->fd;
+    pfd.events = device->record ? POLLIN : POLLOUT;
+    pfd.revents = 0;
+
+    do {
+      result = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0)
+      luaL_error(L, "Failed to poll i2s: %s", strerror(errno));
+
+    if (pfd.revents & (POLLERR | POLLNVAL))
+      luaL_error(L, "i2s device error while polling");
+
+    lua_pushboolean(L, result > 0);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// device:stats() returns the driver's telemetry, shared by both directions:
+// a table of counters plus latency, a list of write to played counts where
+// latency[n] is under 2^(n-1) ms and the last one is everything longer
+LUALIB_API int i2s_stats(lua_State *L){
+    i2s_device* device = checkDevice(L, 1);
+    struct i2s_telemetry t;
+    int i;
+
+    if (ioctl(device->fd, I2S_STATS, &t) < 0) {
+      luaL_error(L, "Failed to get I2S_STATS: %s", strerror(errno));
+    }
+
+    lua_createtable(L, 0, 10);
+
+#define SET_COUNTER(name) lua_pushnumber(L, t.name); lua_setfield(L, -2, #name)
+    SET_COUNTER(underruns);
+    SET_COUNTER(overruns);
+    SET_COUNTER(play_dry);
+    SET_COUNTER(play_completes);
+    SET_COUNTER(record_completes);
+    SET_COUNTER(play_sleeps);
+    SET_COUNTER(record_sleeps);
+    SET_COUNTER(outstanding);
+    SET_COUNTER(outstanding_max);
+#undef SET_COUNTER
+
+    lua_createtable(L, I2S_LATENCY_BUCKETS, 0);
+    for (i = 0; i < I2S_LATENCY_BUCKETS; i++) {
+      lua_pushnumber(L, t.latency[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "latency");
+
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LUALIB_API int i2s_resetStats(lua_State *L){
+    i2s_device* device = checkDevice(L, 1);
+
+    if (ioctl(device->fd, I2S_STATS_CLEAR) < 0) {
+      luaL_error(L, "Failed to I2S_STATS_CLEAR: %s", strerror(errno));
+    }
+
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 LUALIB_API int i2s_version(lua_State *L){
-    lua_pushstring(L, "AR9331 lua i2s version 0.1, Dean Blackketter 2013");
+    lua_pushstring(L, "AR9331 lua i2s version 0.2, Dean Blackketter 2013");
     return 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Ring buffer
+////////////////////////////////////////////////////////////////////////////////
+
+static i2s_ring* checkRing(lua_State *L, int index) {
+  i2s_ring* ring = (i2s_ring*)luaL_checkudata(L, index, I2S_RING_KEY);
+
+  if (ring->device->fd < 0)
+    luaL_error(L, "i2s device is closed");
+
+  return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// write out complete frames at the head of the ring, normally in at most two writes.
+// returns the number of frames written, which is less than count only when non-blocking.
+static size_t ringWriteFrames(lua_State *L, i2s_ring* ring, size_t count) {
+  i2s_device* device = ring->device;
+  size_t written = 0;
+
+  while (count) {
+    ssize_t writeResult;
+    size_t frames;
+    size_t run = ring->frameCount - ring->head;
+    if (run > count)
+      run = count;
+
+    writeResult = write(device->fd, ring->frames + ring->head * I2S_FRAME_SIZE + ring->headOffset,
+                        run * I2S_FRAME_SIZE - ring->headOffset);
+
+    if (writeResult < 0) {
+      if (errno == EAGAIN && device->nonBlocking)
+        break;
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      luaL_error(L, "Failed to i2s_write: %s", strerror(errno));
+    }
+
+    ring->headOffset += writeResult;
+    frames = ring->headOffset / I2S_FRAME_SIZE;
+    ring->headOffset %= I2S_FRAME_SIZE;
+
+    ring->head = (ring->head + frames) % ring->frameCount;
+    ring->used -= frames;
+    count -= frames;
+    written += frames;
+  }
+
+  return written;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// read as many free frames as the device will give us in one go, returns the frame count
+static size_t ringReadFrames(lua_State *L, i2s_ring* ring) {
+  i2s_device* device = ring->device;
+  ssize_t readResult;
+  size_t tail = (ring->head + ring->used) % ring->frameCount;
+  size_t run = ring->frameCount - ring->used;
+
+  if (run > ring->frameCount - tail)
+    run = ring->frameCount - tail;
+
+  if (run == 0)
+    return 0;
+
+  do {
+    readResult = read(device->fd, ring->frames + tail * I2S_FRAME_SIZE, run * I2S_FRAME_SIZE);
+  } while (readResult < 0 && (errno == EINTR || (errno == EAGAIN && !device->nonBlocking)));
+
+  if (readResult < 0 && errno == EAGAIN)
+    return 0;
+
+  if (readResult < 0)
+    luaL_error(L, "I2S read failed: %s", strerror(errno));
+
+  // the driver only ever hands back whole descriptors
+  ring->used += readResult / I2S_FRAME_SIZE;
+  return readResult / I2S_FRAME_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// blocking reads until the ring holds a frame.  the driver's first read after open or flush
+// only starts the DMA and comes back empty, so allow a few of those before giving up.
+static void ringWaitFrames(lua_State *L, i2s_ring* ring) {
+  int empty = 0;
+
+  while (ring->used == 0) {
+    if (ringReadFrames(L, ring) == 0 && ++empty > I2S_RING_EMPTY_READS)
+      luaL_error(L, "I2S read returned no data");
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// device:ring([frames]) - a ring feeding a player or drawing from a recorder
+LUALIB_API int i2s_ring_new(lua_State *L) {
+  i2s_device* device = checkDevice(L, 1);
+  int frameCount = luaL_optint(L, 2, I2S_RING_DEFAULT_FRAMES);
+  i2s_ring* ring;
+  void* frames;
+  int err;
+
+  if (frameCount < 2)
+    luaL_error(L, "An i2s ring needs at least 2 frames, not %d", frameCount);
+
+  ring = (i2s_ring*)lua_newuserdata(L, sizeof(i2s_ring));
+  memset(ring, 0, sizeof(i2s_ring));
+  ring->device = device;
+  luaL_getmetatable(L, I2S_RING_KEY);
+  lua_setmetatable(L, -2);
+
+  // hold a reference to the device so it isn't collected out from under the ring
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+
+  err = posix_memalign(&frames, sysconf(_SC_PAGESIZE), frameCount * I2S_FRAME_SIZE);
+  if (err)
+    luaL_error(L, "Failed to allocate %d ring frames: %s", frameCount, strerror(err));
+
+  ring->frames = frames;
+  ring->frameCount = frameCount;
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// playback: ring:fill(data) queues the data, writing whole frames to the device as the ring fills up.
+//           returns the number of bytes queued, all of them unless the device is non-blocking.
+// record:   ring:fill() reads whatever frames the device has ready, returns the number of frames read
+LUALIB_API int i2s_ring_fill(lua_State *L) {
+  i2s_ring* ring = checkRing(L, 1);
+  const char* data;
+  size_t dataLength;
+  size_t queued = 0;
+
+  if (ring->device->record) {
+    lua_pushinteger(L, ringReadFrames(L, ring));
+    return 1;
+  }
+
+  data = luaL_checklstring(L, 2, &dataLength);
+
+  while (dataLength) {
+    char* frame;
+    size_t room, take;
+
+    if (ring->tailFill == 0 || ring->tailFill == I2S_FRAME_SIZE) {
+      // start a new frame, making space if needed
+      if (ring->used == ring->frameCount && ringWriteFrames(L, ring, ring->used) == 0)
+        break;
+      ring->used++;
+      ring->tailFill = 0;
+    }
+
+    frame = ring->frames + ((ring->head + ring->used - 1) % ring->frameCount) * I2S_FRAME_SIZE + ring->tailFill;
+    room = I2S_FRAME_SIZE - ring->tailFill;
+
+    if (ring->device->channels == 1) {
+      // mono data gets doubled up into the stereo frame
+      take = dataLength < room / 2 ? dataLength & ~1 : room / 2;
+      if (take == 0)
+        luaL_error(L, "Mono i2s data must be a whole number of samples");
+      pcm_duplicate((int16_t*)frame, (const int16_t*)data, take / 2);
+      ring->tailFill += take * 2;
+    } else {
+      take = dataLength < room ? dataLength : room;
+      memcpy(frame, data, take);
+      ring->tailFill += take;
+    }
+
+    data += take;
+    dataLength -= take;
+    queued += take;
+  }
+
+  lua_pushinteger(L, queued);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// playback: ring:drain([pad]) writes the complete frames to the device, and the last
+//           partial frame too, padded out with silence, if pad is true.  returns the frames written.
+// record:   ring:drain(size) returns size bytes of audio, reading from the device as needed.
+//           a non-blocking device returns nil instead of waiting for the data to arrive.
+LUALIB_API int i2s_ring_drain(lua_State *L) {
+  i2s_ring* ring = checkRing(L, 1);
+  luaL_Buffer b;
+  size_t wanted;
+  size_t written;
+
+  if (!ring->device->record) {
+    size_t complete = ring->used;
+
+    if (ring->used && ring->tailFill < I2S_FRAME_SIZE) {
+      if (lua_toboolean(L, 2)) {
+        char* frame = ring->frames + ((ring->head + ring->used - 1) % ring->frameCount) * I2S_FRAME_SIZE;
+        memset(frame + ring->tailFill, 0, I2S_FRAME_SIZE - ring->tailFill);
+        ring->tailFill = I2S_FRAME_SIZE;
+      } else {
+        complete--;
+      }
+    }
+
+    written = ringWriteFrames(L, ring, complete);
+    if (ring->used == 0)
+      ring->tailFill = 0;
+
+    lua_pushinteger(L, written);
+    return 1;
+  }
+
+  wanted = luaL_checkint(L, 2);
+
+  if (ring->device->nonBlocking) {
+    // only start handing data over once all of it has arrived
+    size_t scale = ring->device->channels == 1 ? 2 : 1;
+
+    if (wanted * scale > (ring->frameCount - 1) * I2S_FRAME_SIZE)
+      luaL_error(L, "Ring is too small for a %d byte read", (int)wanted);
+
+    while ((ring->used * I2S_FRAME_SIZE - ring->headOffset) / scale < wanted) {
+      if (ringReadFrames(L, ring) == 0) {
+        lua_pushnil(L);
+        return 1;
+      }
+    }
+  }
+
+  luaL_buffinit(L, &b);
+  while (wanted) {
+    const char* frame;
+    size_t available, take;
+
+    if (ring->used == 0)
+      ringWaitFrames(L, ring);
+    assert(ring->used > 0);
+
+    frame = ring->frames + ring->head * I2S_FRAME_SIZE + ring->headOffset;
+    available = I2S_FRAME_SIZE - ring->headOffset;
+
+    if (ring->device->channels == 1) {
+      // the hardware gives us stereo always, skip over the alternate channel
+      char* out = luaL_prepbuffer(&b);
+      take = wanted < available / 2 ? wanted & ~1 : available / 2;
+      if (take > LUAL_BUFFERSIZE)
+        take = LUAL_BUFFERSIZE;
+      if (take == 0)
+        luaL_error(L, "Mono i2s reads must be a whole number of samples");
+      pcm_decimate((int16_t*)out, (const int16_t*)frame, take / 2);
+      luaL_addsize(&b, take);
+      ring->headOffset += take * 2;
+    } else {
+      take = wanted < available ? wanted : available;
+      luaL_addlstring(&b, frame, take);
+      ring->headOffset += take;
+    }
+
+    wanted -= take;
+
+    if (ring->headOffset == I2S_FRAME_SIZE) {
+      assert(ring->used > 0);
+      ring->head = (ring->head + 1) % ring->frameCount;
+      ring->used--;
+      ring->headOffset = 0;
+    }
+  }
+  luaL_pushresult(&b);
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// throw away anything queued, e.g. along with device:flush()
+LUALIB_API int i2s_ring_reset(lua_State *L) {
+  i2s_ring* ring = (i2s_ring*)luaL_checkudata(L, 1, I2S_RING_KEY);
+
+  ring->head = ring->used = ring->headOffset = ring->tailFill = 0;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// returns the number of frames holding data and the ring's capacity in frames
+LUALIB_API int i2s_ring_frames(lua_State *L) {
+  i2s_ring* ring = (i2s_ring*)luaL_checkudata(L, 1, I2S_RING_KEY);
+
+  lua_pushinteger(L, ring->used);
+  lua_pushinteger(L, ring->frameCount);
+  return 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LUALIB_API int i2s_ring_free(lua_State *L) {
+  i2s_ring* ring = (i2s_ring*)luaL_checkudata(L, 1, I2S_RING_KEY);
+
+  free(ring->frames);
+  ring->frames = NULL;
+  return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /* functions exposed to lua */
 static const luaL_reg i2s_functions[] = {
   {"open", i2s_open},
+  {"sound", i2s_sound_open},
+  {"cached", i2s_sound_cached},
+
+  {"version", i2s_version},
+
+  {NULL, NULL}
+};
+
+static const luaL_reg i2s_device_functions[] = {
   {"close",i2s_close},
+  {"format", i2s_format},
 
   {"write", i2s_write},
   {"read", i2s_read},
 
   {"pause", i2s_pause},
   {"resume", i2s_resume},
+  {"flush", i2s_flush},
 
   {"sampleCount", i2s_sampleCount},
+  {"drain", i2s_drain},
 
-  {"version", i2s_version},
+  {"fd", i2s_fd},
+  {"ready", i2s_ready},
+
+  {"stats", i2s_stats},
+  {"resetStats", i2s_resetStats},
 
+  {"ring", i2s_ring_new},
+
+  {"__gc", i2s_close},
+  {NULL, NULL}
+};
+
+static const luaL_reg i2s_ring_functions[] = {
+  {"fill", i2s_ring_fill},
+  {"drain", i2s_ring_drain},
+  {"reset", i2s_ring_reset},
+  {"frames", i2s_ring_frames},
+  {"__gc", i2s_ring_free},
   {NULL, NULL}
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 /* init function, will be called when lua run require */
 LUALIB_API int luaopen_i2s (lua_State *L) {
+    luaL_newmetatable(L, I2S_DEVICE_KEY);
+    luaL_register(L, 0, i2s_device_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, I2S_RING_KEY);
+    luaL_register(L, 0, i2s_ring_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    i2s_sound_register(L);
+
     luaL_openlib(L, "i2s", i2s_functions, 0);
-    return 1; 
-}
\ No newline at end of file
+    return 1;
+}
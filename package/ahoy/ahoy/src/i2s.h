@@ -0,0 +1,36 @@
+/*
+
+Shared between the parts of the lua i2s module
+
+*/
+
+#ifndef I2S_H
+#define I2S_H
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#define I2S_DEVICE_KEY "i2s.device"
+
+// one DMA descriptor's worth of stereo 16-bit audio (ATH_I2S_BUFF_SIZE in the driver)
+#define I2S_FRAME_SIZE 768
+
+// One open direction of /dev/i2s.  The driver takes a reader and a writer at
+// the same time, so record and playback devices can be open together.
+typedef struct {
+  int fd;             // -1 once closed
+  int record;
+  int nonBlocking;
+  int sampleSize;
+  int sampleRate;
+  int channels;       // the format lua reads and writes, the hardware is always stereo
+} i2s_device;
+
+i2s_device* checkDevice(lua_State *L, int index);
+
+// sound.c
+LUALIB_API int i2s_sound_open(lua_State *L);
+LUALIB_API int i2s_sound_cached(lua_State *L);
+void i2s_sound_register(lua_State *L);
+
+#endif
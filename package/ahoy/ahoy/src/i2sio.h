@@ -14,4 +14,24 @@
 #define I2S_PAUSE       _IOWR('N', 0x26, int)
 #define I2S_RESUME      _IOWR('N', 0x27, int)
 #define I2S_MCLK        _IOW('N', 0x28, int)
+#define I2S_FLUSH       _IOW('N', 0x2b, int)
+#define I2S_DRAIN       _IO('N', 0x2c)
 
+#define I2S_LATENCY_BUCKETS 12
+
+/* the driver's struct i2s_telemetry, see ath-i2s.h */
+struct i2s_telemetry {
+    uint32_t underruns;
+    uint32_t overruns;
+    uint32_t play_dry;
+    uint32_t play_completes;
+    uint32_t record_completes;
+    uint32_t play_sleeps;
+    uint32_t record_sleeps;
+    uint32_t outstanding;
+    uint32_t outstanding_max;
+    uint32_t latency[I2S_LATENCY_BUCKETS];  /* bucket n under 2^n ms, the last the rest */
+};
+
+#define I2S_STATS       _IOR('N', 0x30, struct i2s_telemetry)
+#define I2S_STATS_CLEAR _IO('N', 0x31)
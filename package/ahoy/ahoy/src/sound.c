@@ -0,0 +1,580 @@
+/*
+
+Streaming sound player
+
+i2s.sound(path) opens a .wav or .opus file and snd:play(device) decodes it
+straight into whole DMA frames for the driver, one frame at a time, so a
+sound of any length plays in the same small, fixed amount of memory.
+
+i2s.cached(path) decodes a sound once into a file of raw frames under /tmp
+and maps it, so short sounds that play over and over (button feedback) are
+written to the driver straight from the page cache, without touching flash
+or the decoder again.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <opusfile.h>
+
+#include "pcmconv.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "i2s.h"
+
+#define I2S_SOUND_KEY "i2s.sound"
+#define I2S_CACHE_DIR "/tmp/sounds"
+#define I2S_CACHE_MAGIC "i2spcm1"
+
+LUALIB_API int i2s_sound_rate(lua_State *L);
+LUALIB_API int i2s_sound_channels(lua_State *L);
+LUALIB_API int i2s_sound_play(lua_State *L);
+LUALIB_API int i2s_sound_rewind(lua_State *L);
+LUALIB_API int i2s_sound_close(lua_State *L);
+
+// WAVE_FORMAT_PCM, and WAVE_FORMAT_EXTENSIBLE which keeps the real format in its sub format
+#define WAV_FORMAT_PCM        1
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+// the largest fmt chunk, the extensible one, is 40 bytes
+#define WAV_FMT_MAX 40
+
+// a data chunk of either size was written by something that couldn't seek back to fill it in
+#define WAV_SIZE_UNKNOWN 0xFFFFFFFF
+
+typedef struct {
+  FILE* file;           // wav, positioned in the data chunk
+  OggOpusFile* opus;    // opus, decoded at 48k stereo
+  uint32_t dataLeft;    // wav bytes left in the data chunk
+  int untilEof;         // wav data runs to the end of the file instead
+  int channels;         // of the file, frames handed to the device are always stereo
+  int rate;
+  int done;             // nothing left to decode
+  size_t frameSent;     // bytes of the pending frame already written
+  int framePending;
+  char* map;            // cached, the whole cache file mapped
+  size_t mapSize;
+  size_t pcmOffset;     // cached, bytes of frames already written
+  FILE* cacheFile;      // a cache file being written, under its temporary name
+  char* cacheTemp;
+  union {
+    int16_t samples[I2S_FRAME_SIZE / 2];
+    char bytes[I2S_FRAME_SIZE];
+  } frame;
+} i2s_sound;
+
+// the start of a cache file, the frames follow it.  the source's size and time
+// tell a stale cache from a good one.
+typedef struct {
+  char magic[8];
+  uint32_t rate;
+  uint32_t channels;
+  uint32_t sourceSize;
+  uint32_t sourceTime;
+} i2s_cache_header;
+
+////////////////////////////////////////////////////////////////////////////////
+// wav files are little endian whatever we run on
+
+static uint16_t le16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static i2s_sound* checkSound(lua_State *L, int index) {
+  i2s_sound* sound = (i2s_sound*)luaL_checkudata(L, index, I2S_SOUND_KEY);
+
+  if (!sound->file && !sound->opus && !sound->map)
+    luaL_error(L, "sound is closed");
+
+  return sound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// walk the RIFF chunks up to the data, reading the format on the way.  the fmt chunk
+// is 16 bytes, 18 with a (zero) extension size, or 40 when extensible, and any other
+// chunks (LIST, fact, ...) are skipped.  chunks are padded to an even length.
+static void readWavHeader(lua_State *L, i2s_sound* sound, const char* path) {
+  unsigned char header[8];
+  unsigned char fmt[WAV_FMT_MAX];
+  int haveFormat = 0;
+
+  // "RIFF" was checked by the caller
+  if (fread(header, 1, 8, sound->file) != 8 || memcmp(header + 4, "WAVE", 4))
+    luaL_error(L, "%s is not a WAVE file", path);
+
+  for (;;) {
+    uint32_t size;
+
+    if (fread(header, 1, 8, sound->file) != 8)
+      luaL_error(L, "%s has no data chunk", path);
+
+    size = le32(header + 4);
+
+    if (memcmp(header, "fmt ", 4) == 0) {
+      size_t take = size < WAV_FMT_MAX ? size : WAV_FMT_MAX;
+      int format;
+
+      if (size < 16 || fread(fmt, 1, take, sound->file) != take)
+        luaL_error(L, "%s has a bad fmt chunk", path);
+
+      format = le16(fmt);
+      if (format == WAV_FORMAT_EXTENSIBLE && take >= 26)
+        format = le16(fmt + 24);
+
+      sound->channels = le16(fmt + 2);
+      sound->rate = le32(fmt + 4);
+
+      if (format != WAV_FORMAT_PCM || le16(fmt + 14) != 16)
+        luaL_error(L, "%s is not 16-bit PCM", path);
+
+      if (sound->channels < 1 || sound->channels > 2)
+        luaL_error(L, "%s has %d channels, only mono and stereo play", path, sound->channels);
+
+      haveFormat = 1;
+      size -= take;
+    } else if (memcmp(header, "data", 4) == 0) {
+      if (!haveFormat)
+        luaL_error(L, "%s has data before its fmt chunk", path);
+
+      sound->dataLeft = size;
+      sound->untilEof = size == 0 || size == WAV_SIZE_UNKNOWN;
+      return;
+    }
+
+    if (fseek(sound->file, size + (size & 1), SEEK_CUR) < 0)
+      luaL_error(L, "Failed to read %s: %s", path, strerror(errno));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a cache file that wasn't finished is thrown away
+static void discardCache(i2s_sound* sound) {
+  if (sound->cacheFile) {
+    fclose(sound->cacheFile);
+    sound->cacheFile = NULL;
+  }
+
+  if (sound->cacheTemp) {
+    unlink(sound->cacheTemp);
+    free(sound->cacheTemp);
+    sound->cacheTemp = NULL;
+  }
+}
+
+static void closeSound(i2s_sound* sound) {
+  discardCache(sound);
+
+  if (sound->file) {
+    fclose(sound->file);
+    sound->file = NULL;
+  }
+
+  if (sound->opus) {
+    op_free(sound->opus);
+    sound->opus = NULL;
+  }
+
+  if (sound->map) {
+    munmap(sound->map, sound->mapSize);
+    sound->map = NULL;
+  }
+}
+
+static i2s_sound* newSound(lua_State *L) {
+  i2s_sound* sound = (i2s_sound*)lua_newuserdata(L, sizeof(i2s_sound));
+  memset(sound, 0, sizeof(i2s_sound));
+  luaL_getmetatable(L, I2S_SOUND_KEY);
+  lua_setmetatable(L, -2);
+  return sound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// open the file for decoding, errors leave it to be closed by __gc
+static void openSound(lua_State *L, i2s_sound* sound, const char* path) {
+  unsigned char magic[4];
+
+  sound->file = fopen(path, "rb");
+  if (!sound->file)
+    luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+
+  if (fread(magic, 1, 4, sound->file) != 4)
+    luaL_error(L, "%s is too short to be a sound", path);
+
+  if (memcmp(magic, "RIFF", 4) == 0) {
+    readWavHeader(L, sound, path);
+  } else if (memcmp(magic, "OggS", 4) == 0) {
+    int err = 0;
+
+    fclose(sound->file);
+    sound->file = NULL;
+
+    sound->opus = op_open_file(path, &err);
+    if (!sound->opus)
+      luaL_error(L, "Failed to open opus file %s: %d", path, err);
+
+    sound->channels = op_channel_count(sound->opus, -1);
+    sound->rate = 48000;
+  } else {
+    luaL_error(L, "%s is not a wav or opus file", path);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// i2s.sound(path) opens a wav (16-bit PCM, mono or stereo) or an ogg opus file for playing
+LUALIB_API int i2s_sound_open(lua_State *L) {
+  const char* path = luaL_checkstring(L, 1);
+
+  openSound(L, newSound(L), path);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// wav data into the frame, from fill bytes in.  mono is read into the back half
+// of the space and doubled up forwards over itself.  returns the new fill.
+static size_t readWav(lua_State *L, i2s_sound* sound, size_t fill) {
+  size_t room = I2S_FRAME_SIZE - fill;
+  size_t want = sound->channels == 1 ? room / 2 : room;
+  char* dst = sound->frame.bytes + fill;
+  char* at = sound->channels == 1 ? dst + want : dst;
+  size_t got;
+
+  if (!sound->untilEof && want > sound->dataLeft)
+    want = sound->dataLeft;
+
+  got = fread(at, 1, want, sound->file);
+
+  if (got < want) {
+    if (ferror(sound->file))
+      luaL_error(L, "Failed to read wav data: %s", strerror(errno));
+    sound->done = 1;
+  }
+
+  // a trailing odd byte is half a sample, leave it out
+  got &= sound->channels == 1 ? ~(size_t)1 : ~(size_t)3;
+
+  if (!sound->untilEof) {
+    sound->dataLeft -= got;
+    if (sound->dataLeft < (sound->channels == 1 ? 2u : 4u))
+      sound->done = 1;
+  }
+
+  if (sound->channels == 1) {
+    pcm_duplicate((int16_t*)dst, (const int16_t*)at, got / 2);
+    got *= 2;
+  }
+
+  return fill + got;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// opus decodes to native endian stereo, the device takes the little endian
+// samples a wav file holds
+static size_t readOpus(lua_State *L, i2s_sound* sound, size_t fill) {
+  int16_t* dst = (int16_t*)(sound->frame.bytes + fill);
+  int result;
+
+  result = op_read_stereo(sound->opus, dst, (I2S_FRAME_SIZE - fill) / 2);
+
+  if (result == OP_HOLE) {
+    // a gap in the stream, carry on with what follows it
+    return fill;
+  }
+
+  if (result < 0)
+    luaL_error(L, "Failed to decode opus: %d", result);
+
+  if (result == 0) {
+    sound->done = 1;
+    return fill;
+  }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  pcm_swap(dst, dst, result * 2);
+#endif
+
+  return fill + result * 4;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// decode the next whole frame, the last one padded out with silence.
+// returns 0 when there is nothing left.
+static int nextFrame(lua_State *L, i2s_sound* sound) {
+  size_t fill = 0;
+
+  while (fill < I2S_FRAME_SIZE && !sound->done) {
+    fill = sound->opus ? readOpus(L, sound, fill) : readWav(L, sound, fill);
+  }
+
+  if (fill == 0)
+    return 0;
+
+  memset(sound->frame.bytes + fill, 0, I2S_FRAME_SIZE - fill);
+  sound->framePending = 1;
+  sound->frameSent = 0;
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// a cached sound is already whole frames, write up to count of them (all when negative)
+// from the mapping in one go.  returns the number of frames finished.
+static int writeCached(lua_State *L, i2s_sound* sound, i2s_device* device, int count) {
+  const char* pcm = sound->map + sizeof(i2s_cache_header);
+  size_t pcmSize = sound->mapSize - sizeof(i2s_cache_header);
+  size_t start = sound->pcmOffset;
+  size_t end = pcmSize;
+
+  if (count >= 0 && start - start % I2S_FRAME_SIZE + (size_t)count * I2S_FRAME_SIZE < end)
+    end = start - start % I2S_FRAME_SIZE + (size_t)count * I2S_FRAME_SIZE;
+
+  while (sound->pcmOffset < end) {
+    ssize_t writeResult = write(device->fd, pcm + sound->pcmOffset, end - sound->pcmOffset);
+
+    if (writeResult < 0) {
+      if (errno == EAGAIN && device->nonBlocking)
+        break;
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      luaL_error(L, "Failed to i2s_write: %s", strerror(errno));
+    }
+
+    sound->pcmOffset += writeResult;
+  }
+
+  return sound->pcmOffset / I2S_FRAME_SIZE - start / I2S_FRAME_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// snd:play(device, [frames]) decodes and writes up to frames DMA frames (default all
+// of them), returns the number written and true once the whole sound has been written.
+// a non-blocking device stops when the driver is full, keeping the frame it was on for
+// the next call.  set the device to snd:rate() first, the sound is always written as stereo.
+LUALIB_API int i2s_sound_play(lua_State *L) {
+  i2s_sound* sound = checkSound(L, 1);
+  i2s_device* device = checkDevice(L, 2);
+  int count = luaL_optint(L, 3, -1);
+  int written = 0;
+
+  if (device->record)
+    luaL_error(L, "A sound can only be played on a playback device");
+
+  if (sound->map) {
+    lua_pushinteger(L, writeCached(L, sound, device, count));
+    lua_pushboolean(L, sound->pcmOffset == sound->mapSize - sizeof(i2s_cache_header));
+    return 2;
+  }
+
+  while (count != 0) {
+    ssize_t writeResult;
+
+    if (!sound->framePending && !nextFrame(L, sound))
+      break;
+
+    writeResult = write(device->fd, sound->frame.bytes + sound->frameSent, I2S_FRAME_SIZE - sound->frameSent);
+
+    if (writeResult < 0) {
+      if (errno == EAGAIN && device->nonBlocking)
+        break;
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      luaL_error(L, "Failed to i2s_write: %s", strerror(errno));
+    }
+
+    sound->frameSent += writeResult;
+    if (sound->frameSent == I2S_FRAME_SIZE) {
+      sound->framePending = 0;
+      written++;
+      count--;
+    }
+  }
+
+  lua_pushinteger(L, written);
+  lua_pushboolean(L, sound->done && !sound->framePending);
+  return 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// snd:rewind() starts a cached sound over, to play it again
+LUALIB_API int i2s_sound_rewind(lua_State *L) {
+  i2s_sound* sound = checkSound(L, 1);
+
+  if (!sound->map)
+    luaL_error(L, "Only a cached sound can be rewound");
+
+  sound->pcmOffset = 0;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// map a cache file, if it's there and was made from the source as it is now
+static int mapCache(i2s_sound* sound, const char* cachePath, const struct stat* source) {
+  i2s_cache_header* header;
+  struct stat st;
+  void* map;
+  int fd = open(cachePath, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(i2s_cache_header) ||
+      (st.st_size - sizeof(i2s_cache_header)) % I2S_FRAME_SIZE) {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return 0;
+
+  header = (i2s_cache_header*)map;
+  if (memcmp(header->magic, I2S_CACHE_MAGIC, sizeof(header->magic)) ||
+      header->sourceSize != (uint32_t)source->st_size ||
+      header->sourceTime != (uint32_t)source->st_mtime) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  sound->map = map;
+  sound->mapSize = st.st_size;
+  sound->rate = header->rate;
+  sound->channels = header->channels;
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// decode the whole of sound into a new cache file.  it's written under a temporary
+// name and renamed into place, so a reader never maps half of one.  the file is
+// kept in sound until then, so a decode error leaves it to be removed by __gc.
+static void writeCache(lua_State *L, i2s_sound* sound, const char* cachePath, const struct stat* source) {
+  i2s_cache_header header;
+  char tempPath[PATH_MAX];
+  int ok;
+
+  snprintf(tempPath, sizeof(tempPath), "%s.%d", cachePath, (int)getpid());
+
+  sound->cacheTemp = strdup(tempPath);
+  if (!sound->cacheTemp)
+    luaL_error(L, "Failed to allocate the cache file name for %s", cachePath);
+
+  sound->cacheFile = fopen(tempPath, "wb");
+  if (!sound->cacheFile)
+    luaL_error(L, "Failed to create %s: %s", tempPath, strerror(errno));
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, I2S_CACHE_MAGIC, sizeof(header.magic));
+  header.rate = sound->rate;
+  header.channels = sound->channels;
+  header.sourceSize = source->st_size;
+  header.sourceTime = source->st_mtime;
+
+  ok = fwrite(&header, sizeof(header), 1, sound->cacheFile) == 1;
+  while (ok && nextFrame(L, sound)) {
+    ok = fwrite(sound->frame.bytes, I2S_FRAME_SIZE, 1, sound->cacheFile) == 1;
+    sound->framePending = 0;
+  }
+
+  if (ok) {
+    ok = fclose(sound->cacheFile) == 0;
+    sound->cacheFile = NULL;
+  }
+  if (ok)
+    ok = rename(tempPath, cachePath) == 0;
+
+  if (!ok) {
+    int err = errno;
+    discardCache(sound);
+    luaL_error(L, "Failed to write %s: %s", cachePath, strerror(err));
+  }
+
+  free(sound->cacheTemp);
+  sound->cacheTemp = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// i2s.cached(path, [dir]) is i2s.sound(path) played from a cache file in dir (default
+// /tmp/sounds), decoding the sound into it first if it isn't there or is out of date
+LUALIB_API int i2s_sound_cached(lua_State *L) {
+  const char* path = luaL_checkstring(L, 1);
+  const char* dir = luaL_optstring(L, 2, I2S_CACHE_DIR);
+  const char* name = strrchr(path, '/');
+  char cachePath[PATH_MAX];
+  struct stat source;
+  i2s_sound* sound;
+
+  if (stat(path, &source) < 0)
+    luaL_error(L, "Failed to open %s: %s", path, strerror(errno));
+
+  snprintf(cachePath, sizeof(cachePath), "%s/%s.pcm", dir, name ? name + 1 : path);
+
+  sound = newSound(L);
+  if (mapCache(sound, cachePath, &source))
+    return 1;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    luaL_error(L, "Failed to create %s: %s", dir, strerror(errno));
+
+  openSound(L, sound, path);
+  writeCache(L, sound, cachePath, &source);
+  closeSound(sound);
+
+  if (!mapCache(sound, cachePath, &source))
+    luaL_error(L, "Failed to map %s", cachePath);
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LUALIB_API int i2s_sound_rate(lua_State *L) {
+  lua_pushinteger(L, checkSound(L, 1)->rate);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+LUALIB_API int i2s_sound_channels(lua_State *L) {
+  lua_pushinteger(L, checkSound(L, 1)->channels);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// also the __gc method, closing twice is harmless
+LUALIB_API int i2s_sound_close(lua_State *L) {
+  closeSound((i2s_sound*)luaL_checkudata(L, 1, I2S_SOUND_KEY));
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static const luaL_reg i2s_sound_functions[] = {
+  {"rate", i2s_sound_rate},
+  {"channels", i2s_sound_channels},
+  {"play", i2s_sound_play},
+  {"rewind", i2s_sound_rewind},
+  {"close", i2s_sound_close},
+  {"__gc", i2s_sound_close},
+  {NULL, NULL}
+};
+
+void i2s_sound_register(lua_State *L) {
+  luaL_newmetatable(L, I2S_SOUND_KEY);
+  luaL_register(L, 0, i2s_sound_functions);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+}
@@ -0,0 +1,347 @@
+/*
+
+ring-sim: runs the driver's descriptor ring (src/ath-i2s-ring.h) against a
+model of the MBOX DMA engine, with the reader or writer and the DMA going at
+random relative speeds, and checks that no period is lost, repeated or
+reordered and that the playback counts add up.  The mmap tests do the
+same through the interface a client of I2S_MMAP_STATUS, I2S_MMAP_COMMIT
+and I2S_MMAP_CONSUME sees: period offsets into the mapping and counts.
+
+  make test && ./ring-sim [seed] [steps]
+
+The model DMA walks the ring like the hardware does: it takes the
+descriptor it's pointing at while OWN is set, clears OWN when it's done
+with it and moves to the next, and stalls on one it doesn't own.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "ath-i2s-ring.h"
+
+static ath_mbox_dma_desc gDesc[ATH_I2S_NUM_DESC];
+static uint32_t gBuf[ATH_I2S_NUM_DESC][ATH_I2S_BUFF_SIZE / 4];   // what the device mmap()s
+static i2s_ring_t gRing;
+
+// the model DMA engine
+static int gHw;             // descriptor it's on
+static uint32_t gHwSeq;     // periods it has played or filled
+static int gStalls;         // steps it found nothing it owned
+
+static int gFailed;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: ", __func__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        gFailed = 1; \
+        return; \
+    } \
+} while (0)
+
+static void reset(int own) {
+    memset(gDesc, 0, sizeof(gDesc));
+    memset(gBuf, 0, sizeof(gBuf));
+    gRing.desc = gDesc;
+    i2s_ring_reset(&gRing, own);
+    gHw = 0;
+    gHwSeq = 0;
+    gStalls = 0;
+}
+
+// one step of the DMA, returns 1 if it moved a period
+static int dma(int record) {
+    if (!gDesc[gHw].OWN) {
+        gStalls++;
+        return 0;
+    }
+
+    if (record) {
+        gBuf[gHw][0] = gHwSeq;
+        gDesc[gHw].length = ATH_I2S_BUFF_SIZE;
+    } else if (gBuf[gHw][0] != gHwSeq) {
+        fprintf(stderr, "dma: played period %u where %u was expected\n", gBuf[gHw][0], gHwSeq);
+        gFailed = 1;
+    }
+
+    gHwSeq++;
+    gDesc[gHw].OWN = 0;
+    gHw = i2s_ring_next(gHw);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// write() and the mmap commit, against a DMA sometimes faster and sometimes slower
+static void playback(int steps) {
+    uint32_t written = 0;
+    unsigned long bytesWritten = 0, bytesPlayed = 0;
+    int step;
+
+    reset(0);
+
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == ATH_I2S_NUM_DESC,
+          "a fresh playback ring has %d free", i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC));
+
+    for (step = 0; step < steps; step++) {
+        int want = rand() % 4;
+        int n = i2s_ring_avail(&gRing, want);
+        int i;
+
+        CHECK(n <= want, "avail returned %d, more than the %d asked", n, want);
+
+        for (i = 0; i < n; i++) {
+            // now and then a short period, like the end of a write
+            unsigned int length = rand() % 8 ? ATH_I2S_BUFF_SIZE : 4 + rand() % (ATH_I2S_BUFF_SIZE - 4);
+
+            CHECK(!gDesc[gRing.tail].OWN, "filling descriptor %d while the DMA owns it", gRing.tail);
+            gBuf[gRing.tail][0] = written++;
+            i2s_ring_give(&gRing, length);
+            bytesWritten += length;
+        }
+
+        // the DMA, then the interrupt
+        for (i = rand() % 4; i > 0; i--) {
+            dma(0);
+        }
+        bytesPlayed += i2s_ring_reap(&gRing);
+
+        CHECK(gRing.outstanding >= 0 && gRing.outstanding <= ATH_I2S_NUM_DESC,
+              "%d outstanding", gRing.outstanding);
+        CHECK(written - gHwSeq == (uint32_t)gRing.outstanding,
+              "%u written, %u played but %d outstanding", written, gHwSeq, gRing.outstanding);
+    }
+
+    // drain
+    while (gRing.outstanding) {
+        CHECK(dma(0), "the DMA stalled with %d outstanding", gRing.outstanding);
+        bytesPlayed += i2s_ring_reap(&gRing);
+    }
+
+    CHECK(bytesPlayed == bytesWritten, "%lu bytes written but %lu played", bytesWritten, bytesPlayed);
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == ATH_I2S_NUM_DESC, "drained ring isn't all free");
+
+    printf("playback: %u periods, %lu bytes, the DMA stalled %d times\n", written, bytesPlayed, gStalls);
+}
+
+// a full ring takes nothing more until the DMA hands a descriptor back
+static void playbackFull(void) {
+    int i;
+
+    reset(0);
+
+    for (i = 0; i < ATH_I2S_NUM_DESC; i++) {
+        gBuf[gRing.tail][0] = i;
+        i2s_ring_give(&gRing, ATH_I2S_BUFF_SIZE);
+    }
+
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == 0, "full ring has %d free", i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC));
+    CHECK(gRing.outstanding == ATH_I2S_NUM_DESC, "full ring has %d outstanding", gRing.outstanding);
+    CHECK(i2s_ring_reap(&gRing) == 0, "nothing has played yet");
+
+    for (i = 0; i < 5; i++) {
+        dma(0);
+    }
+
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == 5, "%d free after 5 played", i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC));
+    CHECK(i2s_ring_reap(&gRing) == 5 * ATH_I2S_BUFF_SIZE, "reaped the wrong byte count");
+    CHECK(gRing.outstanding == ATH_I2S_NUM_DESC - 5, "%d outstanding", gRing.outstanding);
+}
+
+// read() and the mmap consume: nothing lost while the reader keeps up, and the DMA waits when it doesn't
+static void record(int steps) {
+    uint32_t read = 0;
+    int step;
+
+    reset(1);
+
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == 0, "a fresh record ring has %d to read",
+          i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC));
+
+    for (step = 0; step < steps; step++) {
+        int want = rand() % 4;
+        int n = i2s_ring_avail(&gRing, want);
+        int i;
+
+        // the reader sometimes goes away for longer than the ring lasts
+        if (rand() % 512 == 0) {
+            n = 0;
+            for (i = 0; i < ATH_I2S_NUM_DESC + 10; i++) {
+                dma(1);
+            }
+            CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == ATH_I2S_NUM_DESC, "overrun ring isn't all filled");
+        }
+
+        for (i = 0; i < n; i++) {
+            CHECK(!gDesc[gRing.tail].OWN, "reading descriptor %d while the DMA owns it", gRing.tail);
+            CHECK(gBuf[gRing.tail][0] == read, "read period %u where %u was expected", gBuf[gRing.tail][0], read);
+            read++;
+            i2s_ring_recycle(&gRing);
+        }
+
+        for (i = rand() % 4; i > 0; i--) {
+            dma(1);
+        }
+
+        CHECK(gHwSeq - read == (uint32_t)i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC),
+              "%u filled, %u read, but %d waiting", gHwSeq, read, i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC));
+    }
+
+    printf("record: %u periods, the DMA waited %d times\n", read, gStalls);
+}
+
+// a flush mid stream puts everything back the way open left it
+static void flush(void) {
+    int i;
+
+    reset(0);
+
+    for (i = 0; i < 40; i++) {
+        i2s_ring_give(&gRing, ATH_I2S_BUFF_SIZE - i);
+    }
+    i2s_ring_reset(&gRing, 0);
+
+    CHECK(gRing.tail == 0 && gRing.done == 0 && gRing.outstanding == 0, "flushed ring isn't at the start");
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == ATH_I2S_NUM_DESC, "flushed ring isn't all free");
+    for (i = 0; i < ATH_I2S_NUM_DESC; i++) {
+        CHECK(gDesc[i].length == ATH_I2S_BUFF_SIZE, "descriptor %d left at length %d", i, gDesc[i].length);
+    }
+
+    i2s_ring_reset(&gRing, 1);
+    CHECK(i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC) == 0, "flushed record ring isn't all with the DMA");
+}
+
+// what I2S_MMAP_STATUS, I2S_MMAP_COMMIT and I2S_MMAP_CONSUME do to the ring, less the hardware
+static void mmapStatus(uint32_t* tail, uint32_t* avail) {
+    *tail = gRing.tail;
+    *avail = i2s_ring_avail(&gRing, ATH_I2S_NUM_DESC);
+}
+
+static int mmapCommit(int n) {
+    int err = i2s_ring_mmap_check(&gRing, n);
+
+    while (!err && n-- > 0) {
+        i2s_ring_give(&gRing, ATH_I2S_BUFF_SIZE);
+    }
+    return err;
+}
+
+static int mmapConsume(int n) {
+    if (i2s_ring_mmap_check(&gRing, n) != 0) {
+        return -EINVAL;
+    }
+    while (n-- > 0) {
+        i2s_ring_recycle(&gRing);
+    }
+    return 0;
+}
+
+// a client like athplay --mmap: fills the free periods it's told about through the mapping, at
+// tail + i periods in, and commits them.  the DMA must play them in order.
+static void mmapPlayback(int steps) {
+    uint8_t* map = (uint8_t*)gBuf;
+    uint32_t written = 0, tail, avail;
+    int step;
+
+    reset(0);
+
+    CHECK(mmapCommit(-1) == -EINVAL, "a negative commit was taken");
+    CHECK(mmapCommit(0) == 0 && gRing.outstanding == 0, "an empty commit did something");
+
+    for (step = 0; step < steps; step++) {
+        int n, i;
+
+        mmapStatus(&tail, &avail);
+        n = avail ? rand() % (avail + 1) : 0;
+
+        for (i = 0; i < n; i++) {
+            uint32_t* period = (uint32_t*)(map + ((tail + i) % ATH_I2S_NUM_DESC) * ATH_I2S_BUFF_SIZE);
+
+            period[0] = written++;
+        }
+        CHECK(mmapCommit(n) == 0, "committing %d of %u free periods failed", n, avail);
+
+        // more than is free leaves the ring alone
+        mmapStatus(&tail, &avail);
+        if (avail < ATH_I2S_NUM_DESC) {
+            CHECK(mmapCommit(avail + 1) == -EAGAIN, "committed past the free periods");
+            CHECK(gRing.tail == (int)tail, "a refused commit moved tail");
+        }
+
+        for (i = rand() % 4; i > 0; i--) {
+            dma(0);
+        }
+        i2s_ring_reap(&gRing);
+
+        CHECK(written - gHwSeq == (uint32_t)gRing.outstanding,
+              "%u committed, %u played but %d outstanding", written, gHwSeq, gRing.outstanding);
+    }
+
+    while (gRing.outstanding) {
+        CHECK(dma(0), "the DMA stalled with %d outstanding", gRing.outstanding);
+        i2s_ring_reap(&gRing);
+    }
+    CHECK(gHwSeq == written, "%u committed but %u played", written, gHwSeq);
+
+    printf("mmap playback: %u periods, the DMA stalled %d times\n", written, gStalls);
+}
+
+// and recording: read what the status says is filled, at tail + i periods in, then consume it
+static void mmapRecord(int steps) {
+    uint8_t* map = (uint8_t*)gBuf;
+    uint32_t read = 0, tail, avail;
+    int step;
+
+    reset(1);
+
+    CHECK(mmapConsume(1) == -EINVAL, "consumed a period that wasn't recorded");
+    CHECK(mmapConsume(-1) == -EINVAL, "a negative consume was taken");
+
+    for (step = 0; step < steps; step++) {
+        int n, i;
+
+        mmapStatus(&tail, &avail);
+        n = avail ? rand() % (avail + 1) : 0;
+
+        for (i = 0; i < n; i++) {
+            uint32_t* period = (uint32_t*)(map + ((tail + i) % ATH_I2S_NUM_DESC) * ATH_I2S_BUFF_SIZE);
+
+            CHECK(period[0] == read, "read period %u where %u was expected", period[0], read);
+            read++;
+        }
+        CHECK(mmapConsume(n) == 0, "consuming %d of %u filled periods failed", n, avail);
+
+        mmapStatus(&tail, &avail);
+        CHECK(mmapConsume(avail + 1) == -EINVAL, "consumed past the filled periods");
+
+        for (i = rand() % 4; i > 0; i--) {
+            dma(1);
+        }
+    }
+
+    printf("mmap record: %u periods, the DMA waited %d times\n", read, gStalls);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    unsigned int seed = argc > 1 ? (unsigned int)atoi(argv[1]) : 1;
+    int steps = argc > 2 ? atoi(argv[2]) : 200000;
+
+    srand(seed);
+
+    playback(steps);
+    playbackFull();
+    record(steps);
+    flush();
+    mmapPlayback(steps);
+    mmapRecord(steps);
+
+    printf("ring-sim seed %u: %s\n", seed, gFailed ? "FAILED" : "ok");
+    return gFailed;
+}
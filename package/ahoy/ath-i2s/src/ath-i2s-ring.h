@@ -0,0 +1,137 @@
+/*
+ * The MBOX DMA descriptor ring, shared by the CPU and the DMA engine.
+ *
+ * Nothing here touches the kernel or the hardware registers, so the same
+ * code runs in the driver and in the user space simulator in ../sim. The
+ * CPU fills (playback) or empties (record) descriptors at tail, the DMA
+ * owns a descriptor while its OWN bit is set and clears it when it's done.
+ * Callers do their own locking, and include <linux/errno.h> or <errno.h>.
+ */
+
+#ifndef _ATH_I2S_RING_H
+#define _ATH_I2S_RING_H
+
+#define ATH_I2S_NUM_DESC            128
+#define ATH_I2S_BUFF_SIZE           768
+
+typedef struct {
+	unsigned int OWN		:  1,    /* bit 00 */
+	             EOM		:  1,    /* bit 01 */
+	             rsvd1	    :  6,    /* bit 07-02 */
+	             size	    : 12,    /* bit 19-08 */
+	             length	    : 12,    /* bit 31-20 */
+	             rsvd2	    :  4,    /* bit 00 */
+	             BufPtr	    : 28,    /* bit 00 */
+	             rsvd3	    :  4,    /* bit 00 */
+	             NextPtr	: 28;    /* bit 00 */
+#ifdef SPDIF
+    unsigned int Va[6];
+    unsigned int Ua[6];
+    unsigned int Ca[6];
+    unsigned int Vb[6];
+    unsigned int Ub[6];
+    unsigned int Cb[6];
+#endif
+} ath_mbox_dma_desc;
+
+typedef struct i2s_ring {
+    ath_mbox_dma_desc *desc;
+    int tail;           /* next descriptor the CPU fills or empties */
+    int done;           /* playback: oldest descriptor not yet counted as played */
+    int outstanding;    /* playback: handed to the DMA and not played yet */
+} i2s_ring_t;
+
+#define i2s_ring_next(t)    (((t) == (ATH_I2S_NUM_DESC - 1)) ? 0 : ((t) + 1))
+
+/*
+ * Every descriptor back to a full buffer, owned by the DMA for record
+ * (waiting to be filled) or by the CPU for playback (waiting for data).
+ */
+static inline void i2s_ring_reset(i2s_ring_t *ring, int own)
+{
+    int j;
+
+    for (j = 0; j < ATH_I2S_NUM_DESC; j++) {
+        ring->desc[j].length = ATH_I2S_BUFF_SIZE;
+        ring->desc[j].OWN = own ? 1 : 0;
+    }
+    ring->tail = 0;
+    ring->done = 0;
+    ring->outstanding = 0;
+}
+
+/*
+ * How many descriptors from tail on belong to the CPU, up to max: free
+ * ones to fill for playback, filled ones to read for record.
+ */
+static inline int i2s_ring_avail(const i2s_ring_t *ring, int max)
+{
+    int t = ring->tail;
+    int n = 0;
+
+    while (n < max && n < ATH_I2S_NUM_DESC && !ring->desc[t].OWN) {
+        t = i2s_ring_next(t);
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Playback: hand the descriptor at tail, filled with length bytes, to the
+ * DMA.  The caller checks i2s_ring_avail() first.
+ */
+static inline void i2s_ring_give(i2s_ring_t *ring, unsigned int length)
+{
+    ring->desc[ring->tail].length = length;
+    ring->desc[ring->tail].OWN = 1;
+    ring->tail = i2s_ring_next(ring->tail);
+    ring->outstanding++;
+}
+
+/*
+ * Record: the descriptor at tail has been read, give it back to the DMA to
+ * fill again.
+ */
+static inline void i2s_ring_recycle(i2s_ring_t *ring)
+{
+    ring->desc[ring->tail].length = ATH_I2S_BUFF_SIZE;
+    ring->desc[ring->tail].OWN = 1;
+    ring->tail = i2s_ring_next(ring->tail);
+}
+
+/*
+ * Playback, from the DMA complete interrupt: one interrupt can cover more
+ * than one descriptor, so walk everything the DMA has given back since last
+ * time.  Returns the bytes played.
+ */
+static inline unsigned int i2s_ring_reap(i2s_ring_t *ring)
+{
+    unsigned int bytes = 0;
+
+    while (ring->outstanding > 0 && !ring->desc[ring->done].OWN) {
+        bytes += ring->desc[ring->done].length;
+        ring->done = i2s_ring_next(ring->done);
+        ring->outstanding--;
+    }
+
+    return bytes;
+}
+
+/*
+ * The check I2S_MMAP_COMMIT and I2S_MMAP_CONSUME make before touching the
+ * n periods from tail on: -EINVAL for a negative n, -EAGAIN if the DMA still
+ * owns any of them, otherwise 0.
+ */
+static inline int i2s_ring_mmap_check(const i2s_ring_t *ring, int n)
+{
+    if (n < 0)
+        return -EINVAL;
+
+    if (i2s_ring_avail(ring, n) < n)
+        return -EAGAIN;
+
+    return 0;
+}
+
+#endif /* _ATH_I2S_RING_H */
@@ -18,6 +18,9 @@
 #include <linux/sched.h>   // Now required by linux/wait.h
 #include <linux/wait.h>
 #include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
 
 #include "atheros.h"
 #include "933x.h"
@@ -28,14 +31,18 @@
 #undef USE_MEMCPY
 #define MAX_I2S_WRITE_RETRIES 2
 
+// Whole pages for the descriptor buffers, so they can be mmap'd
+#define ATH_I2S_BUF_ORDER   get_order(ATH_I2S_NUM_DESC * ATH_I2S_BUFF_SIZE)
+
 int ath_i2s_major = 253;
 int ath_i2s_minor = 0;
 
-int num_outstanding = 0;
 // Hardware defaults
 int num_channels = 2;
 int i2s_word_bytes = 2;
 uint32_t written_samples;
+// Samples in the playback descriptors the DMA has already handed back
+uint32_t played_samples;
 
 
 static int i2s_start;
@@ -52,6 +59,15 @@ void ath_i2s_dma_desc(unsigned long, int);
 void ath_i2s_dma_start(int);
 void ath_i2s_dma_pause(int);
 void ath_i2s_dma_resume(int);
+int ath_i2s_flush(int);
+int ath_i2s_drain(struct file *);
+int ath_i2s_mmap(struct file *, struct vm_area_struct *);
+int ath_i2s_mmap_status(struct file *, struct i2s_mmap_status __user *);
+int ath_i2s_mmap_commit(struct file *, int);
+int ath_i2s_mmap_consume(struct file *, int);
+int ath_i2s_stats(struct i2s_telemetry __user *);
+void ath_i2s_stats_clear(void);
+void ath_i2s_count_played(ath_i2s_softc_t *);
 //void ath_i2s_clk(unsigned long, unsigned long);
 void ath_i2s_posedge(uint32_t);
 //void ath_i2s_dpll(uint32_t, uint32_t);
@@ -84,6 +100,29 @@ void i2s_clear_stats(void)
     stats.rx_underflow = 0;
 }EXPORT_SYMBOL(i2s_clear_stats);
 
+int ath_i2s_stats(struct i2s_telemetry __user *arg)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    struct i2s_telemetry copy;
+
+    I2S_LOCK(sc);
+    telemetry.outstanding = sc->sc_pbuf.ring.outstanding;
+    copy = telemetry;
+    I2S_UNLOCK(sc);
+
+    return copy_to_user(arg, &copy, sizeof(copy)) ? -EFAULT : 0;
+}
+
+void ath_i2s_stats_clear(void)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+
+    I2S_LOCK(sc);
+    memset(&telemetry, 0, sizeof(telemetry));
+    telemetry.outstanding_max = sc->sc_pbuf.ring.outstanding;
+    I2S_UNLOCK(sc);
+}
+
 
 int ath_i2s_desc_busy(struct file *filp)
 {
@@ -202,7 +241,7 @@ int ath_i2s_init_desc(struct file *filp)
     /* Allocate data buffers */
     scbuf = dmabuf->db_buf;
 
-    if (!(bufp = kmalloc(ATH_I2S_NUM_DESC * ATH_I2S_BUFF_SIZE, GFP_KERNEL))) {
+    if (!(bufp = (uint8_t *) __get_free_pages(GFP_KERNEL, ATH_I2S_BUF_ORDER))) {
         printk(KERN_CRIT "Buffer allocation failed for \n");
         goto fail3;
     }
@@ -219,13 +258,12 @@ int ath_i2s_init_desc(struct file *filp)
                                             ATH_I2S_BUFF_SIZE,
                                             DMA_BIDIRECTIONAL);
     }
-    dmabuf->tail = 0;
 
     // Initialize desc
     desc = dmabuf->db_desc;
     desc_p = (unsigned long) dmabuf->db_desc_p;
     byte_cnt = ATH_I2S_NUM_DESC * ATH_I2S_BUFF_SIZE;
-    tail = dmabuf->tail;
+    tail = 0;
 
     while (byte_cnt && (tail < ATH_I2S_NUM_DESC)) {
         desc[tail].rsvd1 = 0;
@@ -256,7 +294,8 @@ int ath_i2s_init_desc(struct file *filp)
     tail--;
     desc[tail].NextPtr = desc_p;
 
-    dmabuf->tail = 0;
+    dmabuf->ring.desc = desc;
+    i2s_ring_reset(&dmabuf->ring, mode & FMODE_READ);
 
     return 0;
 
@@ -271,11 +310,13 @@ fail3:
                       dmabuf->db_desc, dmabuf->db_desc_p);
     if (mode & FMODE_READ) {
         if (sc->sc_rmall_buf) {
-            kfree(sc->sc_rmall_buf);
+            free_pages((unsigned long) sc->sc_rmall_buf, ATH_I2S_BUF_ORDER);
+            sc->sc_rmall_buf = NULL;
         }
     } else {
         if (sc->sc_pmall_buf) {
-            kfree(sc->sc_pmall_buf);
+            free_pages((unsigned long) sc->sc_pmall_buf, ATH_I2S_BUF_ORDER);
+            sc->sc_pmall_buf = NULL;
         }
     }
 
@@ -306,9 +347,6 @@ int ath_i2s_open(struct inode *inode, struct file *filp)
     ath_i2s_softc_t *sc = &sc_buf_var;
     int opened = 0, mode = MASTER;
 
-    written_samples = 0;
-    num_outstanding = 0;
-
     if (filp && (filp->f_mode & FMODE_READ) && (sc->ropened)) {
         printk("%s, %d I2S mic busy\n", __func__, __LINE__);
         return -EBUSY;
@@ -318,6 +356,12 @@ int ath_i2s_open(struct inode *inode, struct file *filp)
         return -EBUSY;
     }
 
+    // Opening the mic must not lose track of a speaker that's playing
+    if (!filp || (filp->f_mode & FMODE_WRITE)) {
+        written_samples = 0;
+        played_samples = 0;
+    }
+
     opened = (sc->ropened | sc->popened);
 
     /* Reset MBOX FIFO's */
@@ -349,73 +393,146 @@ int ath_i2s_open(struct inode *inode, struct file *filp)
     return (0);
 }
 
+/*
+ * Turns a direction's xrun interrupt (playback underflow, record overflow)
+ * on or off. The condition stays up for as long as the DMA is starved, so
+ * the interrupt turns it off once counted, and starting or resuming the DMA
+ * turns it back on: a stall is counted once however long it lasts.
+ */
+static void ath_i2s_xrun_irq(int mode, int on)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    uint32_t xrun = mode ? ATH_MBOX_TX_OVERFLOW : ATH_MBOX_RX_UNDERFLOW;
+
+    I2S_LOCK(sc);
+    if (on) {
+        // Not one left over from before
+        ath_reg_wr(ATH_MBOX_INT_STATUS, xrun);
+        ath_reg_rmw_set(ATH_MBOX_INT_ENABLE, xrun);
+    } else {
+        ath_reg_rmw_clear(ATH_MBOX_INT_ENABLE, xrun);
+    }
+    I2S_UNLOCK(sc);
+}
+
+/*
+ * The first read, write or mmap commit in a direction turns its DMA complete
+ * and xrun interrupts on. Returns true if the DMA still has to be started.
+ */
+static int ath_i2s_first_use(int mode)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    int need_start = 0;
+
+    if (mode) {
+        if (sc->ropened < 2) {
+            ath_reg_rmw_set(ATH_MBOX_INT_ENABLE, ATH_MBOX_TX_DMA_COMPLETE);
+            ath_i2s_xrun_irq(mode, 1);
+            need_start = 1;
+        }
+        sc->ropened = 2;
+    } else {
+        if (sc->popened < 2) {
+            ath_reg_rmw_set(ATH_MBOX_INT_ENABLE, ATH_MBOX_RX_DMA_COMPLETE);
+            ath_i2s_xrun_irq(mode, 1);
+            need_start = 1;
+        }
+        sc->popened = 2;
+    }
+
+    return need_start;
+}
+
+/*
+ * Let the DMA at what was just queued from descriptor first on: the first
+ * time it's pointed at the ring and started, after that a resume picks up
+ * where it ran out, unless user space has it paused.
+ */
+static void ath_i2s_kick(int mode, int first, int need_start)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_dma_buf_t *dmabuf = mode ? &sc->sc_rbuf : &sc->sc_pbuf;
+
+    if (need_start) {
+        ath_i2s_dma_desc((unsigned long) dmabuf->db_desc_p +
+                         first * sizeof(ath_mbox_dma_desc), mode);
+        ath_i2s_dma_start(mode);
+    } else if (!(mode ? sc->rpause : sc->ppause)) {
+        ath_i2s_xrun_irq(mode, 1);
+        ath_i2s_dma_resume(mode);
+    }
+}
+
+/*
+ * Playback: hand the descriptor at tail to the DMA, remembering when for
+ * the latency histogram.
+ */
+static void ath_i2s_give(ath_i2s_softc_t *sc, i2s_dma_buf_t *dmabuf, unsigned int length)
+{
+    i2s_ring_t *ring = &dmabuf->ring;
+
+    ring->desc[ring->tail].BufPtr = (unsigned int) dmabuf->db_buf[ring->tail].bf_paddr;
+
+    // The interrupt counts these back down as they play
+    I2S_LOCK(sc);
+    dmabuf->given[ring->tail] = ktime_get();
+    i2s_ring_give(ring, length);
+    if (ring->outstanding > telemetry.outstanding_max)
+        telemetry.outstanding_max = ring->outstanding;
+    I2S_UNLOCK(sc);
+}
+
 ssize_t ath_i2s_read(struct file * filp, char __user * buf,
                      size_t count, loff_t * f_pos)
 {
-#define prev_tail(t) ({ (t == 0) ? (ATH_I2S_NUM_DESC - 1) : (t - 1); })
-#define next_tail(t) ({ (t == (ATH_I2S_NUM_DESC - 1)) ? 0 : (t + 1); })
-
-    uint8_t *data;
     ssize_t retval;
     struct ath_i2s_softc *sc = &sc_buf_var;
     i2s_dma_buf_t *dmabuf = &sc->sc_rbuf;
+    i2s_ring_t *ring = &dmabuf->ring;
     i2s_buf_t *scbuf;
-    ath_mbox_dma_desc *desc;
-    unsigned int byte_cnt, mode = 1, offset = 0, tail = dmabuf->tail;
-    unsigned long desc_p;
-    int need_start = 0;
+    unsigned int byte_cnt, length, mode = 1, offset = 0;
+    int first = ring->tail;
+    int need_start;
 
     byte_cnt = count;
 
-    if (sc->ropened < 2) {
-        ath_reg_rmw_set(ATH_MBOX_INT_ENABLE, ATH_MBOX_TX_DMA_COMPLETE);
-        need_start = 1;
-    }
-
-    sc->ropened = 2;
+    need_start = ath_i2s_first_use(mode);
 
     scbuf = dmabuf->db_buf;
-    desc = dmabuf->db_desc;
-    desc_p = (unsigned long) dmabuf->db_desc_p;
-    data = scbuf[0].bf_vaddr;
-
-    desc_p += tail * sizeof(ath_mbox_dma_desc);
 
 #ifndef AOW
     if (!need_start) {
-        wait_event_interruptible(sc->wq_tx, desc[tail].OWN != 1);
+        if (!i2s_ring_avail(ring, 1) && filp && (filp->f_flags & O_NONBLOCK)) {
+            return -EAGAIN;
+        }
+        if (!i2s_ring_avail(ring, 1)) {
+            telemetry.record_sleeps++;
+            wait_event_interruptible(sc->wq_tx, i2s_ring_avail(ring, 1));
+        }
     }
 #endif
 
-    while (byte_cnt && !desc[tail].OWN) {
-        if (byte_cnt >= ATH_I2S_BUFF_SIZE) {
-            desc[tail].length = ATH_I2S_BUFF_SIZE;
-            byte_cnt -= ATH_I2S_BUFF_SIZE;
-        } else {
-            desc[tail].length = byte_cnt;
-            byte_cnt = 0;
-        }
-        dma_cache_sync(NULL, scbuf[tail].bf_vaddr, desc[tail].length, DMA_FROM_DEVICE);
-        retval = copy_to_user(buf + offset, scbuf[tail].bf_vaddr,
-                              ATH_I2S_BUFF_SIZE);
+    while (byte_cnt && i2s_ring_avail(ring, 1)) {
+        // A short read still uses up the whole buffer, the rest is dropped
+        length = byte_cnt >= ATH_I2S_BUFF_SIZE ? ATH_I2S_BUFF_SIZE : byte_cnt;
+        byte_cnt -= length;
+
+        dma_cache_sync(NULL, scbuf[ring->tail].bf_vaddr, length, DMA_FROM_DEVICE);
+        retval = copy_to_user(buf + offset, scbuf[ring->tail].bf_vaddr, length);
         if (retval)
-            return retval;
-        desc[tail].BufPtr = (unsigned int) scbuf[tail].bf_paddr;
-        desc[tail].OWN = 1;
+            return -EFAULT;
+        ring->desc[ring->tail].BufPtr = (unsigned int) scbuf[ring->tail].bf_paddr;
+        i2s_ring_recycle(ring);
 
-        tail = next_tail(tail);
-        offset += ATH_I2S_BUFF_SIZE;
+        offset += length;
     }
 
-    dmabuf->tail = tail;
-
-    if (need_start) {
-        ath_i2s_dma_desc((unsigned long) desc_p, mode);
-        if (filp) {
-            ath_i2s_dma_start(mode);
-        }
-    } else if (!sc->rpause) {
-        ath_i2s_dma_resume(mode);
+    if (need_start && !filp) {
+        // A driver user gets the DMA pointed at the ring, but starts it itself
+        ath_i2s_dma_desc((unsigned long) dmabuf->db_desc_p +
+                         first * sizeof(ath_mbox_dma_desc), mode);
+    } else {
+        ath_i2s_kick(mode, first, need_start);
     }
 
     return offset;
@@ -426,85 +543,57 @@ ssize_t ath_i2s_read(struct file * filp, char __user * buf,
 ssize_t ath_i2s_wr(struct file * filp, const char __user * buf,
              size_t count, loff_t * f_pos, int resume)
 {
-#define prev_tail(t) ({ (t == 0) ? (ATH_I2S_NUM_DESC - 1) : (t - 1); })
-#define next_tail(t) ({ (t == (ATH_I2S_NUM_DESC - 1)) ? 0 : (t + 1); })
-
     //printk("ATH_I2S_WR\n");
-    uint8_t *data;
     ssize_t retval;
-    int byte_cnt, offset, need_start = 0;
+    int byte_cnt, offset, need_start;
+    unsigned int length;
     int mode = 0;
     struct ath_i2s_softc *sc = &sc_buf_var;
     i2s_dma_buf_t *dmabuf = &sc->sc_pbuf;
+    i2s_ring_t *ring = &dmabuf->ring;
     i2s_buf_t *scbuf;
-    ath_mbox_dma_desc *desc;
-    int tail = dmabuf->tail;
-    unsigned long desc_p;
+    int first = ring->tail;
 
     byte_cnt = count;
 
-    if (sc->popened < 2) {
-        ath_reg_rmw_set(ATH_MBOX_INT_ENABLE, ATH_MBOX_RX_DMA_COMPLETE);
-        need_start = 1;
-    }
-
-    sc->popened = 2;
+    need_start = ath_i2s_first_use(mode);
 
     scbuf = dmabuf->db_buf;
-    desc = dmabuf->db_desc;
-    desc_p = (unsigned long) dmabuf->db_desc_p;
     offset = 0;
-    data = scbuf[0].bf_vaddr;
-
-    desc_p += tail * sizeof(ath_mbox_dma_desc);
 
 #ifndef AOW
     if (!need_start) {
-        retval = wait_event_interruptible(sc->wq_rx, desc[tail].OWN != 1);
-        if (retval == -ERESTARTSYS) {
-            return -ERESTART;
+        if (!i2s_ring_avail(ring, 1) && filp && (filp->f_flags & O_NONBLOCK)) {
+            return -EAGAIN;
+        }
+        if (!i2s_ring_avail(ring, 1)) {
+            telemetry.play_sleeps++;
+            retval = wait_event_interruptible(sc->wq_rx, i2s_ring_avail(ring, 1));
+            if (retval == -ERESTARTSYS) {
+                return -ERESTART;
+            }
         }
     }
 #endif
 
-    while (byte_cnt && !desc[tail].OWN) {
-        if (byte_cnt >= ATH_I2S_BUFF_SIZE) {
-            desc[tail].length = ATH_I2S_BUFF_SIZE;
-            byte_cnt -= ATH_I2S_BUFF_SIZE;
-        } else {
-            desc[tail].length = byte_cnt;
-            byte_cnt = 0;
-        }
+    while (byte_cnt && i2s_ring_avail(ring, 1)) {
+        length = byte_cnt >= ATH_I2S_BUFF_SIZE ? ATH_I2S_BUFF_SIZE : byte_cnt;
+        byte_cnt -= length;
 #ifdef USE_MEMCPY
-        memcpy(scbuf[tail].bf_vaddr, buf + offset, ATH_I2S_BUFF_SIZE);
+        memcpy(scbuf[ring->tail].bf_vaddr, buf + offset, length);
 #else
-        retval = copy_from_user(scbuf[tail].bf_vaddr, buf + offset,
-                                ATH_I2S_BUFF_SIZE);
+        retval = copy_from_user(scbuf[ring->tail].bf_vaddr, buf + offset,
+                                length);
         if (retval)
-            return retval;
+            return -EFAULT;
 #endif
-        dma_cache_sync(NULL, scbuf[tail].bf_vaddr, desc[tail].length, DMA_TO_DEVICE);
-        desc[tail].BufPtr = (unsigned int) scbuf[tail].bf_paddr;
-        desc[tail].OWN = 1;
+        dma_cache_sync(NULL, scbuf[ring->tail].bf_vaddr, length, DMA_TO_DEVICE);
 
-        tail = next_tail(tail);
-        offset += ATH_I2S_BUFF_SIZE;
-        num_outstanding++;
-        if (num_outstanding > 1) {
-            //printk("OUTSTANDING: %d\n", num_outstanding);
-        }
+        offset += length;
+        ath_i2s_give(sc, dmabuf, length);
     }
 
-    dmabuf->tail = tail;
-
-    if (need_start) {
-//        printk("I2S STARTING\n");
-        ath_i2s_dma_desc((unsigned long) desc_p, mode);
-        ath_i2s_dma_start(mode);
-    } else if (!sc->ppause) {
-//        printk("I2S RESUMING\n");
-        ath_i2s_dma_resume(mode);
-    }
+    ath_i2s_kick(mode, first, need_start);
 
     return count - byte_cnt;
 }
@@ -576,20 +665,23 @@ ssize_t ath_i2s_write(struct file * filp, const char __user * buf,
 //        if( myVectCnt >= (myTestVectSz *2) ) myVectCnt = 0;
 //    }
 //#endif
-eagain:
     tmpcount = count;
     data = (char *) buf;
     ret = 0;
 
     do {
-        ret = ath_i2s_wr(NULL, data, tmpcount, NULL, 1);
+        ret = ath_i2s_wr(filp, data, tmpcount, NULL, 1);
         cnt++;
         if (ret == -ERESTART) {
             return ret;
         }
-        if (ret == EAGAIN) {
-            printk("%s:%d %d\n", __func__, __LINE__, ret);
-            goto eagain;
+        if (ret == -EAGAIN) {
+            // Non-blocking and every descriptor is queued, report
+            // however much made it in before that.
+            if (tmpcount == count) {
+                return ret;
+            }
+            break;
         }
 
 
@@ -611,11 +703,260 @@ eagain:
 
     // TODO: assert count is evenly divisible by sample size at the top
     // of this function.
-    written_samples += count / (num_channels * i2s_word_bytes);
+    written_samples += (count - tmpcount) / (num_channels * i2s_word_bytes);
+
+    return count - tmpcount;
+}
+
+
+unsigned int ath_i2s_poll(struct file *filp, poll_table *wait)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_dma_buf_t *dmabuf;
+    unsigned int mask = 0;
+
+    // The DMA complete interrupt wakes these queues as descriptors
+    // come back from the hardware.
+    if (filp->f_mode & FMODE_READ) {
+        dmabuf = &sc->sc_rbuf;
+        poll_wait(filp, &sc->wq_tx, wait);
+        // Until the first read starts the DMA there is nothing to wait
+        // for, the read itself kicks it off.
+        if (sc->ropened < 2 || i2s_ring_avail(&dmabuf->ring, 1)) {
+            mask |= POLLIN | POLLRDNORM;
+        }
+    } else {
+        dmabuf = &sc->sc_pbuf;
+        poll_wait(filp, &sc->wq_rx, wait);
+        if (sc->popened < 2 || i2s_ring_avail(&dmabuf->ring, 1)) {
+            mask |= POLLOUT | POLLWRNORM;
+        }
+    }
 
-    return count;
+    return mask;
 }
 
+/*
+ * Called from the interrupt, as descriptors come back from the DMA.
+ */
+void ath_i2s_count_played(ath_i2s_softc_t *sc)
+{
+    i2s_dma_buf_t *dmabuf = &sc->sc_pbuf;
+    i2s_ring_t *ring = &dmabuf->ring;
+    int j = ring->done;
+    int n = ring->outstanding;
+    ktime_t now = ktime_get();
+    s64 ms;
+
+    played_samples += i2s_ring_reap(ring) / (num_channels * i2s_word_bytes);
+    n -= ring->outstanding;
+
+    if (n > 0 && ring->outstanding == 0)
+        telemetry.play_dry++;
+
+    for (; n > 0; n--, j = i2s_ring_next(j)) {
+        ms = ktime_to_ms(ktime_sub(now, dmabuf->given[j]));
+        if (ms >= 1 << (I2S_LATENCY_BUCKETS - 2))
+            telemetry.latency[I2S_LATENCY_BUCKETS - 1]++;
+        else
+            telemetry.latency[fls((int) ms)]++;
+    }
+}
+
+/*
+ * Wait until the speaker has played everything written to it.
+ */
+int ath_i2s_drain(struct file *filp)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+
+    if (!filp || !(filp->f_mode & FMODE_WRITE))
+        return -EINVAL;
+
+    if (sc->sc_pbuf.ring.outstanding == 0)
+        return 0;
+
+    // A paused speaker would never get there
+    if (sc->ppause)
+        return -EBUSY;
+
+    if (filp->f_flags & O_NONBLOCK)
+        return -EAGAIN;
+
+#ifndef AOW
+    return wait_event_interruptible(sc->wq_rx, sc->sc_pbuf.ring.outstanding == 0);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Reset one direction without closing the device. Like close, playback
+ * that isn't paused is allowed to finish first, pause it to throw the
+ * queued audio away. The DMA is left stopped with the descriptors back in
+ * their just-opened state, so the next read or write restarts it from
+ * desc 0.
+ */
+int ath_i2s_flush(int mode)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_dma_buf_t *dmabuf;
+    ath_mbox_dma_desc *desc;
+    int j;
+
+    if (mode) {
+        if (!sc->ropened)
+            return -EINVAL;
+        dmabuf = &sc->sc_rbuf;
+    } else {
+        if (!sc->popened)
+            return -EINVAL;
+        dmabuf = &sc->sc_pbuf;
+    }
+
+    desc = dmabuf->db_desc;
+
+#ifndef AOW
+    if (!mode && sc->popened == 2 && !sc->ppause) {
+        for (j = 0; j < ATH_I2S_NUM_DESC; j++) {
+            if (wait_event_interruptible(sc->wq_rx, desc[j].OWN != 1))
+                return -ERESTARTSYS;
+        }
+    }
+#endif
+
+    ath_i2s_dma_pause(mode);
+    ath_i2s_xrun_irq(mode, 0);
+
+    /* Record descriptors wait in the hardware's hands for data */
+    I2S_LOCK(sc);
+    i2s_ring_reset(&dmabuf->ring, mode);
+    I2S_UNLOCK(sc);
+
+    if (mode) {
+        sc->ropened = 1;
+        sc->rpause = 0;
+#ifndef AOW
+        wake_up_interruptible(&sc->wq_tx);
+#endif
+    } else {
+        sc->popened = 1;
+        sc->ppause = 0;
+        I2S_LOCK(sc);
+        // Whatever was thrown away was never played
+        written_samples = played_samples;
+        I2S_UNLOCK(sc);
+#ifndef AOW
+        wake_up_interruptible(&sc->wq_rx);
+#endif
+    }
+
+    return 0;
+}
+
+
+/*
+ * Map the descriptor buffers of the direction the device was opened for.
+ * The mapping is uncached, so nothing has to be flushed between user space
+ * and the DMA, and the cache can't alias the kernel's view of the pages.
+ */
+int ath_i2s_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    char *buf = (filp->f_mode & FMODE_READ) ? sc->sc_rmall_buf : sc->sc_pmall_buf;
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if (!buf)
+        return -ENODEV;
+
+    if (vma->vm_pgoff || size > (PAGE_SIZE << ATH_I2S_BUF_ORDER))
+        return -EINVAL;
+
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(buf) >> PAGE_SHIFT,
+                           size, vma->vm_page_prot);
+}
+
+int ath_i2s_mmap_status(struct file *filp, struct i2s_mmap_status __user *arg)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_ring_t *ring = (filp->f_mode & FMODE_READ) ? &sc->sc_rbuf.ring : &sc->sc_pbuf.ring;
+    struct i2s_mmap_status status;
+
+    status.tail = ring->tail;
+    status.avail = i2s_ring_avail(ring, ATH_I2S_NUM_DESC);
+    status.periods = ATH_I2S_NUM_DESC;
+    status.period_bytes = ATH_I2S_BUFF_SIZE;
+
+    return copy_to_user(arg, &status, sizeof(status)) ? -EFAULT : 0;
+}
+
+/*
+ * Playback: the n periods from tail on have been filled through the
+ * mapping, give them to the DMA. They must all be free, which poll() and
+ * I2S_MMAP_STATUS tell.
+ */
+int ath_i2s_mmap_commit(struct file *filp, int n)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_dma_buf_t *dmabuf = &sc->sc_pbuf;
+    i2s_ring_t *ring = &dmabuf->ring;
+    int first = ring->tail;
+    int need_start, j, err;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EINVAL;
+
+    if ((err = i2s_ring_mmap_check(ring, n)) != 0)
+        return err;
+
+    if (n == 0)
+        return 0;
+
+    need_start = ath_i2s_first_use(0);
+
+    for (j = 0; j < n; j++) {
+        ath_i2s_give(sc, dmabuf, ATH_I2S_BUFF_SIZE);
+    }
+
+    written_samples += n * ATH_I2S_BUFF_SIZE / (num_channels * i2s_word_bytes);
+
+    ath_i2s_kick(0, first, need_start);
+
+    return 0;
+}
+
+/*
+ * Record: the n periods from tail on have been read through the mapping,
+ * hand them back to the DMA. The first consume, even of 0, starts recording.
+ */
+int ath_i2s_mmap_consume(struct file *filp, int n)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    i2s_dma_buf_t *dmabuf = &sc->sc_rbuf;
+    i2s_ring_t *ring = &dmabuf->ring;
+    int first = ring->tail;
+    int need_start, j;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EINVAL;
+
+    // consuming periods that haven't been recorded yet is a caller bug, not a wait
+    if (i2s_ring_mmap_check(ring, n) != 0)
+        return -EINVAL;
+
+    need_start = ath_i2s_first_use(1);
+
+    for (j = 0; j < n; j++) {
+        ring->desc[ring->tail].BufPtr = (unsigned int) dmabuf->db_buf[ring->tail].bf_paddr;
+        i2s_ring_recycle(ring);
+    }
+
+    ath_i2s_kick(1, first, need_start);
+
+    return 0;
+}
 
 int ath_i2s_close(struct inode *inode, struct file *filp)
 {
@@ -661,14 +1002,18 @@ int ath_i2s_close(struct inode *inode, struct file *filp)
     }
 
     if (mode & FMODE_READ) {
-        kfree(sc->sc_rmall_buf);
+        free_pages((unsigned long) sc->sc_rmall_buf, ATH_I2S_BUF_ORDER);
+        sc->sc_rmall_buf = NULL;
     } else {
-        kfree(sc->sc_pmall_buf);
+        free_pages((unsigned long) sc->sc_pmall_buf, ATH_I2S_BUF_ORDER);
+        sc->sc_pmall_buf = NULL;
     }
     dma_free_coherent(NULL,
                       ATH_I2S_NUM_DESC * sizeof(ath_mbox_dma_desc),
                       dmabuf->db_desc, dmabuf->db_desc_p);
 
+    ath_i2s_xrun_irq(mode & FMODE_READ ? 1 : 0, 0);
+
     if (mode & FMODE_READ) {
         sc->ropened = 0;
         sc->rpause = 0;
@@ -845,6 +1190,8 @@ long ath_i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     case I2S_PAUSE:
         data = arg;
         ath_i2s_dma_pause(data);
+        // Starving it on purpose isn't an xrun
+        ath_i2s_xrun_irq(data, 0);
         if (data) {
             sc->rpause = 1;
         } else {
@@ -853,6 +1200,8 @@ long ath_i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         return 0;
     case I2S_RESUME:
         data = arg;
+        if ((data ? sc->ropened : sc->popened) == 2)
+            ath_i2s_xrun_irq(data, 1);
         ath_i2s_dma_resume(data);
         if (data) {
             sc->rpause = 0;
@@ -860,6 +1209,8 @@ long ath_i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             sc->ppause = 0;
         }
         return 0;
+    case I2S_FLUSH:
+        return ath_i2s_flush(arg);
     case I2S_VOLUME:
         sc->vol = arg;
         ath_i2s_set_volume(sc->vol);
@@ -890,7 +1241,26 @@ long ath_i2s_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         /*Otherwise default settings. Nothing to do */
         return 0;
     case I2S_COUNT:
-        data = arg;
+        // Samples the DMA has played since the speaker was opened
+        return put_user(played_samples, (uint32_t __user *) arg);
+
+    case I2S_DRAIN:
+        return ath_i2s_drain(filp);
+
+    case I2S_MMAP_STATUS:
+        return ath_i2s_mmap_status(filp, (struct i2s_mmap_status __user *) arg);
+
+    case I2S_MMAP_COMMIT:
+        return ath_i2s_mmap_commit(filp, arg);
+
+    case I2S_MMAP_CONSUME:
+        return ath_i2s_mmap_consume(filp, arg);
+
+    case I2S_STATS:
+        return ath_i2s_stats((struct i2s_telemetry __user *) arg);
+
+    case I2S_STATS_CLEAR:
+        ath_i2s_stats_clear();
         return 0;
 
     case I2S_CLEAR_OUT_SAMPLE_COUNT:
@@ -938,18 +1308,24 @@ irqreturn_t ath_i2s_intr(int irq, void *dev_id, struct pt_regs *regs)
 
 #ifndef AOW
     if (r & ATH_MBOX_RX_DMA_COMPLETE) {
+        telemetry.play_completes++;
+        ath_i2s_count_played(sc);
         wake_up_interruptible(&sc->wq_rx);
-        num_outstanding--;
     }
     if (r & ATH_MBOX_TX_DMA_COMPLETE) {
+        telemetry.record_completes++;
         wake_up_interruptible(&sc->wq_tx);
     }
 #endif
+    // Off until the DMA is started or resumed again, see ath_i2s_xrun_irq()
     if (r & ATH_MBOX_RX_UNDERFLOW) {
-//        printk("audio dma rx underflow\n");
+        telemetry.underruns++;
+        stats.rx_underflow++;
+        ath_reg_rmw_clear(ATH_MBOX_INT_ENABLE, ATH_MBOX_RX_UNDERFLOW);
     }
     if (r & ATH_MBOX_TX_OVERFLOW) {
-//        printk("audio dma tx underflow\n");
+        telemetry.overruns++;
+        ath_reg_rmw_clear(ATH_MBOX_INT_ENABLE, ATH_MBOX_TX_OVERFLOW);
     }
 
     /* Ack the interrupts */
@@ -1169,11 +1545,56 @@ loff_t ath_i2s_llseek(struct file *filp, loff_t off, int whence)
 }
 
 
+/*
+ * /proc/ath_i2s, the telemetry as "name value" lines.
+ */
+static int ath_i2s_proc_show(struct seq_file *m, void *v)
+{
+    ath_i2s_softc_t *sc = &sc_buf_var;
+    struct i2s_telemetry copy;
+    int j;
+
+    I2S_LOCK(sc);
+    telemetry.outstanding = sc->sc_pbuf.ring.outstanding;
+    copy = telemetry;
+    I2S_UNLOCK(sc);
+
+    seq_printf(m, "underruns %u\n", copy.underruns);
+    seq_printf(m, "overruns %u\n", copy.overruns);
+    seq_printf(m, "play_dry %u\n", copy.play_dry);
+    seq_printf(m, "play_completes %u\n", copy.play_completes);
+    seq_printf(m, "record_completes %u\n", copy.record_completes);
+    seq_printf(m, "play_sleeps %u\n", copy.play_sleeps);
+    seq_printf(m, "record_sleeps %u\n", copy.record_sleeps);
+    seq_printf(m, "outstanding %u\n", copy.outstanding);
+    seq_printf(m, "outstanding_max %u\n", copy.outstanding_max);
+    for (j = 0; j < I2S_LATENCY_BUCKETS - 1; j++)
+        seq_printf(m, "latency_under_%ums %u\n", 1 << j, copy.latency[j]);
+    seq_printf(m, "latency_over_%ums %u\n", 1 << (j - 1), copy.latency[j]);
+
+    return 0;
+}
+
+static int ath_i2s_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ath_i2s_proc_show, NULL);
+}
+
+static const struct file_operations ath_i2s_proc_fops = {
+    .owner   = THIS_MODULE,
+    .open    = ath_i2s_proc_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 struct file_operations ath_i2s_fops = {
     .owner   = THIS_MODULE,
     .llseek  = ath_i2s_llseek,
     .read    = ath_i2s_read,
     .write   = ath_i2s_write,
+    .poll    = ath_i2s_poll,
+    .mmap    = ath_i2s_mmap,
     .unlocked_ioctl   = ath_i2s_ioctl,
     .open    = ath_i2s_open,
     .release = ath_i2s_close,
@@ -1185,6 +1606,7 @@ void ath_i2s_cleanup_module(void)
 
     printk(KERN_CRIT "unregister\n");
 
+    remove_proc_entry("ath_i2s", NULL);
     free_irq(sc->sc_irq, NULL);
     unregister_chrdev(ath_i2s_major, "ath_i2s");
 }
@@ -1225,6 +1647,10 @@ int ath_i2s_init_module(void)
 
     I2S_LOCK_INIT(&sc_buf_var);
 
+    if (!proc_create("ath_i2s", S_IRUGO, NULL, &ath_i2s_proc_fops)) {
+        printk(KERN_WARNING "ath_i2s: can't create /proc/ath_i2s\n");
+    }
+
     return 0;        /* succeed */
 }
 
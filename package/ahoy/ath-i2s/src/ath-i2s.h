@@ -31,8 +31,6 @@
 #define MBOX_INTR_MASK              (1ul << 7)
 
 #define MONO                    	(1ul << 14)
-#define ATH_I2S_NUM_DESC            128
-#define ATH_I2S_BUFF_SIZE           768
 
 #define ATH_AUDIO_PLL_CFG_PWR_DWN   (1ul << 5)
 
@@ -192,26 +190,51 @@ struct i2s_sync {
 #define I2S_MCLK        _IOR('N', 0x28, int)
 #define I2S_CLEAR_OUT_SAMPLE_COUNT _IOWR('N', 0x29, uint32_t*)
 #define I2S_GET_SYNC    _IOWR('N', 0x2a, struct i2s_sync*)
+#define I2S_FLUSH       _IOW('N', 0x2b, int)
+#define I2S_DRAIN       _IO('N', 0x2c)
 
-typedef struct {
-	unsigned int OWN		:  1,    /* bit 00 */
-	             EOM		:  1,    /* bit 01 */
-	             rsvd1	    :  6,    /* bit 07-02 */
-	             size	    : 12,    /* bit 19-08 */
-	             length	    : 12,    /* bit 31-20 */
-	             rsvd2	    :  4,    /* bit 00 */
-	             BufPtr	    : 28,    /* bit 00 */
-	             rsvd3	    :  4,    /* bit 00 */
-	             NextPtr	: 28;    /* bit 00 */
-#ifdef SPDIF
-    unsigned int Va[6];
-    unsigned int Ua[6];
-    unsigned int Ca[6];
-    unsigned int Vb[6];
-    unsigned int Ub[6];
-    unsigned int Cb[6];
-#endif
-} ath_mbox_dma_desc;
+/*
+ * mmap: the descriptor buffers of the direction the device was opened for,
+ * ATH_I2S_NUM_DESC periods of ATH_I2S_BUFF_SIZE bytes, period n at offset
+ * n * ATH_I2S_BUFF_SIZE.  Playback fills the free periods from tail on and
+ * commits them, record reads the filled ones from tail on and consumes them.
+ * poll() says when there are periods available.
+ */
+struct i2s_mmap_status {
+    uint32_t tail;          /* the period the next commit or consume starts at */
+    uint32_t avail;         /* periods from tail on that are free to fill, or filled to read */
+    uint32_t periods;       /* ATH_I2S_NUM_DESC */
+    uint32_t period_bytes;  /* ATH_I2S_BUFF_SIZE */
+};
+
+#define I2S_MMAP_STATUS     _IOR('N', 0x2d, struct i2s_mmap_status)
+#define I2S_MMAP_COMMIT     _IOW('N', 0x2e, int)
+#define I2S_MMAP_CONSUME    _IOW('N', 0x2f, int)
+
+/*
+ * Telemetry, always on, for telling a glitch caused by user space not
+ * keeping up from one in the driver. Also in /proc/ath_i2s.
+ */
+#define I2S_LATENCY_BUCKETS 12
+
+struct i2s_telemetry {
+    uint32_t underruns;         /* playback DMA underflows, one per stall */
+    uint32_t overruns;          /* record DMA overflows, one per stall */
+    uint32_t play_dry;          /* times every queued descriptor played, ends of playback included */
+    uint32_t play_completes;    /* playback DMA complete interrupts */
+    uint32_t record_completes;  /* record DMA complete interrupts */
+    uint32_t play_sleeps;       /* writes that waited for a free descriptor */
+    uint32_t record_sleeps;     /* reads that waited for a full one */
+    uint32_t outstanding;       /* playback descriptors queued now */
+    uint32_t outstanding_max;   /* and the most queued at once */
+    /* write to played, bucket n under 2^n ms, the last one everything longer */
+    uint32_t latency[I2S_LATENCY_BUCKETS];
+};
+
+#define I2S_STATS           _IOR('N', 0x30, struct i2s_telemetry)
+#define I2S_STATS_CLEAR     _IO('N', 0x31)
+
+#include "ath-i2s-ring.h"
 
 /*
  * XXX : This is the interface between i2s and wlan
@@ -233,7 +256,8 @@ typedef struct i2s_dma_buf {
     ath_mbox_dma_desc *db_desc;
     dma_addr_t db_desc_p;
     i2s_buf_t db_buf[ATH_I2S_NUM_DESC];
-    int tail;
+    i2s_ring_t ring;
+    ktime_t given[ATH_I2S_NUM_DESC];    /* playback: when each went to the DMA */
 } i2s_dma_buf_t;
 
 typedef struct ath_i2s_softc {
@@ -260,4 +284,5 @@ typedef struct ath_i2s_softc {
 
 ath_i2s_softc_t sc_buf_var;
 i2s_stats_t stats;
+struct i2s_telemetry telemetry;
 
@@ -13,71 +13,85 @@
 #include <errno.h>
 #include <sys/signal.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/sem.h>
-#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
-#include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "i2sio.h"
 
 #define BUFF_SIZE	(NUM_DESC * I2S_BUF_SIZE)
+#define RING_SLOTS	64	/* buffers between the file and the device */
 
-typedef struct {
-	u_int	data_chunk;	/* 'data' */
-	u_int	data_length;	/* samplecount (lenth of rest of block?) */
-} scdata_t;
+/* Recordings are 16 bit stereo at this rate, which is what the header says */
+#define REC_FQ		44100
+#define REC_SECONDS	15
 
+/* What the chunk walker found in a wav file */
 typedef struct {
-	u_int		main_chunk;	/* 'RIFF' */
-	u_int		length;		/* Length of rest of file */
-	u_int		chunk_type;	/* 'WAVE' */
-	u_int		sub_chunk;	/* 'fmt ' */
-	u_int		sc_len;		/* length of sub_chunk */
-	u_short		format;		/* should be 1 for PCM-code */
+	u_short		format;		/* 1 for PCM-code */
 	u_short		modus;		/* 1 Mono, 2 Stereo */
 	u_int		sample_fq;	/* frequence of sample */
 	u_int		byte_p_sec;
-	u_short		byte_p_spl;	/* samplesize; 1 or 2 bytes */
+	u_short		byte_p_spl;	/* bytes per sample, all channels */
 	u_short		bit_p_spl;	/* 8, 12 or 16 bit */
-	/*
-	 * FIXME:
-	 * Apparently, two different formats exist.
-	 * One with a sub chunk length of 16 and another of length 18.
-	 * For the one with 18, there are two bytes here.  Don't know
-	 * what they mean.  For the other type (i.e. length 16) this
-	 * does not exist.
-	 *
-	 * To handle the above issue, some jugglery is done after we
-	 * read the header
-	 *		-Varada (Wed Apr 25 14:53:02 PDT 2007)
-	 */
-	u_char		pad[2];
-	scdata_t	sc;
-} __attribute__((packed)) wavhead_t;
+	u_int		data_length;	/* bytes of audio, 0 to play to the end */
+} wavinfo_t;
+
+/*
+ * Single producer, single consumer ring of buffers between the thread
+ * reading the file and the one writing the device.  Each side only moves
+ * its own index, so handing a buffer over takes no lock.  A side that finds
+ * the ring full (reader) or empty (writer) sleeps on its semaphore, and the
+ * other side only posts it if it's actually asleep.
+ */
+#define RING_READER	0
+#define RING_WRITER	1
+
+typedef struct {
+	char		*buf;		/* slots * bufsz bytes */
+	int		*len;		/* bytes in each slot, 0 ends the stream */
+	u_int		slots;
+	volatile u_int	head;		/* slots the reader has filled */
+	volatile u_int	tail;		/* slots the writer has played */
+	volatile int	done;		/* the reader has pushed its last slot */
+	volatile int	sleeping[2];
+	sem_t		wake[2];
+	u_int		stalls[2];	/* times each side had to wait for the other */
+	double		longest[2];	/* and the longest wait, in seconds */
+} ring_t;
+
+typedef struct {
+	ring_t		ring;
+	int		fd;
+	int		limited;	/* the data chunk gave a length */
+	u_int		length;		/* bytes of it left to read */
+	volatile int	stop;		/* the writer has given up */
+	int		error;
+} player_t;
 
 char *audev = "/dev/i2s";
 int audio, bufsz, fine, dbg, recorder = 0;
 int loop = 0;
+int bench = 0;			/* the device is a file or fifo stand-in */
+int use_mmap = 0;		/* read the file straight into the device's buffers */
+int slots = RING_SLOTS;
+int rec_seconds = REC_SECONDS;
+volatile sig_atomic_t stop_recording = 0;
 
 int valfix = -1, mclk_sel = 0;	/* Audio parameters */
 
 #define dp(...)	do { if (dbg) { fprintf(stderr, __VA_ARGS__); } } while(0)
 #define ep(...)	do { fprintf(stderr, __VA_ARGS__); } while(0)
 
-#if __BYTE_ORDER == __BIG_ENDIAN
-#	if !defined(__NetBSD__)
-#		include <byteswap.h>
-#	else
-#		include <sys/bswap.h>
-#		define bswap_32 bswap32
-#		define bswap_16 bswap16
-#	endif
-#endif
-
 void signal_handler(sig)
         int sig;
 {
@@ -116,196 +130,329 @@ void resume_handler(int iSignal)
 }
 
 
-int
-record (int fd)
+/* Finish the recording, with a header that has the real lengths */
+void stop_handler(int iSignal)
 {
-    wavhead_t   hdr;
-    scdata_t    sc;
-    int     ret=0, count=0, i=0;
-    char        *audiodata;
-    u_char      *tmp;
-
-    if (fd < 0) {
-        return EINVAL;
-    }
+    stop_recording = 1;
+}
 
-    /*
-     * Header needs to be formulated....
-     */
-
-    hdr.main_chunk = 0x52494646;	// RIFF
-    hdr.length = 0xe6822700;
-    hdr.chunk_type = 0x57415645;	// WAVE
-    hdr.sub_chunk = 0x666d7420;		// fmt
-    hdr.sc_len = 0x12000000;
-    hdr.format = 0x100;
-    hdr.modus = 0x200; 
-    hdr.sample_fq = 0x44ac0000;
-    hdr.byte_p_sec = 0x10b10200;
-    hdr.byte_p_spl = 0x400;
-    hdr.bit_p_spl =  0x1000;
-    hdr.pad[0] = 0x0;
-    hdr.pad[1] = 0x0;
-    hdr.sc.data_chunk = 0x64617461;
-    hdr.sc.data_length = 0xc0822700; // 0x00945228 to be tested for long hrs record
-
-    write(fd, &hdr, sizeof (hdr));
-
-#if __BYTE_ORDER == __BIG_ENDIAN
-    hdr.length  = bswap_32(hdr.length);
-    hdr.sc_len  = bswap_32(hdr.sc_len);
-    hdr.format  = bswap_16(hdr.format);
-    hdr.modus   = bswap_16(hdr.modus);
-    hdr.sample_fq   = bswap_32(hdr.sample_fq);
-    hdr.byte_p_sec  = bswap_32(hdr.byte_p_sec);
-    hdr.byte_p_spl  = bswap_16(hdr.byte_p_spl);
-    hdr.bit_p_spl   = bswap_16(hdr.bit_p_spl);
-#endif
-
-    /*
-     * Refer to the comments in the declaration of the wavhead_t
-     * structure.
-     * Having a pointer and moving around would have been easier.
-     * But, that results in unaligned reads for the 32bit integer
-     * data resulting in core dump.  Hence...
-     * -Varada
-     */
-
-    if (hdr.sc_len == 16) {
-        tmp = &hdr.pad[0];
-        lseek(fd, -2, SEEK_CUR);
-    } else if (hdr.sc_len == 18) {
-        tmp = &hdr.pad[2];
-    } else {
-        return EINVAL;
-    }
-    memcpy(&sc, tmp, sizeof(sc));
 
-#if __BYTE_ORDER == __BIG_ENDIAN
-    sc.data_chunk = bswap_32 (sc.data_chunk);
-    sc.data_length = bswap_32 (sc.data_length);
-#endif
+/*
+ * wav files are little endian whatever the cpu is, so the header fields
+ * are picked out and put together a byte at a time.  That also keeps the
+ * 32 bit fields that follow odd sized chunks from being unaligned reads.
+ */
+static u_int
+le32 (const u_char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u_int) p[3] << 24);
+}
 
-    if (bufsz <= 0) {
-        bufsz = BUFF_SIZE;
-    }
+static u_short
+le16 (const u_char *p)
+{
+	return p[0] | (p[1] << 8);
+}
 
-    audiodata = (char *) malloc (bufsz * sizeof (char));
-    if (audiodata == NULL) {
-        return ENOMEM;
-    }
+static void
+put_le32 (u_char *p, u_int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
 
-    do {
-        /*
-         * Bug#:    26972
-         * The byte stream after the `.wav' header could have
-         * additional data (like author, album etc...) apart
-         * from the actual `audio data'.  Hence, ensure that
-         * extra stuff is not written to the device.  Stop at
-         * wherever the audio data ends.
-         *  +--------+----------------------+--------+
-         *  | header | audio data . . . . . | extras |
-         *  +--------+----------------------+--------+
-         */
-        count = bufsz;
-
-eagain:
-        ret = read (audio, audiodata, count);
-        if (ret < 0 && errno == EAGAIN) {
-            printf("record %d, error %d \n", __LINE__, ret);
-            goto eagain;
-        }
-
-        if ((write(fd, audiodata, ret)) < 0)  {
-            printf("record %d, error %d \n", __LINE__, ret);
-            perror("Read audio data");
-            break;
-        }
-
-
-        i += ret;
-
-    } while (i <= sc.data_length);
-
-    free (audiodata);
-
-    return 0;
+static void
+put_le16 (u_char *p, u_short v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
 }
 
+static double
+now (void)
+{
+	struct timeval tv;
 
-int
-playwav (int fd)
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Read up to len bytes, carrying on through the short reads a fifo or a
+ * slow filesystem gives.  Returns the bytes read, less than len only at
+ * the end of the file, or -1.
+ */
+static ssize_t
+read_full (int fd, void *buf, size_t len)
 {
-	wavhead_t	hdr;
-	scdata_t	sc;
-	int		tmpcount, ret=0, count=0, i;
-	char		*audiodata, *data;
-	u_char		*tmp;
+	size_t	got = 0;
+	ssize_t	ret;
 
-	if (fd < 0) {
-		return EINVAL;
+	while (got < len) {
+		ret = read(fd, (char *) buf + got, len - got);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		got += ret;
+	}
+
+	return got;
+}
+
+static int
+write_full (int fd, const void *buf, size_t len)
+{
+	size_t	done = 0;
+	ssize_t	ret;
+
+	while (done < len) {
+		ret = write(fd, (const char *) buf + done, len - done);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+			dp("%s:%d %d %d\n", __func__, __LINE__, (int) ret, errno);
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		done += ret;
 	}
 
-	read(fd, &hdr, sizeof (hdr));
+	return 0;
+}
 
-#if __BYTE_ORDER == __BIG_ENDIAN
-	hdr.length	= bswap_32(hdr.length);
-	hdr.sc_len	= bswap_32(hdr.sc_len);
-	hdr.format	= bswap_16(hdr.format);
-	hdr.modus	= bswap_16(hdr.modus);
-	hdr.sample_fq	= bswap_32(hdr.sample_fq);
-	hdr.byte_p_sec	= bswap_32(hdr.byte_p_sec);
-	hdr.byte_p_spl	= bswap_16(hdr.byte_p_spl);
-	hdr.bit_p_spl	= bswap_16(hdr.bit_p_spl);
-#endif
+/* Skip over a chunk, by reading it if the file is a pipe */
+static int
+skip (int fd, off_t len)
+{
+	char	junk[256];
+	ssize_t	ret;
 
-	/*
-	 * Refer to the comments in the declaration of the wavhead_t
-	 * structure.
-	 * Having a pointer and moving around would have been easier.
-	 * But, that results in unaligned reads for the 32bit integer
-	 * data resulting in core dump.  Hence...
-	 * -Varada
-	 */
-	if (hdr.sc_len == 16) {
-		tmp = &hdr.pad[0];
-		lseek(fd, -2, SEEK_CUR);
-	} else if (hdr.sc_len == 18) {
-		tmp = &hdr.pad[2];
-	} else {
+	if (lseek(fd, len, SEEK_CUR) != (off_t) -1) {
+		return 0;
+	}
+	if (errno != ESPIPE) {
+		return -1;
+	}
+
+	while (len > 0) {
+		ret = read_full(fd, junk, len < sizeof(junk) ? len : sizeof(junk));
+		if (ret <= 0) {
+			return -1;
+		}
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Walk the RIFF chunks up to the start of the audio data, picking up the
+ * format on the way and skipping anything else (LIST, fact, cue, ...).
+ * The fmt chunk can be 16, 18 or 40 bytes, only the first 16 matter here.
+ */
+static int
+parse_wav (int fd, wavinfo_t *wi)
+{
+	u_char	riff[12], chunk[8], fmt[16];
+	u_int	len;
+	int	have_fmt = 0;
+
+	if (read_full(fd, riff, sizeof(riff)) != sizeof(riff) ||
+	    memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4)) {
+		ep("Not a RIFF WAVE file\n");
 		return EINVAL;
 	}
-    memcpy(&sc, tmp, sizeof(sc));
 
-#if __BYTE_ORDER == __BIG_ENDIAN
-	sc.data_chunk = bswap_32 (sc.data_chunk);
-	sc.data_length = bswap_32 (sc.data_length);
-#endif
+	for (;;) {
+		if (read_full(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+			ep("No data chunk\n");
+			return EINVAL;
+		}
+		len = le32(chunk + 4);
+		dp("chunk '%.4s', %u bytes\n", chunk, len);
+
+		if (!memcmp(chunk, "data", 4)) {
+			if (!have_fmt) {
+				ep("data chunk before the fmt chunk\n");
+				return EINVAL;
+			}
+			/* Streamed files leave the length 0 or all ones */
+			wi->data_length = (len == 0xffffffff) ? 0 : len;
+			return 0;
+		}
 
-	if (bufsz <= 0) {
-		bufsz = BUFF_SIZE;
+		if (!memcmp(chunk, "fmt ", 4)) {
+			if (len < sizeof(fmt) ||
+			    read_full(fd, fmt, sizeof(fmt)) != sizeof(fmt)) {
+				ep("Short fmt chunk\n");
+				return EINVAL;
+			}
+			wi->format	= le16(fmt);
+			wi->modus	= le16(fmt + 2);
+			wi->sample_fq	= le32(fmt + 4);
+			wi->byte_p_sec	= le32(fmt + 8);
+			wi->byte_p_spl	= le16(fmt + 12);
+			wi->bit_p_spl	= le16(fmt + 14);
+			/* 0xfffe is WAVE_FORMAT_EXTENSIBLE, PCM in this context */
+			if (wi->format != 1 && wi->format != 0xfffe) {
+				ep("Format %d is not PCM\n", wi->format);
+				return EINVAL;
+			}
+			len -= sizeof(fmt);
+			have_fmt = 1;
+		}
+
+		/* Chunks are padded to an even length */
+		if (skip(fd, (off_t) len + (len & 1)) < 0) {
+			ep("Truncated '%.4s' chunk\n", chunk);
+			return EINVAL;
+		}
+	}
+}
+
+/* A 44 byte PCM header, data_length 0xffffffff while it isn't known yet */
+static void
+wav_header (u_char *hdr, u_int sample_fq, u_short modus, u_short bit_p_spl,
+	    u_int data_length)
+{
+	u_short	byte_p_spl = modus * (bit_p_spl / 8);
+
+	memcpy(hdr, "RIFF", 4);
+	put_le32(hdr + 4, data_length == 0xffffffff ? data_length : data_length + 36);
+	memcpy(hdr + 8, "WAVE", 4);
+	memcpy(hdr + 12, "fmt ", 4);
+	put_le32(hdr + 16, 16);
+	put_le16(hdr + 20, 1);
+	put_le16(hdr + 22, modus);
+	put_le32(hdr + 24, sample_fq);
+	put_le32(hdr + 28, sample_fq * byte_p_spl);
+	put_le16(hdr + 32, byte_p_spl);
+	put_le16(hdr + 34, bit_p_spl);
+	memcpy(hdr + 36, "data", 4);
+	put_le32(hdr + 40, data_length);
+}
+
+static int
+ring_init (ring_t *r, u_int n)
+{
+	memset(r, 0, sizeof(*r));
+	r->slots = n;
+	r->buf = malloc(n * bufsz);
+	r->len = malloc(n * sizeof(*r->len));
+	if (r->buf == NULL || r->len == NULL) {
+		free(r->buf);
+		free(r->len);
+		return ENOMEM;
+	}
+	sem_init(&r->wake[RING_READER], 0, 0);
+	sem_init(&r->wake[RING_WRITER], 0, 0);
+	return 0;
+}
+
+static void
+ring_free (ring_t *r)
+{
+	sem_destroy(&r->wake[RING_READER]);
+	sem_destroy(&r->wake[RING_WRITER]);
+	free(r->buf);
+	free(r->len);
+}
+
+/* Can side go on with want slots, free ones for the reader, full for the writer? */
+static int
+ring_ready (ring_t *r, int side, u_int want)
+{
+	u_int	used = r->head - r->tail;
+
+	if (side == RING_READER) {
+		return r->slots - used >= want;
 	}
+	return used >= want || r->done;
+}
 
-	if (ioctl(audio, I2S_DSIZE, hdr.bit_p_spl) < 0) {
-		perror("I2S_DSIZE");
+/*
+ * Sleep until the other side moves.  Saying we're asleep and then looking
+ * again, with a barrier between, means a post can't be missed; a stale
+ * one only costs the caller's loop an extra look.
+ */
+static void
+ring_wait (ring_t *r, int side, u_int want)
+{
+	r->sleeping[side] = 1;
+	__sync_synchronize();
+	if (!ring_ready(r, side, want)) {
+		while (sem_wait(&r->wake[side]) < 0 && errno == EINTR)
+			;
 	}
+	r->sleeping[side] = 0;
+}
+
+/* side has moved its index, wake the other one if it's waiting on that */
+static void
+ring_kick (ring_t *r, int side)
+{
+	int	other = !side;
 
-	if (ioctl(audio, I2S_FREQ, hdr.sample_fq) < 0) {
-		perror("I2S_FREQ");
+	__sync_synchronize();
+	if (r->sleeping[other] &&
+	    __sync_bool_compare_and_swap(&r->sleeping[other], 1, 0)) {
+		sem_post(&r->wake[other]);
 	}
+}
+
+/* Wait for want slots, counting it as a stall if there's any waiting */
+static void
+ring_stall (ring_t *r, int side, u_int want)
+{
+	double	start, waited;
 
-    if (mclk_sel) {
-	    if (ioctl(audio, I2S_MCLK, mclk_sel) < 0) {
-	    	perror("I2S_MCLK");
-	    }
+	if (ring_ready(r, side, want)) {
+		return;
 	}
 
-	audiodata = (char *) malloc (bufsz * sizeof (char));
-	if (audiodata == NULL) {
-		return ENOMEM;
+	start = now();
+	r->stalls[side]++;
+	do {
+		ring_wait(r, side, want);
+	} while (!ring_ready(r, side, want));
+
+	waited = now() - start;
+	if (waited > r->longest[side]) {
+		r->longest[side] = waited;
 	}
+}
+
+/*
+ * The reader thread: keeps the ring full from the file, so a slow read
+ * from flash or USB is covered by what's already queued.
+ */
+static void *
+reader (void *arg)
+{
+	player_t	*p = arg;
+	ring_t		*r = &p->ring;
+	sigset_t	sigs;
+	u_int		slot;
+	ssize_t		count;
+
+	/* Pause and resume are for the thread writing the device */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	do {
+		ring_stall(r, RING_READER, 1);
+		slot = r->head % r->slots;
 
-	for (i = 0; i <= sc.data_length; i += bufsz) {
 		/*
 		 * Bug#:	26972
 		 * The byte stream after the `.wav' header could have
@@ -318,70 +465,371 @@ playwav (int fd)
 		 *	+--------+----------------------+--------+
 		 */
 		count = bufsz;
-		if ((i + count) > sc.data_length) {
-			count = sc.data_length - i;
+		if (p->limited && count > p->length) {
+			count = p->length;
+		}
+
+		if (count > 0) {
+			count = read_full(p->fd, r->buf + slot * bufsz, count);
+			if (count < 0) {
+				perror("Read audio data");
+				p->error = errno;
+				count = 0;
+			}
+		}
+		if (p->limited) {
+			p->length -= count;
 		}
 
-		if ((count = read (fd, audiodata, count)) <= 0) {
-			perror("Read audio data");
+		/* An empty slot tells the writer that's all */
+		r->len[slot] = count;
+		__sync_synchronize();
+		r->head++;
+		ring_kick(r, RING_READER);
+	} while (count > 0 && !p->stop);
+
+	r->done = 1;
+	ring_kick(r, RING_READER);
+
+	return NULL;
+}
+
+int
+record (int fd)
+{
+	u_char		hdr[44];
+	u_int		length = 0, limit;
+	ssize_t		ret;
+	size_t		count;
+	char		*audiodata;
+	struct sigaction sa;
+
+	if (fd < 0) {
+		return EINVAL;
+	}
+
+	if (bufsz <= 0) {
+		bufsz = BUFF_SIZE;
+	}
+
+	audiodata = (char *) malloc (bufsz * sizeof (char));
+	if (audiodata == NULL) {
+		return ENOMEM;
+	}
+
+	/* No SA_RESTART, so a blocked read comes back and the header gets fixed */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* The lengths aren't known yet, they're filled in at the end */
+	wav_header(hdr, REC_FQ, 2, 16, 0xffffffff);
+	if (write_full(fd, hdr, sizeof(hdr)) < 0) {
+		perror("Write header");
+		free(audiodata);
+		return errno;
+	}
+
+	limit = rec_seconds * REC_FQ * 2 * 2;
+
+	while (length < limit && !stop_recording) {
+		count = bufsz;
+		if (count > limit - length) {
+			count = limit - length;
+		}
+
+		ret = read (audio, audiodata, count);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			dp("record %d, error %d \n", __LINE__, errno);
+			continue;
+		}
+		if (ret <= 0) {
+			/* A stand-in device file just ends */
+			if (ret < 0) {
+				perror("Read audio");
+			}
 			break;
 		}
 
-#ifdef WASP
-        tmpcount = count;
-        data = audiodata;
-        ret = 0;
-        if (valfix != -1) {
-            memset(data, valfix, tmpcount);
-        }
-erestart:
-        ret = write(audio, data, tmpcount);
-        if (ret == -ERESTART) {
-            goto erestart;
-        }
-#else
-eagain:                                                         
-        tmpcount = count;                                       
-        data = audiodata;                                       
-        ret = 0;                                                
-        do {                                                    
-            ret = write(audio, data, tmpcount);                     
-            if (ret < 0 && errno == EAGAIN) {                       
-                dp("%s:%d %d %d\n", __func__, __LINE__, ret, errno);
-                goto eagain;                                        
-            }                                                       
-            tmpcount = tmpcount - ret;                              
-            data += ret;                                            
-        } while(tmpcount);                                      
-#endif
-		dp("i = %d\n", i);
+		if (write_full(fd, audiodata, ret) < 0)  {
+			perror("Write audio data");
+			break;
+		}
+
+		length += ret;
 	}
 
+	/* Now the real lengths, unless it's going to a pipe */
+	if (lseek(fd, 0, SEEK_SET) == 0) {
+		wav_header(hdr, REC_FQ, 2, 16, length);
+		if (write_full(fd, hdr, sizeof(hdr)) < 0) {
+			perror("Rewrite header");
+		}
+	} else {
+		dp("can't seek back, leaving the header lengths unknown\n");
+	}
+
+	dp("recorded %u bytes\n", length);
 	free (audiodata);
 
 	return 0;
 }
 
+
+/*
+ * Playback through the device's mmap()ed descriptor buffers: the file is
+ * read straight into the periods the DMA plays from and committed, with no
+ * ring in between.  The 128 periods of the device are the read ahead.
+ */
+static int
+play_mmap (int fd, wavinfo_t *wi)
+{
+	struct i2s_mmap_status	st;
+	struct pollfd	pfd;
+	char		*map, *period;
+	size_t		maplen;
+	u_int		length = wi->data_length, played = 0;
+	int		limited = wi->data_length != 0;
+	int		n, ret = 0, done = 0;
+	ssize_t		count;
+
+	if (ioctl(audio, I2S_MMAP_STATUS, &st) < 0) {
+		perror("I2S_MMAP_STATUS");
+		return errno;
+	}
+
+	maplen = st.periods * st.period_bytes;
+	map = mmap(NULL, maplen, PROT_WRITE, MAP_SHARED, audio, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return errno;
+	}
+
+	pfd.fd = audio;
+	pfd.events = POLLOUT;
+
+	while (!done) {
+		if (ioctl(audio, I2S_MMAP_STATUS, &st) < 0) {
+			perror("I2S_MMAP_STATUS");
+			ret = errno;
+			break;
+		}
+
+		if (st.avail == 0) {
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				perror("poll");
+				ret = errno;
+				break;
+			}
+			continue;
+		}
+
+		for (n = 0; n < st.avail; n++) {
+			period = map + ((st.tail + n) % st.periods) * st.period_bytes;
+
+			/* Stop at the end of the data chunk, see reader() */
+			count = st.period_bytes;
+			if (limited && count > length) {
+				count = length;
+			}
+			if (count > 0) {
+				count = read_full(fd, period, count);
+				if (count < 0) {
+					perror("Read audio data");
+					ret = errno;
+					count = 0;
+				}
+			}
+			if (limited) {
+				length -= count;
+			}
+
+			if (count == 0) {
+				done = 1;
+				break;
+			}
+
+			if (valfix != -1) {
+				memset(period, valfix, count);
+			}
+
+			/* The device plays whole periods, the last is padded with silence */
+			if (count < st.period_bytes) {
+				memset(period + count, 0, st.period_bytes - count);
+				done = 1;
+			}
+
+			played += count;
+			if (done) {
+				n++;
+				break;
+			}
+		}
+
+		if (n > 0 && ioctl(audio, I2S_MMAP_COMMIT, n) < 0) {
+			perror("I2S_MMAP_COMMIT");
+			ret = errno;
+			break;
+		}
+		dp("played = %u\n", played);
+	}
+
+	munmap(map, maplen);
+
+	return ret;
+}
+
+int
+playwav (int fd)
+{
+	wavinfo_t	wi;
+	player_t	p;
+	ring_t		*r = &p.ring;
+	pthread_t	thread;
+	u_int		slot, played = 0;
+	int		ret, count;
+	double		start = 0, elapsed;
+
+	if (fd < 0) {
+		return EINVAL;
+	}
+
+	memset(&wi, 0, sizeof(wi));
+	if ((ret = parse_wav(fd, &wi)) != 0) {
+		return ret;
+	}
+
+	dp("format %d, %d channels, %u Hz, %d bits, %u bytes\n", wi.format,
+	   wi.modus, wi.sample_fq, wi.bit_p_spl, wi.data_length);
+
+	if (bufsz <= 0) {
+		bufsz = BUFF_SIZE;
+	}
+
+	if (!bench) {
+		if (ioctl(audio, I2S_DSIZE, wi.bit_p_spl) < 0) {
+			perror("I2S_DSIZE");
+		}
+
+		if (ioctl(audio, I2S_FREQ, wi.sample_fq) < 0) {
+			perror("I2S_FREQ");
+		}
+
+		if (mclk_sel) {
+			if (ioctl(audio, I2S_MCLK, mclk_sel) < 0) {
+				perror("I2S_MCLK");
+			}
+		}
+	}
+
+	if (use_mmap) {
+		return play_mmap(fd, &wi);
+	}
+
+	if (ring_init(r, slots) != 0) {
+		return ENOMEM;
+	}
+	p.fd = fd;
+	p.limited = wi.data_length != 0;
+	p.length = wi.data_length;
+	p.stop = 0;
+	p.error = 0;
+
+	if ((ret = pthread_create(&thread, NULL, reader, &p)) != 0) {
+		ep("Can't start the reader thread: %s\n", strerror(ret));
+		ring_free(r);
+		return ret;
+	}
+
+	/*
+	 * Let the reader get ahead before the device starts draining the
+	 * ring, that first wait isn't counted as a stall.
+	 */
+	while (!ring_ready(r, RING_WRITER, r->slots)) {
+		ring_wait(r, RING_WRITER, r->slots);
+	}
+
+	for (;;) {
+		ring_stall(r, RING_WRITER, 1);
+		slot = r->tail % r->slots;
+		count = r->len[slot];
+		if (count == 0) {
+			break;
+		}
+
+		if (!start) {
+			start = now();
+		}
+
+		if (valfix != -1) {
+			memset(r->buf + slot * bufsz, valfix, count);
+		}
+
+		if (write_full(audio, r->buf + slot * bufsz, count) < 0) {
+			perror("Write audio data");
+			break;
+		}
+		played += count;
+
+		r->tail++;
+		ring_kick(r, RING_WRITER);
+		dp("played = %u\n", played);
+	}
+
+	/* The reader might be waiting for room if the device went away */
+	p.stop = 1;
+	__sync_synchronize();
+	r->tail = r->head;
+	ring_kick(r, RING_WRITER);
+	pthread_join(thread, NULL);
+
+	if (bench) {
+		elapsed = start ? now() - start : 0;
+		printf("%u bytes in %.3f s, %.2f MB/s, %.1fx realtime\n",
+		       played, elapsed,
+		       elapsed > 0 ? played / elapsed / 1e6 : 0,
+		       elapsed > 0 && wi.byte_p_sec ? played / elapsed / wi.byte_p_sec : 0);
+		printf("writer stalls %u (longest %.1f ms), reader waits %u, %d x %d byte ring\n",
+		       r->stalls[RING_WRITER], r->longest[RING_WRITER] * 1000,
+		       r->stalls[RING_READER], r->slots, bufsz);
+	}
+
+	ring_free(r);
+
+	return p.error;
+}
+
 int
 main (int argc, char *argv[])
 {
 
 	int	fd,		/* The file descriptor */
 		optc,		/* For getopt */
-        counter,
-        i,
-        ret,
-        child;
-    char option;
+        ret;
+	static const struct option longopts[] = {
+		{ "bench", no_argument, NULL, 'B' },
+		{ "mmap", no_argument, NULL, 'M' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	bufsz = 0;
 	fine=-2;
 
-	while ((optc = getopt (argc, argv, "mrplv:t:d:f:")) != -1) {
+	while ((optc = getopt_long (argc, argv, "mrplv:t:d:f:n:s:", longopts, NULL)) != -1) {
 		switch (optc) {
 			case 'v': valfix = atoi (optarg); break;
 			case 't': bufsz = atoi (optarg); break;
 			case 'd': audev = optarg; break;
+			case 'n': /* buffers between the file and the device */
+				slots = atoi (optarg);
+				if (slots < 2) {
+					slots = 2;
+				}
+				break;
+			case 's': /* seconds to record */
+				rec_seconds = atoi (optarg);
+				break;
 			case 'f':
 				fine = atoi(optarg);
 				if (fine < -1 || fine > 1) {
@@ -402,11 +850,31 @@ main (int argc, char *argv[])
             case 'm':
                 mclk_sel = 1;
                 break;
+			case 'B': /* -d is a file or fifo standing in for the device */
+				bench = 1;
+				break;
+			case 'M': /* play through the device's mmap()ed buffers */
+				use_mmap = 1;
+				break;
 			default: ep("Unknown option\n"); exit(-1);
 		}
 	}
 
-    audio = open (audev, (recorder) ? O_RDONLY : O_WRONLY);
+	if (optind >= argc) {
+		ep("Usage: athplay [-r] [-d device] [--bench] [--mmap] <file>\n");
+		exit(-1);
+	}
+
+	if (use_mmap && (bench || recorder)) {
+		ep("--mmap is for playback on the device\n");
+		exit(-1);
+	}
+
+	if (bench && !recorder) {
+		audio = open (audev, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else {
+		audio = open (audev, (recorder) ? O_RDONLY : O_WRONLY);
+	}
 
 	if (audio < 0) {
 		ep("Device %s opening failed\n", audev);
@@ -415,7 +883,7 @@ main (int argc, char *argv[])
 
 	if (recorder) {
 		if ((fd = open(
-                    argv[optind], O_CREAT | O_TRUNC | O_WRONLY
+                    argv[optind], O_CREAT | O_TRUNC | O_WRONLY, 0644
 								)) == -1) {
 			perror(argv[optind]);
 			exit(-1);
@@ -430,19 +898,18 @@ main (int argc, char *argv[])
     signal(SIGUSR2, resume_handler);
 
     if(recorder) {
-	    record(fd);
+	    ret = record(fd);
     } else {
       do {
         lseek(fd, 0, SEEK_SET);
-  	    playwav(fd);
-  	  } while (loop);
+  	    ret = playwav(fd);
+  	  } while (loop && ret == 0);
     }
 	close(fd);
 rep:
-	ret = close(audio);
-	if (errno == EAGAIN) {
-		dp("%s:%d %d %d\n", __func__, __LINE__, ret, errno);
+	if (close(audio) < 0 && errno == EAGAIN) {
+		dp("%s:%d %d\n", __func__, __LINE__, errno);
 		goto rep;
 	}
-	return 0;
+	return ret ? -1 : 0;
 }
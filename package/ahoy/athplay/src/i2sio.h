@@ -15,3 +15,17 @@
 #define I2S_RESUME      _IOWR('N', 0x27, int)
 #define I2S_MCLK        _IOW('N', 0x28, int)
 
+
+/*
+ * ath-i2s: the descriptor buffers of the open direction can be mmap()ed,
+ * periods * period_bytes of them, period n at offset n * period_bytes.
+ */
+struct i2s_mmap_status {
+	uint32_t	tail;		/* the period the next commit starts at */
+	uint32_t	avail;		/* periods from tail on free to fill */
+	uint32_t	periods;
+	uint32_t	period_bytes;
+};
+
+#define I2S_MMAP_STATUS	_IOR('N', 0x2d, struct i2s_mmap_status)
+#define I2S_MMAP_COMMIT	_IOW('N', 0x2e, int)
@@ -0,0 +1,682 @@
+/*
+
+Lua TLV320AIC3100 codec Library
+
+Keeps a shadow copy of the codec's registers so that writes which wouldn't
+change anything, and page selects to the page already selected, never go out
+on the bus.  Queued writes are coalesced into runs of consecutive registers
+and submitted as one I2C_RDWR.  Volume ramps run on their own thread, one
+transaction per step, so the audio loop never waits on the bus.
+
+Authors:   0.01 - Dean Blackketter, Ahoy!
+
+*/
+
+// clock_gettime and pthread_cond_timedwait aren't in plain c99
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "linux/i2c.h"
+#include "linux/i2c-dev.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define AIC3100_CODEC_KEY "aic3100.codec"
+
+#define AIC3100_DEFAULT_ADDRESS 0x18
+
+// ahoy only programs pages 0 and 1, the coefficient pages aren't shadowed
+#define AIC3100_PAGES 2
+#define AIC3100_REGISTERS 128
+
+// register 0 of every page selects the page
+#define AIC3100_PAGE_SELECT 0
+
+// page 0 register 1 bit 0 is the software reset
+#define AIC3100_RESET 1
+
+// page 1 register 38, the speaker analog volume the ramps move
+#define AIC3100_VOLUME_PAGE 1
+#define AIC3100_VOLUME_REG 38
+
+// the kernel's I2C_RDWR_IOCTL_MAX_MSGS
+#define AIC3100_MAX_MESSAGES 42
+
+// every register of every page, plus a register byte and a page select per run
+#define AIC3100_MAX_BYTES (AIC3100_PAGES * AIC3100_REGISTERS * 3)
+
+// fastest a ramp steps, the codec's own soft stepping takes about this long
+#define AIC3100_MIN_STEP_USEC 1000
+
+// and the slowest, a minute a step, which keeps a step well inside a long of usec
+#define AIC3100_MAX_STEP_USEC 60000000L
+
+// analog volume attenuation in tenths of a dB for each register value, from the data sheet
+static const uint16_t volumeTenths[] = {
+    0,   5,  10,  15,  20,  25,  30,  35,  40,  45,
+   50,  55,  60,  65,  70,  75,  80,  85,  90,  95,
+  100, 105, 110, 115, 120, 125, 130, 135, 140, 145,
+  150, 155, 160, 165, 170, 175, 181, 186, 191, 196,
+  201, 206, 211, 216, 221, 226, 231, 236, 241, 246,
+  251, 256, 261, 266, 271, 276, 281, 286, 291, 296,
+  301, 306, 311, 316, 321, 326, 331, 336, 341, 346,
+  352, 357, 362, 367, 372, 377, 382, 387, 392, 397,
+  402, 407, 412, 417, 421, 427, 432, 438, 443, 448,
+  452, 458, 462, 467, 474, 479, 482, 487, 493, 500,
+  503, 510, 514, 518, 522, 527, 537, 542, 553, 567,
+  583, 602, 627, 643, 662, 687, 722, 783
+};
+
+#define AIC3100_VOLUME_CODES (sizeof(volumeTenths) / sizeof(volumeTenths[0]))
+#define AIC3100_MAX_TENTHS 783
+
+// register value for every tenth of a dB of attenuation, filled in by luaopen_aic3100
+static uint8_t volumeLookup[AIC3100_MAX_TENTHS + 1];
+
+typedef struct {
+  int fd;               // -1 once closed
+  int address;
+
+  pthread_mutex_t lock; // everything below, and the bus
+  pthread_cond_t wake;
+  pthread_t thread;
+  int threadRunning;
+  int stopping;
+
+  int page;             // selected page, -1 when unknown
+  uint8_t shadow[AIC3100_PAGES][AIC3100_REGISTERS];
+  uint8_t known[AIC3100_PAGES][AIC3100_REGISTERS];
+  uint8_t dirty[AIC3100_PAGES][AIC3100_REGISTERS];
+  int dirtyCount;
+
+  double volume;        // dB last asked for
+  int rampTarget;       // register value, -1 when not ramping
+  long rampStep;        // usec between steps
+  uint32_t errors;      // failed transactions on the ramp thread
+} aic3100_codec;
+
+/* prototypes */
+LUALIB_API int luaopen_aic3100 (lua_State *L);
+
+LUALIB_API int aic3100_version(lua_State *L);
+LUALIB_API int aic3100_open(lua_State *L);
+LUALIB_API int aic3100_close(lua_State *L);
+LUALIB_API int aic3100_reset(lua_State *L);
+LUALIB_API int aic3100_set(lua_State *L);
+LUALIB_API int aic3100_commit(lua_State *L);
+LUALIB_API int aic3100_write(lua_State *L);
+LUALIB_API int aic3100_get(lua_State *L);
+LUALIB_API int aic3100_read(lua_State *L);
+LUALIB_API int aic3100_lookup(lua_State *L);
+LUALIB_API int aic3100_volume(lua_State *L);
+LUALIB_API int aic3100_ramp(lua_State *L);
+LUALIB_API int aic3100_ramping(lua_State *L);
+LUALIB_API int aic3100_errors(lua_State *L);
+
+/* functions exposed to lua */
+static const luaL_reg aic3100_functions[] = {
+  {"version", aic3100_version},
+  {"open", aic3100_open},
+  {"lookup", aic3100_lookup},
+  {NULL, NULL}
+};
+
+static const luaL_reg aic3100_codec_functions[] = {
+  {"close", aic3100_close},
+  {"reset", aic3100_reset},
+  {"set", aic3100_set},
+  {"commit", aic3100_commit},
+  {"write", aic3100_write},
+  {"get", aic3100_get},
+  {"read", aic3100_read},
+  {"lookup", aic3100_lookup},
+  {"volume", aic3100_volume},
+  {"ramp", aic3100_ramp},
+  {"ramping", aic3100_ramping},
+  {"errors", aic3100_errors},
+  {"__gc", aic3100_close},
+  {NULL, NULL}
+};
+
+
+/* init function, will be called when lua run require */
+LUALIB_API int luaopen_aic3100 (lua_State *L) {
+    unsigned int code = 0;
+    int tenths;
+
+    // the first register value at least as quiet as each tenth of a dB
+    for (tenths = 0; tenths <= AIC3100_MAX_TENTHS; tenths++) {
+      while (volumeTenths[code] < tenths)
+        code++;
+      volumeLookup[tenths] = code;
+    }
+
+    luaL_newmetatable(L, AIC3100_CODEC_KEY);
+    luaL_register(L, 0, aic3100_codec_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_openlib(L, "aic3100", aic3100_functions, 0);
+    return 1;
+}
+
+
+
+LUALIB_API int aic3100_version(lua_State *L){
+    lua_pushstring(L, "aic3100 version 0.01, Dean Blackketter");
+
+    return 1;
+}
+
+static aic3100_codec* check_codec(lua_State *L, int index) {
+  aic3100_codec* codec = (aic3100_codec*)luaL_checkudata(L, index, AIC3100_CODEC_KEY);
+
+  if (codec->fd < 0)
+    luaL_error(L, "aic3100 is closed");
+
+  return codec;
+}
+
+static void check_register(lua_State *L, int page, int reg) {
+  if (page < 0 || page >= AIC3100_PAGES)
+    luaL_error(L, "Page %d isn't shadowed, expected 0 to %d", page, AIC3100_PAGES - 1);
+
+  if (reg <= AIC3100_PAGE_SELECT || reg >= AIC3100_REGISTERS)
+    luaL_error(L, "Register %d out of range, the page select is managed by aic3100", reg);
+}
+
+static int volume_code(double db) {
+  double tenths = ceil(-db * 10 - 1e-6);
+
+  if (tenths <= 0)
+    return 0;
+
+  if (tenths >= AIC3100_MAX_TENTHS)
+    return (int)AIC3100_VOLUME_CODES - 1;
+
+  return volumeLookup[(int)tenths];
+}
+
+static void queue(aic3100_codec* codec, int page, int reg, uint8_t value) {
+  // already there, or already on its way
+  if (codec->known[page][reg] && codec->shadow[page][reg] == value)
+    return;
+
+  codec->shadow[page][reg] = value;
+  codec->known[page][reg] = 1;
+  if (!codec->dirty[page][reg]) {
+    codec->dirty[page][reg] = 1;
+    codec->dirtyCount++;
+  }
+}
+
+// the speaker volume register value a ramp starts from, or fallback when it's unknown
+// or isn't a volume step, 0x80 and above route the mixer but aren't on the ramp
+static int current_code(aic3100_codec* codec, int fallback) {
+  int value = codec->shadow[AIC3100_VOLUME_PAGE][AIC3100_VOLUME_REG];
+
+  if (!codec->known[AIC3100_VOLUME_PAGE][AIC3100_VOLUME_REG] || value >= (int)AIC3100_VOLUME_CODES)
+    return fallback;
+
+  return value;
+}
+
+// after a failed transaction neither the page nor what's in the registers can be trusted
+static void forget(aic3100_codec* codec) {
+  codec->page = -1;
+  codec->dirtyCount = 0;
+  memset(codec->known, 0, sizeof(codec->known));
+  memset(codec->dirty, 0, sizeof(codec->dirty));
+}
+
+// sends every dirty register, fewest page selects and messages it can, call with lock held.
+// returns the number of registers written or -1 with errno set
+static int flush(aic3100_codec* codec) {
+  struct i2c_msg messages[AIC3100_MAX_MESSAGES];
+  struct i2c_rdwr_ioctl_data packets;
+  uint8_t data[AIC3100_MAX_BYTES];
+  int count = 0;
+  int used = 0;
+  int written = 0;
+  int pass, page, reg;
+
+  if (codec->dirtyCount == 0)
+    return 0;
+
+  // the selected page first, saving a select
+  for (pass = 0; pass < AIC3100_PAGES; pass++) {
+    page = codec->page >= 0 ? (codec->page + pass) % AIC3100_PAGES : pass;
+
+    for (reg = 1; reg < AIC3100_REGISTERS; reg++) {
+      int run;
+
+      if (!codec->dirty[page][reg])
+        continue;
+
+      // a page select and a run need two messages, send what's queued when there isn't room
+      if (count + 2 > AIC3100_MAX_MESSAGES) {
+        packets.msgs = messages;
+        packets.nmsgs = count;
+        if (ioctl(codec->fd, I2C_RDWR, &packets) < 0) {
+          forget(codec);
+          return -1;
+        }
+        count = used = 0;
+      }
+
+      if (codec->page != page) {
+        data[used] = AIC3100_PAGE_SELECT;
+        data[used + 1] = page;
+        messages[count].addr = codec->address;
+        messages[count].flags = 0;
+        messages[count].len = 2;
+        messages[count].buf = &data[used];
+        count++;
+        used += 2;
+        codec->page = page;
+      }
+
+      // registers auto increment, so a run of dirty ones is one message
+      messages[count].addr = codec->address;
+      messages[count].flags = 0;
+      messages[count].buf = &data[used];
+      data[used++] = reg;
+      for (run = 0; reg < AIC3100_REGISTERS && codec->dirty[page][reg]; reg++, run++) {
+        data[used++] = codec->shadow[page][reg];
+        codec->dirty[page][reg] = 0;
+      }
+      messages[count].len = run + 1;
+      count++;
+      written += run;
+    }
+  }
+
+  codec->dirtyCount = 0;
+
+  if (count) {
+    packets.msgs = messages;
+    packets.nmsgs = count;
+    if (ioctl(codec->fd, I2C_RDWR, &packets) < 0) {
+      forget(codec);
+      return -1;
+    }
+  }
+
+  return written;
+}
+
+static void* ramp_thread(void* arg) {
+  aic3100_codec* codec = (aic3100_codec*)arg;
+
+  pthread_mutex_lock(&codec->lock);
+
+  while (!codec->stopping) {
+    struct timespec next;
+    int64_t nsec;
+    int current, step;
+
+    if (codec->rampTarget < 0) {
+      pthread_cond_wait(&codec->wake, &codec->lock);
+      continue;
+    }
+
+    current = current_code(codec, codec->rampTarget);
+    step = codec->rampTarget > current ? 1 : codec->rampTarget < current ? -1 : 0;
+
+    queue(codec, AIC3100_VOLUME_PAGE, AIC3100_VOLUME_REG, current + step);
+    if (flush(codec) < 0)
+      codec->errors++;
+
+    if (current + step == codec->rampTarget) {
+      codec->rampTarget = -1;
+      continue;
+    }
+
+    // sleep a step, or until the ramp is changed or the codec closed
+    clock_gettime(CLOCK_REALTIME, &next);
+    // in 64 bits, a step of a few seconds overflows a 32 bit long of nanoseconds
+    nsec = next.tv_nsec + (int64_t)codec->rampStep * 1000;
+    next.tv_sec += nsec / 1000000000;
+    next.tv_nsec = nsec % 1000000000;
+    pthread_cond_timedwait(&codec->wake, &codec->lock, &next);
+  }
+
+  pthread_mutex_unlock(&codec->lock);
+  return NULL;
+}
+
+// aic3100.open([bus], [address]) opens the codec, on bus 0 at 0x18 by default
+LUALIB_API int aic3100_open(lua_State *L) {
+  int bus = luaL_optint(L, 1, 0);
+  int address = luaL_optint(L, 2, AIC3100_DEFAULT_ADDRESS);
+  aic3100_codec* codec;
+  char dev[32];
+
+  snprintf(dev, sizeof(dev), "/dev/i2c-%d", bus);
+
+  codec = (aic3100_codec*)lua_newuserdata(L, sizeof(aic3100_codec));
+  memset(codec, 0, sizeof(aic3100_codec));
+  codec->address = address;
+  codec->page = -1;
+  codec->rampTarget = -1;
+  pthread_mutex_init(&codec->lock, NULL);
+  pthread_cond_init(&codec->wake, NULL);
+
+  codec->fd = open(dev, O_RDWR);
+  if (codec->fd < 0)
+    return luaL_error(L, "i2c open of bus %d failed: %s", bus, strerror(errno));
+
+  luaL_getmetatable(L, AIC3100_CODEC_KEY);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// also the __gc method, closing twice is harmless
+LUALIB_API int aic3100_close(lua_State *L) {
+  aic3100_codec* codec = (aic3100_codec*)luaL_checkudata(L, 1, AIC3100_CODEC_KEY);
+
+  if (codec->threadRunning) {
+    pthread_mutex_lock(&codec->lock);
+    codec->stopping = 1;
+    pthread_cond_signal(&codec->wake);
+    pthread_mutex_unlock(&codec->lock);
+    pthread_join(codec->thread, NULL);
+    codec->threadRunning = 0;
+  }
+
+  if (codec->fd >= 0) {
+    close(codec->fd);
+    codec->fd = -1;
+  }
+
+  return 0;
+}
+
+// codec:reset() software resets the codec and forgets the shadow, wait 150ms before anything else
+LUALIB_API int aic3100_reset(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  uint8_t data[] = { AIC3100_PAGE_SELECT, 0, AIC3100_RESET };
+  struct i2c_msg message;
+  struct i2c_rdwr_ioctl_data packets;
+  int status;
+
+  message.addr = codec->address;
+  message.flags = 0;
+  message.len = sizeof(data);
+  message.buf = data;
+  packets.msgs = &message;
+  packets.nmsgs = 1;
+
+  pthread_mutex_lock(&codec->lock);
+  codec->rampTarget = -1;
+  status = ioctl(codec->fd, I2C_RDWR, &packets);
+  forget(codec);
+  if (status >= 0)
+    codec->page = 0;
+  pthread_mutex_unlock(&codec->lock);
+
+  if (status < 0)
+    return luaL_error(L, "aic3100 reset failed: %s", strerror(errno));
+
+  return 0;
+}
+
+// codec:set(page, register, value... or {value...}) queues writes to consecutive registers,
+// dropping any that match what the register already holds
+LUALIB_API int aic3100_set(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  int page = luaL_checkint(L, 2);
+  int reg = luaL_checkint(L, 3);
+  int table = lua_istable(L, 4);
+  int count = table ? (int)lua_objlen(L, 4) : lua_gettop(L) - 3;
+  int i;
+
+  check_register(L, page, reg);
+  if (count < 1)
+    return luaL_error(L, "Got no values to write");
+  check_register(L, page, reg + count - 1);
+
+  pthread_mutex_lock(&codec->lock);
+  for (i = 0; i < count; i++) {
+    int value;
+
+    if (table) {
+      lua_rawgeti(L, 4, i + 1);
+      value = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    } else {
+      value = lua_tointeger(L, 4 + i);
+    }
+
+    queue(codec, page, reg + i, value);
+  }
+  pthread_mutex_unlock(&codec->lock);
+
+  return 0;
+}
+
+// codec:commit() sends everything set since the last commit in one transaction, returns
+// the number of registers that actually changed
+LUALIB_API int aic3100_commit(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  int written;
+
+  pthread_mutex_lock(&codec->lock);
+  written = flush(codec);
+  pthread_mutex_unlock(&codec->lock);
+
+  if (written < 0)
+    return luaL_error(L, "aic3100 write failed: %s", strerror(errno));
+
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+// codec:write(page, register, value...) is set and commit together
+LUALIB_API int aic3100_write(lua_State *L) {
+  aic3100_set(L);
+  lua_settop(L, 1);
+  return aic3100_commit(L);
+}
+
+// codec:get(page, register) returns the shadow copy, nil if it isn't known
+LUALIB_API int aic3100_get(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  int page = luaL_checkint(L, 2);
+  int reg = luaL_checkint(L, 3);
+
+  check_register(L, page, reg);
+
+  pthread_mutex_lock(&codec->lock);
+  if (codec->known[page][reg])
+    lua_pushinteger(L, codec->shadow[page][reg]);
+  else
+    lua_pushnil(L);
+  pthread_mutex_unlock(&codec->lock);
+
+  return 1;
+}
+
+// codec:read(page, register, [count]) reads from the codec itself, refreshing the shadow
+LUALIB_API int aic3100_read(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  int page = luaL_checkint(L, 2);
+  int reg = luaL_checkint(L, 3);
+  int count = luaL_optint(L, 4, 1);
+  uint8_t select[2] = { AIC3100_PAGE_SELECT, page };
+  uint8_t regbyte = reg;
+  uint8_t rdata[AIC3100_REGISTERS];
+  struct i2c_msg messages[3];
+  struct i2c_rdwr_ioctl_data packets;
+  int status;
+  int i;
+
+  check_register(L, page, reg);
+  if (count < 1)
+    return luaL_error(L, "Read count of %d should be at least 1", count);
+  check_register(L, page, reg + count - 1);
+
+  pthread_mutex_lock(&codec->lock);
+
+  // anything queued goes first, so the read sees it
+  status = flush(codec);
+
+  if (status >= 0) {
+    packets.msgs = messages;
+    packets.nmsgs = 0;
+
+    if (codec->page != page) {
+      messages[packets.nmsgs].addr = codec->address;
+      messages[packets.nmsgs].flags = 0;
+      messages[packets.nmsgs].len = sizeof(select);
+      messages[packets.nmsgs].buf = select;
+      packets.nmsgs++;
+    }
+
+    messages[packets.nmsgs].addr = codec->address;
+    messages[packets.nmsgs].flags = 0;
+    messages[packets.nmsgs].len = 1;
+    messages[packets.nmsgs].buf = &regbyte;
+    packets.nmsgs++;
+
+    messages[packets.nmsgs].addr = codec->address;
+    messages[packets.nmsgs].flags = I2C_M_RD;
+    messages[packets.nmsgs].len = count;
+    messages[packets.nmsgs].buf = rdata;
+    packets.nmsgs++;
+
+    status = ioctl(codec->fd, I2C_RDWR, &packets);
+
+    if (status < 0) {
+      forget(codec);
+    } else {
+      codec->page = page;
+      for (i = 0; i < count; i++) {
+        codec->shadow[page][reg + i] = rdata[i];
+        codec->known[page][reg + i] = 1;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&codec->lock);
+
+  if (status < 0)
+    return luaL_error(L, "aic3100 read failed: %s", strerror(errno));
+
+  lua_createtable(L, count, 0);
+  for (i = 0; i < count; i++) {
+    lua_pushinteger(L, rdata[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  return 1;
+}
+
+// lookup(db) returns the speaker volume register value for db, the first at least that quiet
+LUALIB_API int aic3100_lookup(lua_State *L) {
+  lua_pushinteger(L, volume_code(luaL_checknumber(L, lua_gettop(L))));
+  return 1;
+}
+
+// codec:volume([db]) sets the speaker volume now, stopping any ramp, returns the volume
+LUALIB_API int aic3100_volume(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  int set = !lua_isnoneornil(L, 2);
+  int written = 0;
+  double volume = set ? luaL_checknumber(L, 2) : 0;
+
+  // no Lua errors while the lock is held, the ramp thread would be stuck on it
+  pthread_mutex_lock(&codec->lock);
+  if (set) {
+    codec->volume = volume;
+    codec->rampTarget = -1;
+    queue(codec, AIC3100_VOLUME_PAGE, AIC3100_VOLUME_REG, volume_code(codec->volume));
+    written = flush(codec);
+  }
+  volume = codec->volume;
+  pthread_mutex_unlock(&codec->lock);
+
+  if (written < 0)
+    return luaL_error(L, "aic3100 write failed: %s", strerror(errno));
+
+  lua_pushnumber(L, volume);
+  return 1;
+}
+
+// codec:ramp(db, [seconds]) moves the speaker volume to db a register step at a time over
+// about seconds (default 0.1), in the background, returns right away
+LUALIB_API int aic3100_ramp(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  double db = luaL_checknumber(L, 2);
+  double seconds = luaL_optnumber(L, 3, 0.1);
+  int target = volume_code(db);
+  int current, steps, err;
+  double usec;
+
+  if (!codec->threadRunning) {
+    err = pthread_create(&codec->thread, NULL, ramp_thread, codec);
+    if (err)
+      return luaL_error(L, "Failed to start the aic3100 ramp thread: %s", strerror(err));
+    codec->threadRunning = 1;
+  }
+
+  pthread_mutex_lock(&codec->lock);
+  current = current_code(codec, target);
+  steps = abs(target - current);
+
+  codec->volume = db;
+  codec->rampTarget = target;
+  usec = steps ? seconds * 1e6 / steps : 0;
+  if (usec > AIC3100_MAX_STEP_USEC)
+    usec = AIC3100_MAX_STEP_USEC;
+  codec->rampStep = (long)usec;
+  if (codec->rampStep < AIC3100_MIN_STEP_USEC)
+    codec->rampStep = AIC3100_MIN_STEP_USEC;
+
+  pthread_cond_signal(&codec->wake);
+  pthread_mutex_unlock(&codec->lock);
+
+  lua_pushnumber(L, db);
+  return 1;
+}
+
+// codec:ramping() is true until the last ramp reaches its volume
+LUALIB_API int aic3100_ramping(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+
+  pthread_mutex_lock(&codec->lock);
+  lua_pushboolean(L, codec->rampTarget >= 0);
+  pthread_mutex_unlock(&codec->lock);
+
+  return 1;
+}
+
+// the number of ramp steps that failed to write
+LUALIB_API int aic3100_errors(lua_State *L) {
+  aic3100_codec* codec = check_codec(L, 1);
+  uint32_t errors;
+
+  pthread_mutex_lock(&codec->lock);
+  errors = codec->errors;
+  pthread_mutex_unlock(&codec->lock);
+
+  lua_pushnumber(L, errors);
+  return 1;
+}
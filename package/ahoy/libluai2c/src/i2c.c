@@ -18,6 +18,8 @@ Authors:        .90 - Mikael Sundin, se.linkedin.com/in/mikaelsundin
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
+#include <errno.h>
 
 #include "linux/i2c.h"
 #include "linux/i2c-dev.h"
@@ -35,19 +37,39 @@ enum {
     RW_ERROR_PARAM = 4
 };
 
+#define I2C_BUS_KEY "i2c.bus"
+
+/* registry table of the open buses, by number, so every call on a bus shares one fd */
+#define I2C_BUSES_KEY "i2c.buses"
+
+/* the kernel's I2C_RDWR_IOCTL_MAX_MSGS */
+#define I2C_MAX_MESSAGES 42
+
+/* bytes written plus bytes read in one call, more than the codec has registers on a page */
+#define I2C_MAX_BYTES 1024
+
+typedef struct {
+    int fd;     /* -1 once closed */
+    int bus;
+} i2c_bus;
+
 /* prototypes */
-static int i2c_rw( int bus, int addr, 
+static int i2c_transfer(int fd, struct i2c_msg *messages, int count);
+static int i2c_rw( int fd, int addr, 
     const unsigned char *wptr, int wlen, 
     unsigned char *rptr, int rlen);
+LUALIB_API int i2c_open(lua_State *L);
+LUALIB_API int i2c_close(lua_State *L);
 LUALIB_API int i2c_write(lua_State *L);
 LUALIB_API int i2c_read(lua_State *L);
+LUALIB_API int i2c_transaction(lua_State *L);
 LUALIB_API int i2c_version(lua_State *L);
 LUALIB_API int i2c_help(lua_State *L);
 LUALIB_API int luaopen_i2c (lua_State *L);
 
 
 LUALIB_API int i2c_version(lua_State *L){
-    lua_pushstring(L, "i2c version 0.91, Mikael Sundin, Dean Blackketter, Shawn Lewis");
+    lua_pushstring(L, "i2c version 0.92, Mikael Sundin, Dean Blackketter, Shawn Lewis");
 
     return 1;
 }
@@ -55,9 +77,17 @@ LUALIB_API int i2c_version(lua_State *L){
 LUALIB_API int i2c_help(lua_State *L){
     lua_pushstring(L, "usage:\n"
 
+              "bus = open(bus(int)), the same handle every time for a bus, kept open until closed\n"
               "status = write(bus(int), device(int), register(int), data(int))...\n"
-              "status, data... = read(bus(int), device(int), register(int), [count(int)])\n"
-              "    (optional count for number of consecutive registers to read)\n"
+              "status = write(bus(int), device(int), register(int), {data(int)...})\n"
+              "{data(int)...} = read(bus(int), device(int), register(int), [count(int)])\n"
+              "    (optional count for number of consecutive registers to read),\n"
+              "    raises an error with the status if the read isn't acked\n"
+              "status, reads = transaction(bus(int), device(int), {segment...})\n"
+              "    all segments in one I2C_RDWR, a segment is a string or {data(int)...} to write,\n"
+              "    or {write=string or {data...}, read=count(int), addr=device(int)}\n"
+              "    reads has a table of data for each segment that reads\n"
+              "    bus may be a number or a handle from open, as bus:write(device, ...) and so on\n"
                       "   status ok: ack=0\n"
                       "   status error: nack=1, send error=2, bus error=3, parameter error=4\n"
 
@@ -66,29 +96,48 @@ LUALIB_API int i2c_help(lua_State *L){
 }
 
 
+/* submit messages as one I2C_RDWR
+* @return: 0=ack, 1=nack, 2=send error
+*/
+int i2c_transfer(int fd, struct i2c_msg *messages, int count){
+    struct i2c_rdwr_ioctl_data packets;
+    int i;
+
+    packets.msgs = messages;
+    packets.nmsgs = count;
+
+    if (ioctl(fd, I2C_RDWR, &packets) < 0) {
+        return RW_ERROR_SEND;
+    }
+
+    /* check for error from i2c transfer */
+    for (i = 0; i < count; i++) {
+        if (messages[i].flags & I2C_M_NO_RD_ACK) {
+            return RW_NACK;
+        }
+    }
+
+    return RW_ACK;
+}
+
 /* write and/or read i2c bus
-* @param bus, I2c bus to work on
+* @param fd, open i2c bus to work on
 * @param addr, i2c device address
 * @param wptr, pointer to data to write to
 * @param wlen, write length
 * @param rptr, pointer to store read data to
 * @param rlen, number of bytes to read
-* @return: 0=ack, 1=nack, 2=bus error, 3=parameter error
+* @return: 0=ack, 1=nack, 2=send error, 4=parameter error
 */
-int i2c_rw(  int bus, int addr,
+int i2c_rw(  int fd, int addr,
       const unsigned char *wptr, int wlen,
       unsigned char *rptr, int rlen){
-    int f;
-    struct i2c_rdwr_ioctl_data packets;
     struct i2c_msg messages[2];
-    char dev[15];
 
     if (wlen == 0 && rlen == 0) {
         return RW_ERROR_PARAM;
     }
 
-    sprintf(&dev[0], "/dev/i2c-%d", bus);
-
     messages[0].addr  = addr;
     messages[0].flags = 0;
     messages[0].len   = wlen;
@@ -100,109 +149,197 @@ int i2c_rw(  int bus, int addr,
     messages[1].buf   = rptr;
 
     if (wlen > 0 && rlen > 0) {
-        packets.msgs = &messages[0];    // write & read
-        packets.nmsgs = 2;
+        return i2c_transfer(fd, &messages[0], 2);    // write & read
     } else if(wlen > 0) {
-        packets.msgs = &messages[0];    // only write
-        packets.nmsgs = 1;
-    } else if(rlen > 0) {
-        packets.msgs = &messages[1];    // only read
-        packets.nmsgs = 1;
+        return i2c_transfer(fd, &messages[0], 1);    // only write
+    } else {
+        return i2c_transfer(fd, &messages[1], 1);    // only read
     }
+}
+
+/* the open handle for a bus number, opening it the first time, NULL if it can't be opened */
+static i2c_bus* get_bus(lua_State *L, int number){
+    i2c_bus *bus;
+    char dev[32];
 
-    if ((f = open(dev, O_RDWR)) < 0) {
-        return RW_ERROR_BUS;
+    lua_getfield(L, LUA_REGISTRYINDEX, I2C_BUSES_KEY);
+    lua_rawgeti(L, -1, number);
+    bus = (i2c_bus*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (bus && bus->fd >= 0) {
+        lua_pop(L, 1);
+        return bus;
     }
 
-    if (ioctl(f, I2C_RDWR, &packets) < 0) {
-        close(f);
-        return RW_ERROR_SEND;
+    snprintf(dev, sizeof(dev), "/dev/i2c-%d", number);
+
+    bus = (i2c_bus*)lua_newuserdata(L, sizeof(i2c_bus));
+    bus->bus = number;
+    bus->fd = open(dev, O_RDWR);
+    if (bus->fd < 0) {
+        lua_pop(L, 2);
+        return NULL;
     }
+    luaL_getmetatable(L, I2C_BUS_KEY);
+    lua_setmetatable(L, -2);
 
-    close(f);
+    lua_rawseti(L, -2, number);
+    lua_pop(L, 1);
+    return bus;
+}
 
-    /* check for error from i2c transfer */
-    if ( (messages[0].flags & I2C_M_NO_RD_ACK) ||
-         (messages[1].flags & I2C_M_NO_RD_ACK)){
-        return RW_NACK;
-    } else {
-        return RW_ACK;
+/* the bus the first argument names, a handle or a bus number, NULL if it can't be opened */
+static i2c_bus* to_bus(lua_State *L){
+    i2c_bus *bus = NULL;
+
+    if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+        luaL_getmetatable(L, I2C_BUS_KEY);
+        if (lua_rawequal(L, -1, -2)) {
+            bus = (i2c_bus*)lua_touserdata(L, 1);
+        }
+        lua_pop(L, 2);
     }
+
+    if (bus == NULL) {
+        return get_bus(L, luaL_checkint(L, 1));
+    }
+
+    if (bus->fd < 0) {
+        luaL_error(L, "i2c bus %d is closed", bus->bus);
+    }
+
+    return bus;
+}
+
+/* bytes from a string or an array of ints at index into buf, returns how many */
+static int get_bytes(lua_State *L, int index, unsigned char *buf, int max){
+    int count;
+    int i;
+
+    if (lua_type(L, index) == LUA_TSTRING) {
+        size_t len;
+        const char *data = lua_tolstring(L, index, &len);
+
+        if ((int)len > max) {
+            return luaL_error(L, "i2c data of %d bytes is longer than the %d left", (int)len, max);
+        }
+        memcpy(buf, data, len);
+        return len;
+    }
+
+    luaL_checktype(L, index, LUA_TTABLE);
+    count = lua_objlen(L, index);
+    if (count > max) {
+        return luaL_error(L, "i2c data of %d bytes is longer than the %d left", count, max);
+    }
+
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, index, i + 1);
+        buf[i] = luaL_checkint(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return count;
 }
 
 /* LUA parameters:
  * int i2c bus number
+ *
+ * Return values:
+ * bus handle, already open if anything else used the bus
+ */
+LUALIB_API int i2c_open(lua_State *L){
+    int number = luaL_checkint(L, 1);
+
+    if (get_bus(L, number) == NULL) {
+        return luaL_error(L, "i2c open of bus %d failed: %s", number, strerror(errno));
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, I2C_BUSES_KEY);
+    lua_rawgeti(L, -1, number);
+    return 1;
+}
+
+/* close a bus handle, the next call on that bus number opens it again, also __gc */
+LUALIB_API int i2c_close(lua_State *L){
+    i2c_bus *bus = (i2c_bus*)luaL_checkudata(L, 1, I2C_BUS_KEY);
+
+    if (bus->fd >= 0) {
+        close(bus->fd);
+        bus->fd = -1;
+    }
+
+    return 0;
+}
+
+/* LUA parameters:
+ * int i2c bus number, or bus handle
  * int address
  * int starting register
- * int data bytes...
+ * int data bytes..., or a table of them
  *
  * Return values:
  * status
  * Number of bytes written
  */
 LUALIB_API int i2c_write(lua_State *L){
-    int bus;
+    i2c_bus *bus;
     int address;
     int reg;
 
     int wlen = 0;  // strict compiler thinks wlen may be uninitialized
-    unsigned char *wptr = 0;
+    unsigned char wdata[I2C_MAX_BYTES];
 
     if (lua_gettop(L) < 4) {
         return luaL_error(L, "Wrong number of arguments");
     }
-    bus = lua_tointeger(L, 1);
-    address = lua_tointeger(L, 2);
-    reg = lua_tointeger(L, 3);
+    bus = to_bus(L);
+    address = luaL_checkint(L, 2);
+    reg = luaL_checkint(L, 3);
+
+    /* first byte is the register address */
+    wdata[0] = reg;
 
-    if (lua_isnumber(L, 4)) {
+    if (lua_istable(L, 4)) {
+      wlen = 1 + get_bytes(L, 4, &wdata[1], I2C_MAX_BYTES - 1);
+    } else {
       /* buffer length is number of bytes pushed after bus, address and reg plus one byte for the reg address */
       wlen = lua_gettop(L) - 3 + 1;
 
-      wptr = malloc( wlen );
-      if (!wptr) {
-        return luaL_error(L, "Malloc failed for i2c write buffer");
+      if (wlen > I2C_MAX_BYTES) {
+        return luaL_error(L, "i2c write of %d bytes is longer than %d", wlen, I2C_MAX_BYTES);
       }
 
-      /* first byte is the register address */
-      wptr[0] = reg;
-
       /* subsequent bytes are pulled from the stack */
       int i;
       for (i = 1; i < wlen; i++) {
-        wptr[i] = lua_tointeger(L, i + 3);
+        wdata[i] = luaL_checkint(L, i + 3);
       }
-    } else if (lua_istable(L, 4)) {
-      // djb - todo: accept an array of values. (already accept a series of parameters above), until then use unpack
-      luaL_error(L, "i2c.write doesn't accept an array of values, yet");
     }
 
     // write back i2c write status
-    lua_pushnumber(L, i2c_rw(bus, address, wptr, wlen, 0, 0));
-    if (wptr) {
-        free(wptr);
-    }
+    lua_pushnumber(L, bus ? i2c_rw(bus->fd, address, wdata, wlen, 0, 0) : RW_ERROR_BUS);
 
     return 1;
 }
 
 /* LUA
  * Parameters:
- * int bus
+ * int bus, or bus handle
  * int address
  * int reg
  * int count
  *
  * Return:
- * Status
- * data...
+ * table of count data bytes, an error with the status if not acked
  */
 LUALIB_API int i2c_read(lua_State *L){
-  int bus;
+  i2c_bus *bus;
   int address;
   int reg;
-  int count=1;
-  unsigned char rdata[count];
+  int count;
+  unsigned char rdata[I2C_MAX_BYTES];
   unsigned char regbyte;
 
   if (lua_gettop(L) < 3){
@@ -210,44 +347,193 @@ LUALIB_API int i2c_read(lua_State *L){
   }
 
   // parse input
-  bus = lua_tointeger (L, 1);
-  address = lua_tointeger(L, 2);
-  reg = lua_tointeger(L, 3);
-  count = (lua_gettop(L) == 4) ? lua_tointeger(L, 4) : 1;
+  bus = to_bus(L);
+  address = luaL_checkint(L, 2);
+  reg = luaL_checkint(L, 3);
+  count = (lua_gettop(L) >= 4) ? luaL_checkint(L, 4) : 1;
+
+  if (count < 1 || count > I2C_MAX_BYTES)
+    return luaL_error(L, "i2c read count of %d should be between 1 and %d", count, I2C_MAX_BYTES);
+
+  if (bus == NULL)
+    return luaL_error(L, "i2c_rw failed with %d", RW_ERROR_BUS);
 
   regbyte = reg;
   /* transfer data */
   /* do a dummy write of a single byte to set the register position that we want to read */
   /* followed by the actual read of requested bytes */
-  int fail = i2c_rw(bus, address, &regbyte, sizeof(regbyte), &rdata[0], count);
+  int fail = i2c_rw(bus->fd, address, &regbyte, sizeof(regbyte), &rdata[0], count);
 
   if (fail != RW_ACK)
     return luaL_error(L, "i2c_rw failed with %d", fail);
 
-  lua_newtable(L);
+  lua_createtable(L, count, 0);
 
   for (int i = 0; i < count; i++)  {
-    lua_pushnumber(L, i+1); // lua is one based
         lua_pushnumber(L, rdata[i]);
-        lua_settable(L, -3);
+        lua_rawseti(L, -2, i+1); // lua is one based
       }
 
   return 1;
 }
 
+/* LUA
+ * Parameters:
+ * int bus, or bus handle
+ * int address, for segments that don't give their own
+ * table of segments, each a string or table of bytes to write,
+ *   or a table with write (string or table of bytes), read (count) and addr fields
+ *
+ * Return:
+ * Status
+ * table with a table of bytes for each segment that reads, in order
+ */
+LUALIB_API int i2c_transaction(lua_State *L){
+  i2c_bus *bus;
+  int address;
+  struct i2c_msg messages[I2C_MAX_MESSAGES];
+  unsigned char data[I2C_MAX_BYTES];
+  int used = 0;
+  int count = 0;
+  int segments;
+  int status;
+  int i, j;
+
+  if (lua_gettop(L) != 3){
+      return luaL_error(L, "Wrong number of arguments");
+  }
+
+  bus = to_bus(L);
+  address = luaL_checkint(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  segments = lua_objlen(L, 3);
+
+  for (i = 1; i <= segments; i++) {
+    int addr = address;
+    lua_Integer want = 0;
+    int read;
+    int hasWrite;
+
+    lua_rawgeti(L, 3, i);
+
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "read");
+      want = luaL_optinteger(L, -1, 0);
+      lua_pop(L, 1);
+
+      lua_getfield(L, -1, "addr");
+      addr = luaL_optint(L, -1, address);
+      lua_pop(L, 1);
+    }
+
+    if (want < 0 || want > I2C_MAX_BYTES) {
+      return luaL_argerror(L, 3, lua_pushfstring(L, "segment %d reads %f bytes, at most %d",
+                                                 i, (lua_Number)want, I2C_MAX_BYTES));
+    }
+    read = want;
+
+    /* a plain string or array is all write, otherwise the write field, if there is one */
+    if (lua_istable(L, -1) && (read || lua_objlen(L, -1) == 0)) {
+      lua_getfield(L, -1, "write");
+      lua_remove(L, -2);
+    }
+    hasWrite = !lua_isnil(L, -1);
+
+    if (count + hasWrite + (read > 0) > I2C_MAX_MESSAGES) {
+      return luaL_error(L, "i2c transaction has more than %d messages", I2C_MAX_MESSAGES);
+    }
+
+    if (hasWrite) {
+      int wlen = get_bytes(L, lua_gettop(L), &data[used], I2C_MAX_BYTES - used);
+
+      messages[count].addr  = addr;
+      messages[count].flags = 0;
+      messages[count].len   = wlen;
+      messages[count].buf   = &data[used];
+      count++;
+      used += wlen;
+    }
+
+    if (read > 0) {
+      if (read > I2C_MAX_BYTES - used) {
+        return luaL_argerror(L, 3, lua_pushfstring(L, "segment %d reads %d bytes, more than the %d left",
+                                                   i, read, I2C_MAX_BYTES - used));
+      }
+
+      messages[count].addr  = addr;
+      messages[count].flags = I2C_M_RD;
+      messages[count].len   = read;
+      messages[count].buf   = &data[used];
+      count++;
+      used += read;
+    }
+
+    lua_pop(L, 1);
+  }
+
+  if (count == 0) {
+    status = RW_ERROR_PARAM;
+  } else if (bus == NULL) {
+    status = RW_ERROR_BUS;
+  } else {
+    status = i2c_transfer(bus->fd, messages, count);
+  }
+
+  lua_pushnumber(L, status);
+  lua_newtable(L);
+
+  if (status == RW_ACK) {
+    int reads = 0;
+
+    for (i = 0; i < count; i++) {
+      if (!(messages[i].flags & I2C_M_RD))
+        continue;
+
+      lua_createtable(L, messages[i].len, 0);
+      for (j = 0; j < messages[i].len; j++) {
+        lua_pushnumber(L, messages[i].buf[j]);
+        lua_rawseti(L, -2, j + 1);
+      }
+      lua_rawseti(L, -2, ++reads);
+    }
+  }
+
+  return 2;
+}
+
 
 /* functions exposed to lua */
 static const luaL_reg i2c_functions[] = {
+  {"open", i2c_open},
   {"write", i2c_write},
   {"read", i2c_read},
+  {"transaction", i2c_transaction},
   {"version", i2c_version},
   {"help", i2c_help},
   {NULL, NULL}
 };
 
+static const luaL_reg i2c_bus_functions[] = {
+  {"close", i2c_close},
+  {"write", i2c_write},
+  {"read", i2c_read},
+  {"transaction", i2c_transaction},
+  {"__gc", i2c_close},
+  {NULL, NULL}
+};
+
 
 /* init function, will be called when lua run require */
 LUALIB_API int luaopen_i2c (lua_State *L) {
+    luaL_newmetatable(L, I2C_BUS_KEY);
+    luaL_register(L, 0, i2c_bus_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, I2C_BUSES_KEY);
+
     luaL_openlib(L, "i2c", i2c_functions, 0);
     return 1;
-}
\ No newline at end of file
+}
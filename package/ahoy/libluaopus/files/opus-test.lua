@@ -37,6 +37,8 @@ dump( enc:force_channels(), 'force_channels' )
 
 dump( enc:fec(), 'fec' )
 
+dump( enc:packet_loss(), 'packet_loss' )
+
 dump( enc:signal(), 'signal' )
 
 dump( enc:vbr(), 'vbr' )
@@ -76,4 +78,43 @@ dump( dec:pitch(), 'pitch' )
 
 dump( dec:reset(), 'reset' )
 
+print()
+print('Batch encode and decode')
+
+local packets, lengths = enc:encode_many(string.rep(sampledata, 5), 480)
+
+print('encode_many returned', #lengths, 'packets in', #packets, 'bytes')
+
+local decodedmany = dec:decode_many(packets, lengths)
+
+print('decode_many returned data of length', #decodedmany )
+
+print()
+print('Lost packets')
+
+print('concealed frame of length', #dec:recover())
+print('recovered frame of length', #dec:recover(sampleframe))
+local lostpackets = packets:sub(1, lengths[1]) .. packets:sub(lengths[1] + lengths[2] + 1)
+local lostlengths = { lengths[1], 0, lengths[3], lengths[4], lengths[5] }
+print('decode_many with a lost packet returned data of length', #dec:decode_many(lostpackets, lostlengths))
+
+print()
+print('Packet store')
+
+local store = opus.newstore()
+
+store:append_many(packets, lengths)
+store:encode(enc, sampledata)
+
+print('store holds', store:count(), 'packets in', store:bytes(), 'bytes')
+
+print('store truncated to', store:truncate(1), 'packets')
+
+for i, packet in store:packets() do
+  print('packet', i, 'length', #packet, 'decodes to', #store:decode(dec, i))
+end
+
+store:write_ogg('/tmp/opus-test.opus', 2)
+print('wrote /tmp/opus-test.opus')
+
 print('opus-test done')
\ No newline at end of file
@@ -20,8 +20,11 @@ Authors:        0.1 - Dean Blackketter
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 
 #include "opus/opus.h"
+#include "ogg/ogg.h"
+#include "pcmconv.h"
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -70,6 +73,38 @@ Authors:        0.1 - Dean Blackketter
 // bytes per sample for each channel
 #define SAMPLE_SIZE (sizeof(opus_int16))
 
+// the encoder and decoder userdata, keeping the channel count and sample rate
+// next to the opus state so encoding and decoding don't look them up in lua
+typedef struct {
+  OpusEncoder* enc;
+  int channels;
+  opus_int32 samplerate;
+} opus_enc_data;
+
+typedef struct {
+  OpusDecoder* dec;
+  int channels;
+  opus_int32 samplerate;
+} opus_dec_data;
+
+// packets end to end in one growable arena, with an index of where each one starts.
+// offsets[count] is the end of the last packet, so packet i runs from offsets[i] to offsets[i+1].
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  size_t capacity;
+  size_t* offsets;
+  int count;
+  int slots;          // entries allocated in offsets, always more than count
+} opus_store_data;
+
+// a minute of 20ms voip packets, the arena and index double from there
+#define STORE_DEFAULT_BYTES (64 * 1024)
+#define STORE_DEFAULT_PACKETS (3000)
+
+// what the encoder adds up front at 48k, for the OpusHead of recordings we wrote
+#define OGG_DEFAULT_PRESKIP (312)
+
 
 //------------------------------------------------------------------------------
 // Prototypes
@@ -81,6 +116,7 @@ LUALIB_API int luaopen_opus(lua_State *L);
 
 LUALIB_API int opus_enc_new(lua_State *L);
 LUALIB_API int opus_enc_encode(lua_State *L);
+LUALIB_API int opus_enc_encode_many(lua_State *L);
 LUALIB_API int opus_enc_free(lua_State *L);
 LUALIB_API int opus_enc_bitrate(lua_State *L);
 LUALIB_API int opus_enc_complexity(lua_State *L);
@@ -89,12 +125,15 @@ LUALIB_API int opus_enc_signal(lua_State *L);
 LUALIB_API int opus_enc_bandwidth(lua_State *L);
 LUALIB_API int opus_enc_force_channels(lua_State *L);
 LUALIB_API int opus_enc_fec(lua_State *L);
+LUALIB_API int opus_enc_packet_loss(lua_State *L);
 LUALIB_API int opus_enc_vbr(lua_State *L);
 LUALIB_API int opus_enc_vbr_constraint(lua_State *L);
 LUALIB_API int opus_enc_reset(lua_State *L);
 
 LUALIB_API int opus_dec_new(lua_State *L);
 LUALIB_API int opus_dec_decode(lua_State *L);
+LUALIB_API int opus_dec_decode_many(lua_State *L);
+LUALIB_API int opus_dec_recover(lua_State *L);
 LUALIB_API int opus_dec_free(lua_State *L);
 LUALIB_API int opus_dec_bandwidth(lua_State *L);
 LUALIB_API int opus_dec_samples_per_frame(lua_State *L);
@@ -105,12 +144,30 @@ LUALIB_API int opus_dec_gain(lua_State *L);
 LUALIB_API int opus_dec_pitch(lua_State *L);
 LUALIB_API int opus_dec_reset(lua_State *L);
 
+LUALIB_API int opus_store_new(lua_State *L);
+LUALIB_API int opus_store_free(lua_State *L);
+LUALIB_API int opus_store_append(lua_State *L);
+LUALIB_API int opus_store_append_many(lua_State *L);
+LUALIB_API int opus_store_encode(lua_State *L);
+LUALIB_API int opus_store_decode(lua_State *L);
+LUALIB_API int opus_store_get(lua_State *L);
+LUALIB_API int opus_store_count(lua_State *L);
+LUALIB_API int opus_store_bytes(lua_State *L);
+LUALIB_API int opus_store_truncate(lua_State *L);
+LUALIB_API int opus_store_clear(lua_State *L);
+LUALIB_API int opus_store_packets(lua_State *L);
+LUALIB_API int opus_store_write_ogg(lua_State *L);
+
 const char* opus_error_string(int x);
 int opus_check_error(lua_State *L, int x);
 void register_dec(lua_State *L);
 void register_enc(lua_State *L);
+void register_store(lua_State *L);
 OpusEncoder* check_enc(lua_State* L, int index);
 OpusDecoder* check_dec(lua_State* L, int index);
+opus_enc_data* check_enc_data(lua_State* L, int index);
+opus_dec_data* check_dec_data(lua_State* L, int index);
+opus_store_data* check_store_data(lua_State* L, int index);
 
 //------------------------------------------------------------------------------
 
@@ -118,6 +175,7 @@ OpusDecoder* check_dec(lua_State* L, int index);
 
 static const luaL_reg enc_functions[] = {
   {"encode", opus_enc_encode},
+  {"encode_many", opus_enc_encode_many},
   {"bitrate", opus_enc_bitrate},
   {"complexity", opus_enc_complexity},
   {"application", opus_enc_application},
@@ -125,6 +183,7 @@ static const luaL_reg enc_functions[] = {
   {"bandwidth", opus_enc_bandwidth},
   {"force_channels", opus_enc_force_channels},
   {"fec", opus_enc_fec},
+  {"packet_loss", opus_enc_packet_loss},
   {"signal", opus_enc_signal},
   {"vbr", opus_enc_vbr},
   {"vbr_constraint", opus_enc_vbr_constraint},
@@ -139,6 +198,8 @@ static const luaL_Reg enc_gc_functions[] = {
 
 static const luaL_reg dec_functions[] = {
   {"decode", opus_dec_decode},
+  {"decode_many", opus_dec_decode_many},
+  {"recover", opus_dec_recover},
   {"bandwidth", opus_dec_bandwidth},
   {"samples_per_frame", opus_dec_samples_per_frame},
   {"channels", opus_dec_channels},
@@ -155,11 +216,32 @@ static const luaL_Reg dec_gc_functions[] = {
   {NULL, NULL} 
 };
 
+static const luaL_reg store_functions[] = {
+  {"append", opus_store_append},
+  {"append_many", opus_store_append_many},
+  {"encode", opus_store_encode},
+  {"decode", opus_store_decode},
+  {"get", opus_store_get},
+  {"count", opus_store_count},
+  {"bytes", opus_store_bytes},
+  {"truncate", opus_store_truncate},
+  {"clear", opus_store_clear},
+  {"packets", opus_store_packets},
+  {"write_ogg", opus_store_write_ogg},
+  {NULL, NULL}
+};
+
+static const luaL_Reg store_gc_functions[] = {
+  {"__gc", opus_store_free},
+  {NULL, NULL}
+};
+
 static const luaL_reg opus_functions[] = {
   {"version", opus_version},
   {"help", opus_help},
   {"newencoder", opus_enc_new},
   {"newdecoder", opus_dec_new},
+  {"newstore", opus_store_new},
   {NULL, NULL}
 };
 
@@ -183,7 +265,7 @@ int opus_check_error(lua_State *L, int x) {
 // Encoder
 //------------------------------------------------------------------------------
 
-OpusEncoder* check_enc(lua_State* L, int index)
+opus_enc_data* check_enc_data(lua_State* L, int index)
 {
   void* ud = 0;
 
@@ -196,7 +278,12 @@ OpusEncoder* check_enc(lua_State* L, int index)
   
   luaL_argcheck(L, ud != 0, 0,"`opus.encoder' expected");  
 
-  return *((OpusEncoder**)ud);      
+  return (opus_enc_data*)ud;
+}
+
+OpusEncoder* check_enc(lua_State* L, int index)
+{
+  return check_enc_data(L, index)->enc;
 }
 
 
@@ -232,25 +319,20 @@ LUALIB_API int opus_enc_new(lua_State *L){
   luaL_getmetatable(L, "opus.encoder");
   lua_setmetatable(L, -2);
   
- // save away the number of channels
-  lua_pushinteger(L, channels);
-  lua_setfield(L, -2, "channels");
-
-  // save away the sample rate
-  lua_pushinteger(L, Fs);
-  lua_setfield(L, -2, "samplerate");
-
-  // Allocate memory for a pointer to to object
-  OpusEncoder **enc = (OpusEncoder **)lua_newuserdata(L, sizeof(OpusEncoder *));  
+  // Allocate memory for the encoder, its channel count and sample rate
+  opus_enc_data *data = (opus_enc_data *)lua_newuserdata(L, sizeof(opus_enc_data));
+  data->enc = NULL;
+  data->channels = channels;
+  data->samplerate = Fs;
   luaL_getmetatable(L, "opus.encoder");
   lua_setmetatable(L, -2);
 
   // Set field '__self' of instance table to the encoder user data
   lua_setfield(L, -2, "__self");  
 
-  *enc = opus_encoder_create ( Fs,  channels,  app_int,  &error);
+  data->enc = opus_encoder_create ( Fs,  channels,  app_int,  &error);
 
-  printf("created opus encoder: %x\n", (unsigned int)(*enc));
+  printf("created opus encoder: %x\n", (unsigned int)(data->enc));
   
   opus_check_error(L, error);
 
@@ -258,31 +340,58 @@ LUALIB_API int opus_enc_new(lua_State *L){
 }
 
 //------------------------------------------------------------------------------
+// pcm in the encoder's channel count, converted into temp_pcm if it isn't already
+
+static const opus_int16* enc_convert(lua_State *L, const opus_int16* pcm, int frame_size,
+                                     int pcm_channels, int channels, opus_int16* temp_pcm)
+{
+  if (pcm_channels == channels) {
+    return pcm;
+  }
+
+  if (frame_size > MAX_SAMPLES_PER_FRAME) {
+    luaL_error(L, "Too many samples to convert: %d", frame_size);
+  }
+
+  if (pcm_channels == 2 && channels == 1) {
+    pcm_downmix(temp_pcm, pcm, frame_size);
+  } else if (pcm_channels == 1 && channels == 2) {
+    pcm_duplicate(temp_pcm, pcm, frame_size);
+  } else {
+    luaL_error(L, "Can't convert %d channels to %d", pcm_channels, channels);
+  }
+  return temp_pcm;
+}
+
+//------------------------------------------------------------------------------
+
+// encode(pcm, [channels]) - pcm with a different channel count than the encoder's,
+// like stereo straight from i2s into a mono encoder, is converted first
 
 int opus_enc_encode(lua_State *L) 
 {
   // probably too big to put on the stack.
   unsigned char temp_frame[MAX_FRAME_SIZE];
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
 
   int n = lua_gettop(L);  // Number of arguments
   
-  if (n == 2) {
-    OpusEncoder* enc = check_enc(L, 1);
+  if (n == 2 || n == 3) {
+    opus_enc_data* data = check_enc_data(L, 1);
+    OpusEncoder* enc = data->enc;
 
     size_t pcm_len;
 
     const opus_int16 *pcm= (const opus_int16 *)lua_tolstring (L, 2, &pcm_len); 
     
-    // need to use the saved channel count 
-    //  which begs the questions: 
-    //      why is there no accessor to the opus lib for this?  or
-    //      why can't the opus lib do this calculation?
-    lua_getfield(L, 1, "channels");
-    int channels = luaL_checkint(L, -1);
-      
-    lua_pop(L,1);
+    // opus has no accessor for the channel count, we keep it ourselves
+    int channels = data->channels;
+
+    int pcm_channels = luaL_optint(L, 3, channels);
      
-    int frame_size = pcm_len / sizeof(opus_int16) / channels;
+    int frame_size = pcm_len / sizeof(opus_int16) / pcm_channels;
+
+    pcm = enc_convert(L, pcm, frame_size, pcm_channels, channels, temp_pcm);
     
     opus_int32 encoded_bytes =	opus_encode (enc, pcm, frame_size, temp_frame, MAX_FRAME_SIZE);
 
@@ -292,7 +401,7 @@ int opus_enc_encode(lua_State *L)
 
 
   } else {
-    luaL_error(L, "Got %d arguments expected 2 (self, pcm data)", n); 
+    luaL_error(L, "Got %d arguments expected 2 or 3 (self, pcm data, [pcm channels])", n); 
   }
   
   return 1;
@@ -300,11 +409,70 @@ int opus_enc_encode(lua_State *L)
 
 //------------------------------------------------------------------------------
 
+// encode_many(pcm, frame_size, [channels]) - encodes pcm holding any number of whole
+// frames of frame_size samples (per channel) in one call.  returns the packets end to
+// end in one string and a table of their lengths, for decode_many.
+
+LUALIB_API int opus_enc_encode_many(lua_State *L)
+{
+  unsigned char temp_frame[MAX_FRAME_SIZE];
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
+
+  opus_enc_data* data = check_enc_data(L, 1);
+  size_t pcm_len;
+  const opus_int16 *pcm = (const opus_int16 *)luaL_checklstring(L, 2, &pcm_len);
+  int frame_size = luaL_checkint(L, 3);
+  int pcm_channels = luaL_optint(L, 4, data->channels);
+  size_t frame_bytes;
+  int frames, i, lengths;
+  luaL_Buffer b;
+
+  if (frame_size <= 0 || frame_size > MAX_SAMPLES_PER_FRAME) {
+    return luaL_error(L, "Invalid frame size: %d", frame_size);
+  }
+
+  if (pcm_channels < 1 || pcm_channels > MAX_CHANNELS) {
+    return luaL_error(L, "Invalid pcm channels: %d", pcm_channels);
+  }
+
+  frame_bytes = frame_size * pcm_channels * SAMPLE_SIZE;
+  if (pcm_len % frame_bytes) {
+    return luaL_error(L, "pcm is not a whole number of %d sample frames", frame_size);
+  }
+  frames = pcm_len / frame_bytes;
+
+  lua_createtable(L, frames, 0);
+  lengths = lua_gettop(L);
+
+  luaL_buffinit(L, &b);
+  for (i = 0; i < frames; i++) {
+    const opus_int16* frame = enc_convert(L, pcm + (size_t)i * frame_size * pcm_channels, frame_size,
+                                          pcm_channels, data->channels, temp_pcm);
+    opus_int32 encoded_bytes = opus_encode (data->enc, frame, frame_size, temp_frame, MAX_FRAME_SIZE);
+
+    opus_check_error(L, encoded_bytes);
+    luaL_addlstring(&b, (char*)temp_frame, (size_t)encoded_bytes);
+
+    lua_pushinteger(L, encoded_bytes);
+    lua_rawseti(L, lengths, i + 1);
+  }
+  luaL_pushresult(&b);
+
+  // packets first, then their lengths
+  lua_insert(L, lengths);
+  return 2;
+}
+
+//------------------------------------------------------------------------------
+
 LUALIB_API int opus_enc_free(lua_State *L){
 
-  OpusEncoder** enc = luaL_checkudata(L, 1, "opus.encoder");
+  opus_enc_data* data = luaL_checkudata(L, 1, "opus.encoder");
 
-  opus_encoder_destroy(*enc);
+  if (data->enc) {
+    opus_encoder_destroy(data->enc);
+    data->enc = NULL;
+  }
 
   return 0;
 }
@@ -555,6 +723,29 @@ LUALIB_API int opus_enc_fec(lua_State *L){
 
 //------------------------------------------------------------------------------
 
+// the expected packet loss, in percent.  FEC is only added to the packets when it's above 0.
+
+LUALIB_API int opus_enc_packet_loss(lua_State *L){
+  OpusEncoder* enc = check_enc(L, 1);
+  int params = lua_gettop(L);
+  opus_int32 packet_loss;
+   
+  if (params == 2) {
+    packet_loss = luaL_checkint(L, 2);
+    opus_check_error(L,opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(packet_loss)));
+  } else if (params == 1) {
+    opus_check_error(L,opus_encoder_ctl(enc, OPUS_GET_PACKET_LOSS_PERC(&packet_loss)));
+  } else {
+    luaL_error(L, "Got %d arguments expected only one or two (self, packet loss percent)", params);
+  }
+  
+  lua_pushinteger(L, packet_loss);
+  
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
 LUALIB_API int opus_enc_vbr(lua_State *L){
   OpusEncoder* enc = check_enc(L, 1);
   int params = lua_gettop(L);
@@ -659,16 +850,11 @@ LUALIB_API int opus_dec_new(lua_State *L){
   luaL_getmetatable(L, "opus.decoder");
   lua_setmetatable(L, -2);
   
- // save away the number of channels, with a different name than "channels", which is a bona fide method
-  lua_pushinteger(L, channels);
-  lua_setfield(L, -2, "dec_channels");
-
-  // save away the sample rate
-  lua_pushinteger(L, Fs);
-  lua_setfield(L, -2, "samplerate");
-   
-  // Allocate memory for a pointer to to object
-  OpusDecoder **s = (OpusDecoder **)lua_newuserdata(L, sizeof(OpusDecoder *));  
+  // Allocate memory for the decoder, its channel count and sample rate
+  opus_dec_data *data = (opus_dec_data *)lua_newuserdata(L, sizeof(opus_dec_data));
+  data->dec = NULL;
+  data->channels = channels;
+  data->samplerate = Fs;
   luaL_getmetatable(L, "opus.decoder");
   lua_setmetatable(L, -2);
 
@@ -676,40 +862,90 @@ LUALIB_API int opus_dec_new(lua_State *L){
   // Set field '__self' of instance table to the encoder user data
   lua_setfield(L, -2, "__self");  
   
-  *s = opus_decoder_create( Fs,  channels, &error);
+  data->dec = opus_decoder_create( Fs,  channels, &error);
   
   opus_check_error(L, error);
     
   return 1; 
 }
 
+//-----------------------------------------------------------------------------
+// decodes one packet into temp_pcm, converted to pcm_channels, returns the samples per channel.
+// with no packet (data NULL) it conceals a lost one, and with decode_fec it recovers the
+// lost packet before data from the redundancy the encoder put in data (see encoder:fec).
+
+static int dec_frame(lua_State *L, opus_dec_data* dec_data, const unsigned char *data, size_t data_len,
+                     int decode_fec, int pcm_channels, opus_int16* temp_pcm)
+{
+  int sample_count;
+  int frame_size;
+
+  // the decoder always produces its own channel count, whatever the packet has
+  int channels = dec_data->channels;
+
+  if (data && data_len && !decode_fec) {
+    // exactly as much as the packet holds
+    frame_size = opus_check_error(L, opus_packet_get_nb_samples(data, (opus_int32)data_len, dec_data->samplerate));
+  } else {
+    // a lost packet is taken to be as long as the one before it, or 20ms to start with
+    opus_int32 duration = 0;
+    opus_check_error(L, opus_decoder_ctl(dec_data->dec, OPUS_GET_LAST_PACKET_DURATION(&duration)));
+    frame_size = duration > 0 ? duration : dec_data->samplerate / 50;
+
+    if (!decode_fec) {
+      data = NULL;
+      data_len = 0;
+    }
+  }
+
+  if (frame_size > MAX_SAMPLES_PER_FRAME) {
+    return luaL_error(L, "Too many samples in frame: %d", frame_size);
+  }
+
+  if (pcm_channels == 1 && channels == 2) {
+    sample_count = opus_check_error(L,opus_decode (dec_data->dec, data, (opus_int32)data_len, temp_pcm, frame_size, decode_fec));
+    pcm_downmix(temp_pcm, temp_pcm, sample_count);
+  } else if (pcm_channels == 2 && channels == 1) {
+    // decode into the back half so the samples can be doubled up in place
+    opus_int16 *pcm = temp_pcm + MAX_SAMPLES_PER_FRAME;
+    sample_count = opus_check_error(L,opus_decode (dec_data->dec, data, (opus_int32)data_len, pcm, frame_size, decode_fec));
+    pcm_duplicate(temp_pcm, pcm, sample_count);
+  } else if (pcm_channels == channels) {
+    sample_count = opus_check_error(L,opus_decode (dec_data->dec, data, (opus_int32)data_len, temp_pcm, frame_size, decode_fec));
+  } else {
+    return luaL_error(L, "Can't convert %d channels to %d", channels, pcm_channels);
+  }
+
+  return sample_count;
+}
+
 //-----------------------------------------------------------------------------
 
+// decode(frame, [channels]) - returns pcm with the decoder's channel count, or the given one.
+// a nil frame is a lost packet, concealed from what came before.
+
 LUALIB_API int opus_dec_decode(lua_State *L){
   opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
   int sample_count;
   int byte_count;
-  int channels;
+  int pcm_channels;
   const unsigned char *data;
   size_t data_len;
   
-  // TODO - this doesn't support FEC (framesize needs to be tailored for FEC...)
-  int frame_size = MAX_SAMPLES_PER_FRAME;
-  int decode_fec = 0;
-  
-  OpusDecoder* dec = check_dec(L, 1);
+  opus_dec_data* dec_data = check_dec_data(L, 1);
   int params = lua_gettop(L);
 
-  if (params == 2) {
+  if (params == 2 || params == 3) {
 
     data = (const unsigned char*)lua_tolstring (L, 2, &data_len); 
-    channels = opus_packet_get_nb_channels(data);  
 
-    sample_count = opus_check_error(L,opus_decode (dec, data, (opus_int32)data_len, temp_pcm, frame_size, decode_fec));
+    pcm_channels = luaL_optint(L, 3, dec_data->channels);
 
-    byte_count = sample_count * channels * SAMPLE_SIZE; 
+    sample_count = dec_frame(L, dec_data, data, data_len, 0, pcm_channels, temp_pcm);
+
+    byte_count = sample_count * pcm_channels * SAMPLE_SIZE; 
   } else {
-    return luaL_error(L, "Got %d arguments expected 2 (self, encoded frame)", params);
+    return luaL_error(L, "Got %d arguments expected 2 or 3 (self, encoded frame, [pcm channels])", params);
   } 
   
   lua_pushlstring (L, (const char *)temp_pcm, byte_count);
@@ -717,13 +953,85 @@ LUALIB_API int opus_dec_decode(lua_State *L){
   return 1;
 }
 
+//-----------------------------------------------------------------------------
+
+// decode_many(packets, lengths, [channels]) - decodes packets laid end to end in one
+// string, as encode_many returns them, each as long as the next entry in the lengths
+// table.  returns all of the pcm in one string.  a length of 0 is a lost packet, recovered
+// from the next packet's FEC if there is one, concealed if not.
+
+LUALIB_API int opus_dec_decode_many(lua_State *L){
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
+  opus_dec_data* dec_data = check_dec_data(L, 1);
+  size_t packets_len;
+  const unsigned char *packets = (const unsigned char*)luaL_checklstring(L, 2, &packets_len);
+  int pcm_channels = luaL_optint(L, 4, dec_data->channels);
+  size_t offset = 0;
+  int count, i;
+  luaL_Buffer b;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  count = lua_objlen(L, 3);
+
+  luaL_buffinit(L, &b);
+  for (i = 1; i <= count; i++) {
+    int length, next_length, sample_count;
+
+    lua_rawgeti(L, 3, i);
+    length = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, 3, i + 1);
+    next_length = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (length < 0 || offset + length > packets_len) {
+      return luaL_error(L, "Packet %d runs past the end of the packets", i);
+    }
+
+    if (length == 0 && next_length > 0 && offset + next_length <= packets_len) {
+      sample_count = dec_frame(L, dec_data, packets + offset, next_length, 1, pcm_channels, temp_pcm);
+    } else {
+      sample_count = dec_frame(L, dec_data, packets + offset, length, 0, pcm_channels, temp_pcm);
+    }
+    luaL_addlstring(&b, (const char *)temp_pcm, sample_count * pcm_channels * SAMPLE_SIZE);
+    offset += length;
+  }
+  luaL_pushresult(&b);
+
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+
+// recover([next frame], [channels]) - pcm for a lost packet.  from the next packet's
+// in-band FEC when it's given (and was encoded with it), by concealment otherwise.
+// decode the next packet as usual afterwards.
+
+LUALIB_API int opus_dec_recover(lua_State *L){
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
+  opus_dec_data* dec_data = check_dec_data(L, 1);
+  size_t data_len = 0;
+  const unsigned char *data = (const unsigned char*)lua_tolstring (L, 2, &data_len);
+  int pcm_channels = luaL_optint(L, 3, dec_data->channels);
+  int sample_count;
+
+  sample_count = dec_frame(L, dec_data, data, data_len, data != NULL, pcm_channels, temp_pcm);
+
+  lua_pushlstring (L, (const char *)temp_pcm, sample_count * pcm_channels * SAMPLE_SIZE);
+  return 1;
+}
+
 //------------------------------------------------------------------------------
 
 LUALIB_API int opus_dec_free(lua_State *L){
 
-  OpusDecoder** dec = luaL_checkudata(L, 1, "opus.decoder");
+  opus_dec_data* data = luaL_checkudata(L, 1, "opus.decoder");
 
-  opus_decoder_destroy (*dec);
+  if (data->dec) {
+    opus_decoder_destroy (data->dec);
+    data->dec = NULL;
+  }
 
   return 0;
 }
@@ -788,8 +1096,7 @@ LUALIB_API int opus_dec_samples_per_frame(lua_State *L){
     data = (const unsigned char*)luaL_checklstring(L, 2, &data_len);
      
     // we had saved away the sample rate, we need it now
-    lua_getfield(L, 1, "samplerate");
-    opus_int32 Fs = luaL_checkint(L, -1);
+    opus_int32 Fs = check_dec_data(L, 1)->samplerate;
 
     samples_per_frame = opus_check_error(L,opus_packet_get_samples_per_frame (data, Fs));
     lua_pushinteger(L, samples_per_frame);
@@ -814,8 +1121,7 @@ LUALIB_API int opus_dec_channels(lua_State *L){
     data = (const unsigned char*)lua_tolstring (L, 2, &data_len); 
     channels = opus_check_error(L,opus_packet_get_nb_channels (data));
   } else if (params == 1) {
-    lua_getfield(L, 1, "dec_channels");
-    channels = luaL_checkint(L, -1);
+    channels = check_dec_data(L, 1)->channels;
   } else {
     return luaL_error(L, "Got %d arguments expected 1 or 2 (self, optional frame data)", params);
   }
@@ -917,7 +1223,7 @@ LUALIB_API int opus_dec_reset(lua_State *L){
 
 //------------------------------------------------------------------------------
 
-OpusDecoder* check_dec(lua_State* L, int index)
+opus_dec_data* check_dec_data(lua_State* L, int index)
 {
   void* ud = 0;
   
@@ -930,7 +1236,459 @@ OpusDecoder* check_dec(lua_State* L, int index)
  
   luaL_argcheck(L, ud != 0, 0,"`opus.decoder' expected");  
 
-  return *((OpusDecoder**)ud);      
+  return (opus_dec_data*)ud;
+}
+
+OpusDecoder* check_dec(lua_State* L, int index)
+{
+  return check_dec_data(L, index)->dec;
+}
+
+
+//------------------------------------------------------------------------------
+// Packet store
+//------------------------------------------------------------------------------
+
+void register_store(lua_State *L)
+{
+  // Register metatable for user data in registry
+  luaL_newmetatable(L, "opus.store");
+  luaL_register(L, 0, store_gc_functions);
+  luaL_register(L, 0, store_functions);
+
+  // set the metatable as __index
+  lua_pushvalue(L,-1);
+  lua_setfield(L, -2, "__index");
+
+  lua_pop(L,1);
+}
+
+//------------------------------------------------------------------------------
+
+opus_store_data* check_store_data(lua_State* L, int index)
+{
+  void* ud = 0;
+
+  luaL_checktype(L, index, LUA_TTABLE);
+
+  lua_getfield(L, index, "__self");
+
+  ud = luaL_checkudata(L, -1, "opus.store");
+  lua_pop(L,1);
+
+  luaL_argcheck(L, ud != 0, 0,"`opus.store' expected");
+
+  return (opus_store_data*)ud;
+}
+
+//------------------------------------------------------------------------------
+// make room for one more packet of up to bytes long
+
+static void store_reserve(lua_State *L, opus_store_data* store, size_t bytes)
+{
+  if (store->size + bytes > store->capacity) {
+    size_t capacity = store->capacity * 2;
+    unsigned char* data;
+
+    if (capacity < store->size + bytes) {
+      capacity = store->size + bytes;
+    }
+
+    data = realloc(store->data, capacity);
+    if (!data) {
+      luaL_error(L, "Failed to grow packet store to %d bytes", (int)capacity);
+    }
+    store->data = data;
+    store->capacity = capacity;
+  }
+
+  if (store->count + 2 > store->slots) {
+    size_t* offsets = realloc(store->offsets, store->slots * 2 * sizeof(size_t));
+
+    if (!offsets) {
+      luaL_error(L, "Failed to grow packet store to %d packets", store->slots * 2);
+    }
+    store->offsets = offsets;
+    store->slots *= 2;
+  }
+}
+
+static void store_add(opus_store_data* store, size_t bytes)
+{
+  store->size += bytes;
+  store->count++;
+  store->offsets[store->count] = store->size;
+}
+
+// packet index from lua, 1 based, negative counts back from the last one
+static int store_index(lua_State *L, opus_store_data* store, int arg)
+{
+  int i = luaL_checkint(L, arg);
+
+  if (i < 0) {
+    i += store->count + 1;
+  }
+
+  if (i < 1 || i > store->count) {
+    luaL_error(L, "Packet %d is not in the store of %d", i, store->count);
+  }
+  return i - 1;
+}
+
+//------------------------------------------------------------------------------
+
+// newstore([bytes]) - an empty store, with room for bytes of packets before it grows
+
+LUALIB_API int opus_store_new(lua_State *L){
+  size_t bytes = luaL_optint(L, 1, STORE_DEFAULT_BYTES);
+
+  lua_newtable(L);
+
+  luaL_getmetatable(L, "opus.store");
+  lua_setmetatable(L, -2);
+
+  opus_store_data *store = (opus_store_data *)lua_newuserdata(L, sizeof(opus_store_data));
+  memset(store, 0, sizeof(opus_store_data));
+  luaL_getmetatable(L, "opus.store");
+  lua_setmetatable(L, -2);
+
+  lua_setfield(L, -2, "__self");
+
+  // anything that fails from here is freed by __gc
+  store->data = malloc(bytes ? bytes : 1);
+  store->offsets = malloc(STORE_DEFAULT_PACKETS * sizeof(size_t));
+  if (!store->data || !store->offsets) {
+    return luaL_error(L, "Failed to allocate packet store of %d bytes", (int)bytes);
+  }
+  store->capacity = bytes ? bytes : 1;
+  store->slots = STORE_DEFAULT_PACKETS;
+  store->offsets[0] = 0;
+
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+LUALIB_API int opus_store_free(lua_State *L){
+  opus_store_data* store = luaL_checkudata(L, 1, "opus.store");
+
+  free(store->data);
+  free(store->offsets);
+  store->data = NULL;
+  store->offsets = NULL;
+  store->count = 0;
+  store->size = 0;
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+// append(packet) - copies the packet onto the end, returns the packet count
+
+LUALIB_API int opus_store_append(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  size_t len;
+  const char* packet = luaL_checklstring(L, 2, &len);
+
+  store_reserve(L, store, len);
+  memcpy(store->data + store->size, packet, len);
+  store_add(store, len);
+
+  lua_pushinteger(L, store->count);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// append_many(packets, lengths) - appends what encoder:encode_many returns
+
+LUALIB_API int opus_store_append_many(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  size_t packets_len;
+  const char* packets = luaL_checklstring(L, 2, &packets_len);
+  size_t offset = 0;
+  int count, i;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  count = lua_objlen(L, 3);
+
+  for (i = 1; i <= count; i++) {
+    int length;
+
+    lua_rawgeti(L, 3, i);
+    length = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (length < 0 || offset + length > packets_len) {
+      return luaL_error(L, "Packet %d runs past the end of the packets", i);
+    }
+
+    store_reserve(L, store, length);
+    memcpy(store->data + store->size, packets + offset, length);
+    store_add(store, length);
+    offset += length;
+  }
+
+  lua_pushinteger(L, store->count);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// encode(encoder, pcm, [channels]) - encodes one frame straight into the store,
+// returns the packet's length
+
+LUALIB_API int opus_store_encode(lua_State *L){
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
+  opus_store_data* store = check_store_data(L, 1);
+  opus_enc_data* data = check_enc_data(L, 2);
+  size_t pcm_len;
+  const opus_int16 *pcm = (const opus_int16 *)luaL_checklstring(L, 3, &pcm_len);
+  int pcm_channels = luaL_optint(L, 4, data->channels);
+  int frame_size = pcm_len / SAMPLE_SIZE / pcm_channels;
+  opus_int32 encoded_bytes;
+
+  pcm = enc_convert(L, pcm, frame_size, pcm_channels, data->channels, temp_pcm);
+
+  store_reserve(L, store, MAX_FRAME_SIZE);
+  encoded_bytes = opus_check_error(L, opus_encode (data->enc, pcm, frame_size, store->data + store->size, MAX_FRAME_SIZE));
+  store_add(store, encoded_bytes);
+
+  lua_pushinteger(L, encoded_bytes);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// decode(decoder, index, [channels]) - decodes a packet without copying it out first
+
+LUALIB_API int opus_store_decode(lua_State *L){
+  opus_int16 temp_pcm[MAX_SAMPLES_PER_FRAME*MAX_CHANNELS];
+  opus_store_data* store = check_store_data(L, 1);
+  opus_dec_data* dec_data = check_dec_data(L, 2);
+  int i = store_index(L, store, 3);
+  int pcm_channels = luaL_optint(L, 4, dec_data->channels);
+  int sample_count;
+
+  sample_count = dec_frame(L, dec_data, store->data + store->offsets[i],
+                           store->offsets[i + 1] - store->offsets[i], 0, pcm_channels, temp_pcm);
+
+  lua_pushlstring (L, (const char *)temp_pcm, sample_count * pcm_channels * SAMPLE_SIZE);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// get(index) - the packet as a string, negative indexes count back from the end
+
+LUALIB_API int opus_store_get(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  int i = store_index(L, store, 2);
+
+  lua_pushlstring(L, (const char *)store->data + store->offsets[i], store->offsets[i + 1] - store->offsets[i]);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+LUALIB_API int opus_store_count(lua_State *L){
+  lua_pushinteger(L, check_store_data(L, 1)->count);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+LUALIB_API int opus_store_bytes(lua_State *L){
+  lua_pushinteger(L, check_store_data(L, 1)->size);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// truncate(n) - drops the last n packets, returns the packet count
+
+LUALIB_API int opus_store_truncate(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  int n = luaL_checkint(L, 2);
+
+  if (n < 0) {
+    return luaL_error(L, "Can't truncate %d packets", n);
+  }
+
+  store->count = n < store->count ? store->count - n : 0;
+  store->size = store->offsets[store->count];
+
+  lua_pushinteger(L, store->count);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+
+// clear() - empties the store, keeping its memory for the next recording
+
+LUALIB_API int opus_store_clear(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+
+  store->count = 0;
+  store->size = 0;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+static int store_next(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  int i = luaL_checkint(L, 2);
+
+  if (i >= store->count) {
+    return 0;
+  }
+
+  lua_pushinteger(L, i + 1);
+  lua_pushlstring(L, (const char *)store->data + store->offsets[i], store->offsets[i + 1] - store->offsets[i]);
+  return 2;
+}
+
+// packets() - for i, packet in store:packets() do ... end
+
+LUALIB_API int opus_store_packets(lua_State *L){
+  check_store_data(L, 1);
+
+  lua_pushcfunction(L, store_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+//------------------------------------------------------------------------------
+
+static void put_le16(unsigned char* p, unsigned int x)
+{
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char* p, opus_uint32 x)
+{
+  put_le16(p, x & 0xffff);
+  put_le16(p + 2, x >> 16);
+}
+
+static int write_page(FILE* file, const ogg_page* page)
+{
+  return fwrite(page->header, 1, page->header_len, file) == (size_t)page->header_len &&
+         fwrite(page->body, 1, page->body_len, file) == (size_t)page->body_len;
+}
+
+// write_ogg(path, [channels], [samplerate], [preskip]) - saves the packets as an ogg opus
+// file.  channels (default 1) and samplerate (default 48000) are what was encoded, preskip
+// defaults to what the encoder adds at 48k.  the packets go to libogg straight from the store.
+
+LUALIB_API int opus_store_write_ogg(lua_State *L){
+  opus_store_data* store = check_store_data(L, 1);
+  const char* path = luaL_checkstring(L, 2);
+  int channels = luaL_optint(L, 3, 1);
+  opus_int32 Fs = luaL_optint(L, 4, 48000);
+  int preskip = luaL_optint(L, 5, OGG_DEFAULT_PRESKIP);
+  const char* vendor = opus_get_version_string();
+  size_t vendor_len = strlen(vendor);
+
+  unsigned char head[19];
+  unsigned char tags[8 + 4 + 256 + 4];
+  ogg_stream_state os;
+  ogg_packet op;
+  ogg_page og;
+  ogg_int64_t granule = 0;
+  FILE* file;
+  int ok = 1;
+  int i;
+
+  if (channels < 1 || channels > MAX_CHANNELS) {
+    return luaL_error(L, "Invalid channels: %d", channels);
+  }
+
+  if (store->count == 0) {
+    return luaL_error(L, "No packets to write");
+  }
+
+  if (vendor_len > 256) {
+    vendor_len = 256;
+  }
+
+  file = fopen(path, "wb");
+  if (!file) {
+    return luaL_error(L, "Failed to open %s for writing", path);
+  }
+
+  ogg_stream_init(&os, (int)time(NULL));
+
+  // OpusHead, version 1, no output gain, channel mapping family 0
+  memcpy(head, "OpusHead", 8);
+  head[8] = 1;
+  head[9] = channels;
+  put_le16(head + 10, preskip);
+  put_le32(head + 12, Fs);
+  put_le16(head + 16, 0);
+  head[18] = 0;
+
+  memset(&op, 0, sizeof(op));
+  op.packet = head;
+  op.bytes = sizeof(head);
+  op.b_o_s = 1;
+  ogg_stream_packetin(&os, &op);
+  while (ok && ogg_stream_flush(&os, &og)) {
+    ok = write_page(file, &og);
+  }
+
+  // OpusTags, the vendor string and no comments
+  memcpy(tags, "OpusTags", 8);
+  put_le32(tags + 8, vendor_len);
+  memcpy(tags + 12, vendor, vendor_len);
+  put_le32(tags + 12 + vendor_len, 0);
+
+  op.packet = tags;
+  op.bytes = 12 + vendor_len + 4;
+  op.b_o_s = 0;
+  op.packetno = 1;
+  ogg_stream_packetin(&os, &op);
+  while (ok && ogg_stream_flush(&os, &og)) {
+    ok = write_page(file, &og);
+  }
+
+  // the audio must start on a fresh page, the headers are already out
+  for (i = 0; ok && i < store->count; i++) {
+    unsigned char* packet = store->data + store->offsets[i];
+    opus_int32 len = store->offsets[i + 1] - store->offsets[i];
+    int samples = opus_packet_get_nb_samples(packet, len, 48000);
+
+    if (samples > 0) {
+      granule += samples;
+    }
+
+    op.packet = packet;
+    op.bytes = len;
+    op.granulepos = granule;
+    op.packetno = i + 2;
+    op.e_o_s = i == store->count - 1;
+    ogg_stream_packetin(&os, &op);
+
+    while (ok && ogg_stream_pageout(&os, &og)) {
+      ok = write_page(file, &og);
+    }
+  }
+
+  while (ok && ogg_stream_flush(&os, &og)) {
+    ok = write_page(file, &og);
+  }
+
+  ogg_stream_clear(&os);
+
+  if (fclose(file) != 0 || !ok) {
+    return luaL_error(L, "Failed to write %s", path);
+  }
+
+  return 0;
 }
 
 
@@ -954,7 +1712,10 @@ LUALIB_API int opus_help(lua_State *L){
 
       // TODO
       "help - this message\n"
-      "version - version string\n");
+      "version - version string\n"
+      "newencoder(samplerate, channels, application) - encoder\n"
+      "newdecoder(samplerate, channels) - decoder\n"
+      "newstore([bytes]) - packet store for recordings\n");
     return 1;
 }
 
@@ -966,6 +1727,7 @@ LUALIB_API int luaopen_opus (lua_State *L) {
     
     register_dec(L);
     register_enc(L);
+    register_store(L);
 
     return 1;
 }
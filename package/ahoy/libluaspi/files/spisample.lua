@@ -8,7 +8,7 @@ end
     
 local spi = require "spi"
 
-spi.open("/dev/spidev1.0")
+local port = spi.open("/dev/spidev1.0")
 
 --local fullduplex = spi.rw("1",1)
 
@@ -16,6 +16,9 @@ spi.open("/dev/spidev1.0")
 
 --local halfwrite = spi.write(string.char(value))
 
+-- an LED command and a button read in one ioctl, on the handle rather than the default port
+--local buttons = port:transfer_many({ string.char(0x83, 255, 0, 0), 1 })
+
 local value
 spi.write(string.char(128+10, 
 	2,2,2, 0, 1,  
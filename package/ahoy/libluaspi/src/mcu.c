@@ -0,0 +1,451 @@
+/*
+
+Lua Ahoy MCU Library
+
+The AVR on the SPI bus debounces the buttons at about 120Hz and runs the
+LED animations.  Rather than have lua poll it in a loop, a thread here reads
+the buttons at a fixed rate and writes an event down a pipe for every
+change, so the app can block in poll()/socket.select() on mcu:fd().  LED
+commands are queued and sent on the next poll's SPI transaction, a newer
+command replacing one that hasn't gone out yet.
+
+Authors:   0.01 - Dean Blackketter, Ahoy!
+
+*/
+
+// clock_nanosleep and friends aren't in plain c99
+#define _POSIX_C_SOURCE 200112L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define MCU_HANDLE_KEY "mcu.handle"
+
+// the firmware's debounce rate, polling faster only sees the same state again
+#define MCU_DEFAULT_RATE (120)
+
+// the low 4 bits of every byte the MCU sends back are the buttons
+#define MCU_BUTTON_MASK (0x0f)
+
+// a command byte (0x8n) and up to 15 bytes after it
+#define MCU_COMMAND_MAX (16)
+
+// events that fit in the pipe before new ones are dropped, more than enough at 120Hz
+#define MCU_EVENTS_PER_READ (32)
+
+typedef struct {
+  uint8_t button;       // bit number
+  uint8_t down;
+  uint8_t state;        // all of the buttons, after this change
+  uint8_t pad;
+  uint32_t sec;         // gettimeofday, like socket.gettime()
+  uint32_t usec;
+} mcu_event;
+
+typedef struct {
+  int spi;              // -1 once closed
+  int events[2];        // pipe, lua polls the read end
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+
+  // shared with the polling thread, under lock
+  long period;          // nanoseconds between polls
+  uint8_t state;        // buttons as of the last poll
+  uint8_t led[MCU_COMMAND_MAX];
+  size_t ledLength;     // 0 when there is no LED command waiting
+  uint32_t errors;      // failed SPI transactions
+} mcu_handle;
+
+/* prototypes */
+LUALIB_API int luaopen_mcu (lua_State *L);
+
+LUALIB_API int mcu_version(lua_State *L);
+LUALIB_API int mcu_open(lua_State *L);
+LUALIB_API int mcu_close(lua_State *L);
+LUALIB_API int mcu_fd(lua_State *L);
+LUALIB_API int mcu_state(lua_State *L);
+LUALIB_API int mcu_events(lua_State *L);
+LUALIB_API int mcu_wait(lua_State *L);
+LUALIB_API int mcu_led(lua_State *L);
+LUALIB_API int mcu_rate(lua_State *L);
+LUALIB_API int mcu_errors(lua_State *L);
+
+/* functions exposed to lua */
+static const luaL_reg mcu_functions[] = {
+  {"version", mcu_version},
+  {"open", mcu_open},
+  {NULL, NULL}
+};
+
+static const luaL_reg mcu_handle_functions[] = {
+  {"close", mcu_close},
+  {"fd", mcu_fd},
+  {"state", mcu_state},
+  {"events", mcu_events},
+  {"wait", mcu_wait},
+  {"led", mcu_led},
+  {"rate", mcu_rate},
+  {"errors", mcu_errors},
+  {"__gc", mcu_close},
+  {NULL, NULL}
+};
+
+
+/* init function, will be called when lua run require */
+LUALIB_API int luaopen_mcu (lua_State *L) {
+    luaL_newmetatable(L, MCU_HANDLE_KEY);
+    luaL_register(L, 0, mcu_handle_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_openlib(L, "mcu", mcu_functions, 0);
+    return 1;
+}
+
+
+
+LUALIB_API int mcu_version(lua_State *L){
+    lua_pushstring(L, "mcu version 0.01, Dean Blackketter");
+
+    return 1;
+}
+
+static mcu_handle* check_handle(lua_State *L, int index) {
+  mcu_handle* mcu = (mcu_handle*)luaL_checkudata(L, index, MCU_HANDLE_KEY);
+
+  if (mcu->spi < 0)
+    luaL_error(L, "mcu is closed");
+
+  return mcu;
+}
+
+// one SPI transaction: the LED command, or a nop, then a byte back with the buttons
+static int transact(int spi, const uint8_t* command, size_t length, uint8_t* buttons) {
+  static const uint8_t nop = 0;
+  struct spi_ioc_transfer xfer[2];
+  uint8_t rx = 0;
+  int status;
+
+  memset(xfer, 0, sizeof xfer);
+
+  xfer[0].tx_buf = (unsigned long)(length ? command : &nop);
+  xfer[0].len = length ? length : 1;
+
+  xfer[1].rx_buf = (unsigned long)&rx;
+  xfer[1].len = 1;
+
+  status = ioctl(spi, SPI_IOC_MESSAGE(2), xfer);
+  *buttons = rx & MCU_BUTTON_MASK;
+  return status;
+}
+
+static void* poll_thread(void* arg) {
+  mcu_handle* mcu = (mcu_handle*)arg;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  for (;;) {
+    uint8_t command[MCU_COMMAND_MAX];
+    size_t length;
+    uint8_t buttons, changed;
+    long period;
+    struct timespec now;
+
+    pthread_mutex_lock(&mcu->lock);
+    if (!mcu->running) {
+      pthread_mutex_unlock(&mcu->lock);
+      break;
+    }
+    length = mcu->ledLength;
+    memcpy(command, mcu->led, length);
+    mcu->ledLength = 0;
+    period = mcu->period;
+    pthread_mutex_unlock(&mcu->lock);
+
+    if (transact(mcu->spi, command, length, &buttons) < 0) {
+      pthread_mutex_lock(&mcu->lock);
+      mcu->errors++;
+      pthread_mutex_unlock(&mcu->lock);
+    } else {
+      pthread_mutex_lock(&mcu->lock);
+      changed = buttons ^ mcu->state;
+      mcu->state = buttons;
+      pthread_mutex_unlock(&mcu->lock);
+
+      if (changed) {
+        struct timeval tv;
+        int bit;
+
+        gettimeofday(&tv, NULL);
+        for (bit = 0; bit < 4; bit++) {
+          mcu_event event;
+
+          if (!(changed & (1 << bit)))
+            continue;
+
+          event.button = bit;
+          event.down = (buttons >> bit) & 1;
+          event.state = buttons;
+          event.pad = 0;
+          event.sec = tv.tv_sec;
+          event.usec = tv.tv_usec;
+
+          // a full pipe means lua has stopped listening, the state is still kept
+          if (write(mcu->events[1], &event, sizeof(event)) < 0 && errno != EAGAIN) {
+            pthread_mutex_lock(&mcu->lock);
+            mcu->errors++;
+            pthread_mutex_unlock(&mcu->lock);
+          }
+        }
+      }
+    }
+
+    // keep to the rate, but don't try to catch up after falling behind
+    next.tv_nsec += period;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+      next = now;
+    } else {
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+        ;
+    }
+  }
+
+  return NULL;
+}
+
+static long rate_to_period(lua_State *L, lua_Number rate) {
+  if (rate <= 0 || rate > 1000)
+    luaL_error(L, "Poll rate must be between 0 and 1000 per second, not %f", rate);
+
+  return (long)(1000000000.0 / rate);
+}
+
+// mcu.open(path, [rate]) starts polling the MCU at rate times a second (default 120)
+LUALIB_API int mcu_open(lua_State *L) {
+  const char* path = luaL_checkstring(L, 1);
+  long period = rate_to_period(L, luaL_optnumber(L, 2, MCU_DEFAULT_RATE));
+  mcu_handle* mcu;
+  int err;
+
+  mcu = (mcu_handle*)lua_newuserdata(L, sizeof(mcu_handle));
+  memset(mcu, 0, sizeof(mcu_handle));
+  mcu->spi = -1;
+  mcu->events[0] = mcu->events[1] = -1;
+  mcu->period = period;
+  pthread_mutex_init(&mcu->lock, NULL);
+  luaL_getmetatable(L, MCU_HANDLE_KEY);
+  lua_setmetatable(L, -2);
+
+  // errors from here on leave the handle to be closed by __gc
+  mcu->spi = open(path, O_RDWR);
+  if (mcu->spi < 0)
+    return luaL_error(L, "SPI Open failed: %s", strerror(errno));
+
+  if (pipe(mcu->events) < 0)
+    return luaL_error(L, "Failed to create the mcu event pipe: %s", strerror(errno));
+
+  fcntl(mcu->events[0], F_SETFL, O_NONBLOCK);
+  fcntl(mcu->events[1], F_SETFL, O_NONBLOCK);
+  fcntl(mcu->events[0], F_SETFD, FD_CLOEXEC);
+  fcntl(mcu->events[1], F_SETFD, FD_CLOEXEC);
+
+  // start from the buttons as they are, so ones already held don't show up as presses
+  if (transact(mcu->spi, NULL, 0, &mcu->state) < 0)
+    return luaL_error(L, "Failed to read the mcu: %s", strerror(errno));
+
+  mcu->running = 1;
+  err = pthread_create(&mcu->thread, NULL, poll_thread, mcu);
+  if (err) {
+    mcu->running = 0;
+    return luaL_error(L, "Failed to start the mcu thread: %s", strerror(err));
+  }
+
+  return 1;
+}
+
+// also the __gc method, closing twice is harmless
+LUALIB_API int mcu_close(lua_State *L) {
+  mcu_handle* mcu = (mcu_handle*)luaL_checkudata(L, 1, MCU_HANDLE_KEY);
+
+  if (mcu->running) {
+    pthread_mutex_lock(&mcu->lock);
+    mcu->running = 0;
+    pthread_mutex_unlock(&mcu->lock);
+    pthread_join(mcu->thread, NULL);
+  }
+
+  if (mcu->spi >= 0) {
+    close(mcu->spi);
+    mcu->spi = -1;
+  }
+
+  if (mcu->events[0] >= 0) {
+    close(mcu->events[0]);
+    close(mcu->events[1]);
+    mcu->events[0] = mcu->events[1] = -1;
+  }
+
+  return 0;
+}
+
+// the fd that's readable when there are button events, for socket.select() or poll()
+LUALIB_API int mcu_fd(lua_State *L) {
+  lua_pushinteger(L, check_handle(L, 1)->events[0]);
+  return 1;
+}
+
+// the buttons as of the last poll, bit 0 is main
+LUALIB_API int mcu_state(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  uint8_t state;
+
+  pthread_mutex_lock(&mcu->lock);
+  state = mcu->state;
+  pthread_mutex_unlock(&mcu->lock);
+
+  lua_pushinteger(L, state);
+  return 1;
+}
+
+// mcu:events() returns the button changes since the last call, oldest first, as a table
+// of {button = bit, down = boolean, state = all buttons, time = seconds}
+LUALIB_API int mcu_events(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  mcu_event events[MCU_EVENTS_PER_READ];
+  int count = 0;
+
+  lua_newtable(L);
+
+  for (;;) {
+    ssize_t got = read(mcu->events[0], events, sizeof(events));
+    int i;
+
+    if (got < 0 && errno == EINTR)
+      continue;
+
+    if (got <= 0)
+      break;
+
+    for (i = 0; i < got / (ssize_t)sizeof(mcu_event); i++) {
+      lua_createtable(L, 0, 4);
+
+      lua_pushinteger(L, events[i].button);
+      lua_setfield(L, -2, "button");
+
+      lua_pushboolean(L, events[i].down);
+      lua_setfield(L, -2, "down");
+
+      lua_pushinteger(L, events[i].state);
+      lua_setfield(L, -2, "state");
+
+      lua_pushnumber(L, events[i].sec + events[i].usec / 1e6);
+      lua_setfield(L, -2, "time");
+
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+
+  return 1;
+}
+
+// mcu:wait([timeout]) blocks up to timeout seconds (forever when nil or negative) for
+// button events, returns true if there are some to read
+LUALIB_API int mcu_wait(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+  struct pollfd pfd;
+  int result;
+
+  pfd.fd = mcu->events[0];
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  do {
+    result = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+  } while (result < 0 && errno == EINTR);
+
+  if (result < 0)
+    return luaL_error(L, "Failed to poll the mcu: %s", strerror(errno));
+
+  lua_pushboolean(L, result > 0);
+  return 1;
+}
+
+// mcu:led(command) sends an LED command (see mcu-firmware) with the next poll
+LUALIB_API int mcu_led(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  size_t length;
+  const char* command = luaL_checklstring(L, 2, &length);
+
+  if (length == 0 || length > MCU_COMMAND_MAX)
+    return luaL_error(L, "LED commands are 1 to %d bytes, not %d", MCU_COMMAND_MAX, (int)length);
+
+  pthread_mutex_lock(&mcu->lock);
+  memcpy(mcu->led, command, length);
+  mcu->ledLength = length;
+  pthread_mutex_unlock(&mcu->lock);
+
+  return 0;
+}
+
+// mcu:rate([rate]) changes how many times a second the MCU is polled, returns the rate
+LUALIB_API int mcu_rate(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  long period;
+
+  if (lua_gettop(L) > 1) {
+    period = rate_to_period(L, luaL_checknumber(L, 2));
+    pthread_mutex_lock(&mcu->lock);
+    mcu->period = period;
+    pthread_mutex_unlock(&mcu->lock);
+  }
+
+  pthread_mutex_lock(&mcu->lock);
+  period = mcu->period;
+  pthread_mutex_unlock(&mcu->lock);
+
+  lua_pushnumber(L, 1e9 / period);
+  return 1;
+}
+
+// the number of SPI transactions or event writes that have failed
+LUALIB_API int mcu_errors(lua_State *L) {
+  mcu_handle* mcu = check_handle(L, 1);
+  uint32_t errors;
+
+  pthread_mutex_lock(&mcu->lock);
+  errors = mcu->errors;
+  pthread_mutex_unlock(&mcu->lock);
+
+  lua_pushnumber(L, errors);
+  return 1;
+}
@@ -24,7 +24,20 @@ Authors:   0.01 - Dean Blackketter, Ahoy!
 #include "lauxlib.h"
 #include "lualib.h"
 
-int fd;  // global file descriptor for SPI port TODO: Make this not global, i.e. allow multiple open spi ports
+#define SPI_HANDLE_KEY "spi.handle"
+
+// the handle the module level calls use, the last one opened
+#define SPI_DEFAULT_KEY "spi.default"
+
+// spidev rejects messages longer than its bufsiz, 4096 unless the module was loaded with more
+#define SPI_MAX_TRANSFER (4096)
+
+// segments in one transfer_many
+#define SPI_MAX_SEGMENTS (16)
+
+typedef struct {
+  int fd;   // -1 once closed
+} spi_handle;
 
 /* prototypes */
 LUALIB_API int luaopen_spi (lua_State *L);
@@ -33,14 +46,16 @@ LUALIB_API int spi_version(lua_State *L);
 LUALIB_API int spi_help(lua_State *L);
 LUALIB_API int spi_open(lua_State *L);
 LUALIB_API int spi_close(lua_State *L);
+LUALIB_API int spi_gc(lua_State *L);
 LUALIB_API int spi_write(lua_State *L);
 LUALIB_API int spi_read(lua_State *L);
 LUALIB_API int spi_rw(lua_State *L);
+LUALIB_API int spi_transfer_many(lua_State *L);
 
 static int spi_do( int fd, const char* wdata, size_t wlen,
                             char* rdata, size_t rlen );
 
-/* functions exposed to lua */
+/* functions exposed to lua, each works on the default port as spi.write(...) or on a handle as port:write(...) */
 static const luaL_reg spi_functions[] = {
   {"version", spi_version},
   {"help", spi_help},
@@ -49,12 +64,29 @@ static const luaL_reg spi_functions[] = {
   {"write", spi_write},
   {"read", spi_read},
   {"rw", spi_rw},
+  {"transfer_many", spi_transfer_many},
+  {NULL, NULL}
+};
+
+static const luaL_reg spi_handle_functions[] = {
+  {"close", spi_close},
+  {"write", spi_write},
+  {"read", spi_read},
+  {"rw", spi_rw},
+  {"transfer_many", spi_transfer_many},
+  {"__gc", spi_gc},
   {NULL, NULL}
 };
 
 
 /* init function, will be called when lua run require */
 LUALIB_API int luaopen_spi (lua_State *L) {
+    luaL_newmetatable(L, SPI_HANDLE_KEY);
+    luaL_register(L, 0, spi_handle_functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_openlib(L, "spi", spi_functions, 0);
     return 1;
 }
@@ -62,22 +94,56 @@ LUALIB_API int luaopen_spi (lua_State *L) {
 
 
 LUALIB_API int spi_version(lua_State *L){
-    lua_pushstring(L, "spi version 0.01, Dean Blackketter");
+    lua_pushstring(L, "spi version 0.02, Dean Blackketter");
 
     return 1;
 }
 
 LUALIB_API int spi_help(lua_State *L){
   lua_pushstring(L, "usage:\n"
-              "open(device)\n"
+              "port = open(device), also becomes the port the module level calls use\n"
               "close()\n"
               "write(string)\n"
               "rdata = read([count(int), defaults to 1])\n"
               "rdata = rw(wdata, [readcount(int), defaults to length of string])\n"
+              "rdata = transfer_many({segment, ...}), one ioctl, the read bytes of every segment joined\n"
+              "  segment is a string to write, a count to read, or a table of\n"
+              "  {write=string, read=count, speed=hz, cs_change=bool, delay=usecs, bits=bits per word}\n"
+              "each also works on a port, as port:write(string) and so on\n"
               "version - version string\n");
   return 1;
 }
 
+// the handle to use and the index of the first real argument, a handle passed first, or the default one
+static spi_handle* to_handle(lua_State *L, int* first) {
+  spi_handle* spi = NULL;
+
+  if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+    luaL_getmetatable(L, SPI_HANDLE_KEY);
+    if (lua_rawequal(L, -1, -2))
+      spi = (spi_handle*)lua_touserdata(L, 1);
+    lua_pop(L, 2);
+  }
+
+  if (spi) {
+    *first = 2;
+  } else {
+    *first = 1;
+    // the registry holds a reference, so this stays valid after the pop
+    lua_getfield(L, LUA_REGISTRYINDEX, SPI_DEFAULT_KEY);
+    spi = (spi_handle*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (spi == NULL)
+      luaL_error(L, "SPI port is not open");
+  }
+
+  if (spi->fd < 0)
+    luaL_error(L, "SPI port is closed");
+
+  return spi;
+}
+
 LUALIB_API int spi_open(lua_State *L) {
 
   if (lua_gettop(L) != 1) {
@@ -85,104 +151,242 @@ LUALIB_API int spi_open(lua_State *L) {
   }
   
   const char* path = luaL_checkstring(L,1);
-  fd = open(path, O_RDWR);
-  if (fd < 0) {
+  spi_handle* spi = (spi_handle*)lua_newuserdata(L, sizeof(spi_handle));
+
+  spi->fd = open(path, O_RDWR);
+  if (spi->fd < 0) {
     return luaL_error(L, "SPI Open failed: %s", strerror(errno));
   }
-  return 0;
+
+  luaL_getmetatable(L, SPI_HANDLE_KEY);
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, SPI_DEFAULT_KEY);
+
+  return 1;
 }
 
 LUALIB_API int spi_close(lua_State *L) {
+  int first;
+  spi_handle* spi = to_handle(L, &first);
 
-  if (fd) 
-    close(fd);
-    
-  fd = 0;  
+  close(spi->fd);
+  spi->fd = -1;
+
+  // forget the default once it's closed
+  lua_getfield(L, LUA_REGISTRYINDEX, SPI_DEFAULT_KEY);
+  if (lua_touserdata(L, -1) == spi) {
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, SPI_DEFAULT_KEY);
+  }
+  lua_pop(L, 1);
+
+  return 0;
+}
+
+LUALIB_API int spi_gc(lua_State *L) {
+  spi_handle* spi = (spi_handle*)luaL_checkudata(L, 1, SPI_HANDLE_KEY);
+
+  if (spi->fd >= 0)
+    close(spi->fd);
+
+  spi->fd = -1;
   return 0;
 }
 
 LUALIB_API int spi_write(lua_State *L){
 
+    int first;
+    spi_handle* spi = to_handle(L, &first);
     size_t wlen = 0;  // strict compiler thinks wlen may be uninitialized
 
-    if (lua_gettop(L) != 1) {
+    if (lua_gettop(L) != first) {
         return luaL_error(L, "Wrong number of arguments");
     }
     
-    const char* wdata = luaL_checklstring(L, 1, &wlen);
+    const char* wdata = luaL_checklstring(L, first, &wlen);
 
-    int status = spi_do(fd, wdata, wlen, NULL, 0);
+    int status = spi_do(spi->fd, wdata, wlen, NULL, 0);
     
     if (status < 0)
-      luaL_error(L,"ioctl failed, return %d", strerror(status));
+      luaL_error(L,"ioctl failed: %s", strerror(errno));
     
     return 0;
 }
 
 LUALIB_API int spi_read(lua_State *L){
 
+  int first;
+  spi_handle* spi = to_handle(L, &first);
   size_t rlen = 1;
+  char rdata[SPI_MAX_TRANSFER];
   
-  if (lua_gettop(L) == 1) {
-      rlen = luaL_checkint(L, 1);    
-  } else if (lua_gettop(L) == 0) {
+  if (lua_gettop(L) == first) {
+      rlen = luaL_checkint(L, first);
+  } else if (lua_gettop(L) == first - 1) {
       rlen = 1;
   } else {
       return luaL_error(L, "Wrong number of arguments");
   }
   
-  char* rdata = malloc(rlen);
-  
-  if (rdata == NULL)
-    return luaL_error(L, "Malloc failed with data read of length %d\n", rlen);
+  if (rlen > SPI_MAX_TRANSFER)
+    return luaL_error(L, "Read of %d bytes is longer than the %d spidev allows", (int)rlen, SPI_MAX_TRANSFER);
     
-  int status = spi_do(fd, NULL, 0, rdata, rlen);
+  int status = spi_do(spi->fd, NULL, 0, rdata, rlen);
   if (status < 0)
-    luaL_error(L,"ioctl failed, return %d", strerror(status));
+    luaL_error(L,"ioctl failed: %s", strerror(errno));
 
   lua_pushlstring(L,rdata, rlen);
-  free(rdata);
   return 1;
    
 }
 
 LUALIB_API int spi_rw(lua_State *L){
+  int first;
+  spi_handle* spi = to_handle(L, &first);
   size_t rlen = 1;
   size_t wlen;
-  char* rdata;
+  char rdata[SPI_MAX_TRANSFER];
   const char* wdata;
   
-  int params = lua_gettop(L);  
+  int params = lua_gettop(L) - first + 1;
 
   if (params > 2 || params < 1)  {
       return luaL_error(L, "Wrong number of arguments");
   }
   
-  wdata = luaL_checklstring(L, 1, &wlen);
+  wdata = luaL_checklstring(L, first, &wlen);
     
-  if (lua_gettop(L) == 2) {
-      rlen = luaL_checkint(L, 2);    
-  } else if (lua_gettop(L) == 1) {
+  if (params == 2) {
+      rlen = luaL_checkint(L, first + 1);
+  } else {
       rlen = wlen;
   }
  
-  rdata = malloc(rlen);
-  
-  if (rdata == NULL)
-    return luaL_error(L, "Malloc failed with data read of length %d\n", rlen);
+  if (rlen > SPI_MAX_TRANSFER)
+    return luaL_error(L, "Read of %d bytes is longer than the %d spidev allows", (int)rlen, SPI_MAX_TRANSFER);
     
-  int status = spi_do(fd, wdata, wlen, rdata, rlen);
+  int status = spi_do(spi->fd, wdata, wlen, rdata, rlen);
   
   if (status < 0)    
-    luaL_error(L,"ioctl failed, return %d", strerror(status));
+    luaL_error(L,"ioctl failed: %s", strerror(errno));
 
   lua_pushlstring(L, rdata, rlen);
-  free(rdata);
 
   return 1;
 }
 
-int spi_do( int fd, const char* wdata, size_t wlen,
+// fills in one transfer_many segment from the value on top of the stack, returns its length
+static size_t spi_segment(lua_State *L, int arg, int index, struct spi_ioc_transfer* xfer,
+                          char* tx, char* rx, size_t* used, size_t* rlen) {
+  const char* wdata = NULL;
+  size_t wlen = 0;
+  lua_Integer count = 0;
+  size_t read;
+  size_t len;
+
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    wdata = lua_tolstring(L, -1, &wlen);
+  } else if (lua_type(L, -1) == LUA_TNUMBER) {
+    count = lua_tointeger(L, -1);
+  } else if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "write");
+    if (!lua_isnil(L, -1))
+      wdata = luaL_checklstring(L, -1, &wlen);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "read");
+    count = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "speed");
+    xfer->speed_hz = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "delay");
+    xfer->delay_usecs = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "bits");
+    xfer->bits_per_word = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "cs_change");
+    xfer->cs_change = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  } else {
+    return luaL_error(L, "Segment %d should be a string, a count or a table, not %s", index, luaL_typename(L, -1));
+  }
+
+  if (count < 0)
+    return luaL_argerror(L, arg, lua_pushfstring(L, "segment %d reads %d bytes", index, (int)count));
+  read = count;
+
+  // with both, the segment is full duplex, as long as the longer of the two, and all of it is read back
+  len = wlen > read ? wlen : read;
+
+  if (len == 0)
+    return luaL_error(L, "Segment %d is empty", index);
+
+  if (len > SPI_MAX_TRANSFER - *used)
+    return luaL_error(L, "Transfer is longer than the %d bytes spidev allows", SPI_MAX_TRANSFER);
+
+  if (wdata) {
+    memcpy(tx + *used, wdata, wlen);
+    memset(tx + *used + wlen, 0, len - wlen);
+    xfer->tx_buf = (unsigned long)(tx + *used);
+  }
+
+  if (read) {
+    xfer->rx_buf = (unsigned long)(rx + *rlen);
+    *rlen += len;
+  }
+
+  xfer->len = len;
+  *used += len;
+
+  return len;
+}
+
+// rdata = transfer_many(segments) sends every segment in one SPI_IOC_MESSAGE, without
+// dropping chip select between them unless a segment asks to
+LUALIB_API int spi_transfer_many(lua_State *L) {
+  int first;
+  spi_handle* spi = to_handle(L, &first);
+  struct spi_ioc_transfer xfer[SPI_MAX_SEGMENTS];
+  char tx[SPI_MAX_TRANSFER];
+  char rx[SPI_MAX_TRANSFER];
+  size_t used = 0;
+  size_t rlen = 0;
+  int count;
+  int i;
+
+  if (lua_gettop(L) != first)
+    return luaL_error(L, "Wrong number of arguments");
+
+  luaL_checktype(L, first, LUA_TTABLE);
+  count = lua_objlen(L, first);
+
+  if (count < 1 || count > SPI_MAX_SEGMENTS)
+    return luaL_error(L, "Got %d segments expected 1 to %d", count, SPI_MAX_SEGMENTS);
+
+  memset(xfer, 0, sizeof xfer);
+
+  for (i = 0; i < count; i++) {
+    lua_rawgeti(L, first, i + 1);
+    spi_segment(L, first, i + 1, &xfer[i], tx, rx, &used, &rlen);
+    lua_pop(L, 1);
+  }
+
+  if (ioctl(spi->fd, SPI_IOC_MESSAGE(count), xfer) < 0)
+    return luaL_error(L, "ioctl failed: %s", strerror(errno));
+
+  lua_pushlstring(L, rx, rlen);
+  return 1;
+}
+
+static int spi_do( int fd, const char* wdata, size_t wlen,
                            char* rdata, size_t rlen ) {
       
       
@@ -0,0 +1,268 @@
+/*
+
+pcmconv-bench: checks each kernel against a sample at a time loop and
+reports how many samples a second each of them moves.
+
+  make bench && ./pcmconv-bench [seconds per kernel]
+
+Build it with the target's CC to measure the cost on the device itself.
+
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pcmconv.h"
+
+// one second of 48k stereo, a little more than the i2s ring holds
+#define BENCH_SAMPLES (48000 * 2)
+
+static int16_t* gIn16;
+static int16_t* gOut16;
+static int16_t* gRef16;
+static int32_t* gIn32;
+static int32_t* gOut32;
+static int32_t* gRef32;
+
+////////////////////////////////////////////////////////////////////////////////
+// sample at a time versions, what i2s.c and opus.c used to do
+
+static void __attribute__((noinline)) ref_duplicate(int16_t* dst, const int16_t* src, size_t samples) {
+  size_t i;
+  for (i = 0; i < samples; i++) {
+    dst[i * 2] = dst[i * 2 + 1] = src[i];
+  }
+}
+
+static void __attribute__((noinline)) ref_decimate(int16_t* dst, const int16_t* src, size_t frames) {
+  size_t i;
+  for (i = 0; i < frames; i++) {
+    dst[i] = src[i * 2];
+  }
+}
+
+static void __attribute__((noinline)) ref_downmix(int16_t* dst, const int16_t* src, size_t frames) {
+  size_t i;
+  for (i = 0; i < frames; i++) {
+    dst[i] = (int16_t)(((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1);
+  }
+}
+
+static void __attribute__((noinline)) ref_gain(int16_t* dst, const int16_t* src, size_t samples, int16_t gain) {
+  size_t i;
+  for (i = 0; i < samples; i++) {
+    int32_t x = ((int32_t)src[i] * gain) >> PCM_GAIN_SHIFT;
+    dst[i] = x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : (int16_t)x;
+  }
+}
+
+static void __attribute__((noinline)) ref_s16_to_s32(int32_t* dst, const int16_t* src, size_t samples) {
+  size_t i;
+  for (i = 0; i < samples; i++) {
+    dst[i] = (int32_t)((uint32_t)(uint16_t)src[i] << 16);
+  }
+}
+
+static void __attribute__((noinline)) ref_s32_to_s16(int16_t* dst, const int32_t* src, size_t samples) {
+  size_t i;
+  for (i = 0; i < samples; i++) {
+    dst[i] = (int16_t)(src[i] >> 16);
+  }
+}
+
+static void __attribute__((noinline)) ref_swap(int16_t* dst, const int16_t* src, size_t samples) {
+  size_t i;
+  for (i = 0; i < samples; i++) {
+    dst[i] = (int16_t)(((uint16_t)src[i] >> 8) | ((uint16_t)src[i] << 8));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+  DUPLICATE, DECIMATE, DOWNMIX, GAIN, S16_TO_S32, S32_TO_S16, SWAP, KERNEL_COUNT
+} kernel;
+
+static const char* kernelNames[KERNEL_COUNT] = {
+  "duplicate", "decimate", "downmix", "gain", "s16_to_s32", "s32_to_s16", "swap"
+};
+
+// gain below unity, and well above it so the saturation gets exercised
+static const int16_t gains[] = { PCM_GAIN_UNITY / 3, PCM_GAIN_UNITY * 5 };
+
+// runs one kernel over count input samples starting offset samples into the buffers
+static void run(kernel k, int reference, size_t offset, size_t count, int16_t gain) {
+  int16_t* out16 = reference ? gRef16 : gOut16;
+  int32_t* out32 = reference ? gRef32 : gOut32;
+
+  switch (k) {
+    case DUPLICATE:
+      (reference ? ref_duplicate : pcm_duplicate)(out16 + offset * 2, gIn16 + offset, count);
+      break;
+    case DECIMATE:
+      (reference ? ref_decimate : pcm_decimate)(out16 + offset, gIn16 + offset * 2, count / 2);
+      break;
+    case DOWNMIX:
+      (reference ? ref_downmix : pcm_downmix)(out16 + offset, gIn16 + offset * 2, count / 2);
+      break;
+    case GAIN:
+      (reference ? ref_gain : pcm_gain)(out16 + offset, gIn16 + offset, count, gain);
+      break;
+    case S16_TO_S32:
+      (reference ? ref_s16_to_s32 : pcm_s16_to_s32)(out32 + offset, gIn16 + offset, count);
+      break;
+    case S32_TO_S16:
+      (reference ? ref_s32_to_s16 : pcm_s32_to_s16)(out16 + offset, gIn32 + offset, count);
+      break;
+    case SWAP:
+      (reference ? ref_swap : pcm_swap)(out16 + offset, gIn16 + offset, count);
+      break;
+    default:
+      break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// odd lengths and offsets cover the alignment fix ups and the leftover samples
+
+static int check(kernel k) {
+  size_t offset, count;
+  size_t g;
+
+  for (g = 0; g < sizeof(gains) / sizeof(gains[0]); g++) {
+    for (offset = 0; offset < 4; offset++) {
+      for (count = 0; count < 70; count++) {
+        memset(gOut16, 0, BENCH_SAMPLES * 2 * sizeof(int16_t));
+        memset(gRef16, 0, BENCH_SAMPLES * 2 * sizeof(int16_t));
+        memset(gOut32, 0, BENCH_SAMPLES * sizeof(int32_t));
+        memset(gRef32, 0, BENCH_SAMPLES * sizeof(int32_t));
+
+        run(k, 0, offset, count, gains[g]);
+        run(k, 1, offset, count, gains[g]);
+
+        if (memcmp(gOut16, gRef16, BENCH_SAMPLES * 2 * sizeof(int16_t)) ||
+            memcmp(gOut32, gRef32, BENCH_SAMPLES * sizeof(int32_t))) {
+          fprintf(stderr, "%s differs from the reference at offset %d, count %d, gain %d\n",
+                  kernelNames[k], (int)offset, (int)count, gains[g]);
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// decimate, downmix and gain can also be run over their own input, like i2s.read does,
+// and duplicate from the back half of its output, like opus decode does
+static int checkInPlace(kernel k) {
+  size_t offset, count;
+
+  if (k != DUPLICATE && k != DECIMATE && k != DOWNMIX && k != GAIN)
+    return 1;
+
+  for (offset = 0; offset < 2; offset++) {
+    for (count = 0; count < 70; count += (k == DUPLICATE ? 1 : 2)) {
+      int16_t* buf = gOut16 + offset;
+
+      memcpy(k == DUPLICATE ? buf + count : buf, gIn16, count * sizeof(int16_t));
+      memset(gRef16, 0, count * 2 * sizeof(int16_t));
+
+      if (k == DUPLICATE) {
+        pcm_duplicate(buf, buf + count, count);
+        ref_duplicate(gRef16, gIn16, count);
+      } else if (k == DECIMATE) {
+        pcm_decimate(buf, buf, count / 2);
+        ref_decimate(gRef16, gIn16, count / 2);
+      } else if (k == DOWNMIX) {
+        pcm_downmix(buf, buf, count / 2);
+        ref_downmix(gRef16, gIn16, count / 2);
+      } else {
+        pcm_gain(buf, buf, count, gains[1]);
+        ref_gain(gRef16, gIn16, count, gains[1]);
+      }
+
+      if (memcmp(buf, gRef16, (k == DUPLICATE ? count * 2 : k == GAIN ? count : count / 2) * sizeof(int16_t))) {
+        fprintf(stderr, "%s in place differs from the reference at offset %d, count %d\n",
+                kernelNames[k], (int)offset, (int)count);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// input samples a second, running the kernel for about the given time
+static double rate(kernel k, int reference, double seconds) {
+  double start = now();
+  double elapsed;
+  long passes = 0;
+
+  do {
+    run(k, reference, 0, BENCH_SAMPLES, gains[1]);
+    passes++;
+    elapsed = now() - start;
+  } while (elapsed < seconds);
+
+  return passes * (double)BENCH_SAMPLES / elapsed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+  int failed = 0;
+  int i;
+
+  gIn16 = malloc(BENCH_SAMPLES * sizeof(int16_t));
+  gOut16 = malloc(BENCH_SAMPLES * 2 * sizeof(int16_t));
+  gRef16 = malloc(BENCH_SAMPLES * 2 * sizeof(int16_t));
+  gIn32 = malloc(BENCH_SAMPLES * sizeof(int32_t));
+  gOut32 = malloc(BENCH_SAMPLES * sizeof(int32_t));
+  gRef32 = malloc(BENCH_SAMPLES * sizeof(int32_t));
+
+  if (!gIn16 || !gOut16 || !gRef16 || !gIn32 || !gOut32 || !gRef32) {
+    fprintf(stderr, "Failed to allocate buffers\n");
+    return 1;
+  }
+
+  srand(1);
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    gIn16[i] = (int16_t)(rand() - RAND_MAX / 2);
+    gIn32[i] = (int32_t)(((uint32_t)rand() << 16) ^ (uint32_t)rand());
+  }
+
+  printf("pcmconv kernels: %s\n", pcm_kernels());
+  printf("%-12s %16s %16s %8s\n", "kernel", "samples/sec", "reference", "speedup");
+
+  for (i = 0; i < KERNEL_COUNT; i++) {
+    double fast, slow;
+
+    if (!check(i) || !checkInPlace(i)) {
+      failed = 1;
+      continue;
+    }
+
+    fast = rate(i, 0, seconds);
+    slow = rate(i, 1, seconds);
+    printf("%-12s %16.0f %16.0f %7.2fx\n", kernelNames[i], fast, slow, fast / slow);
+  }
+
+  free(gIn16);
+  free(gOut16);
+  free(gRef16);
+  free(gIn32);
+  free(gOut32);
+  free(gRef32);
+
+  return failed;
+}
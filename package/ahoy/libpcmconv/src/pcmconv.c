@@ -0,0 +1,366 @@
+/*
+
+PCM format conversion kernels
+
+Each kernel is a vector loop (SSE2 or NEON, when the compiler targets them),
+then a loop moving 32-bit words, which is what the AR9331's MIPS32 24K core
+gets without a DSP extension, then single samples for whatever is left.
+Define PCMCONV_NO_SIMD to build only the word and sample loops on a host.
+
+*/
+
+#include "pcmconv.h"
+
+#if defined(PCMCONV_NO_SIMD)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PCM_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PCM_NEON
+#endif
+
+// two samples, allowed to alias the int16_t buffers they're loaded from
+typedef uint32_t __attribute__((__may_alias__)) pcm_word;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+// the AR9331 is big endian, the first sample in memory is the high half
+#define FIRST(w)   ((int16_t)((w) >> 16))
+#define SECOND(w)  ((int16_t)(w))
+#define PACK(a, b) (((uint32_t)(uint16_t)(a) << 16) | (uint16_t)(b))
+#else
+#define FIRST(w)   ((int16_t)(w))
+#define SECOND(w)  ((int16_t)((w) >> 16))
+#define PACK(a, b) (((uint32_t)(uint16_t)(b) << 16) | (uint16_t)(a))
+#endif
+
+#define ALIGNED(p) (((uintptr_t)(p) & 3) == 0)
+
+// shifts on the bits, left shifting a negative sample isn't defined
+#define WIDEN(s)   ((int32_t)((uint32_t)(uint16_t)(s) << 16))
+#define NARROW(s)  ((int16_t)((s) >> 16))
+
+static inline int16_t saturate(int32_t x) {
+  if (x > INT16_MAX)
+    return INT16_MAX;
+  if (x < INT16_MIN)
+    return INT16_MIN;
+  return (int16_t)x;
+}
+
+static inline int16_t scale(int16_t s, int16_t gain) {
+  return saturate(((int32_t)s * gain) >> PCM_GAIN_SHIFT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_duplicate(int16_t* dst, const int16_t* src, size_t samples) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_unpacklo_epi16(v, v));
+    _mm_storeu_si128((__m128i*)(dst + i * 2 + 8), _mm_unpackhi_epi16(v, v));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    int16x8x2_t v;
+    v.val[0] = v.val[1] = vld1q_s16(src + i);
+    vst2q_s16(dst + i * 2, v);
+  }
+#endif
+
+  // a stereo frame is a whole word, so only the source may need lining up
+  if (ALIGNED(dst)) {
+    const pcm_word* in;
+    pcm_word* out;
+
+    if (!ALIGNED(src + i) && i < samples) {
+      dst[i * 2] = dst[i * 2 + 1] = src[i];
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i);
+    out = (pcm_word*)(dst + i * 2);
+    for (; i + 2 <= samples; i += 2) {
+      uint32_t w = *in++;
+      out[0] = PACK(FIRST(w), FIRST(w));
+      out[1] = PACK(SECOND(w), SECOND(w));
+      out += 2;
+    }
+  }
+
+  for (; i < samples; i++) {
+    dst[i * 2] = dst[i * 2 + 1] = src[i];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_decimate(int16_t* dst, const int16_t* src, size_t frames) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  for (; i + 8 <= frames; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 8));
+    // sign extend the left channel, the low half of each frame
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= frames; i += 8) {
+    int16x8x2_t v = vld2q_s16(src + i * 2);
+    vst1q_s16(dst + i, v.val[0]);
+  }
+#endif
+
+  if (ALIGNED(src)) {
+    const pcm_word* in;
+    pcm_word* out;
+
+    if (!ALIGNED(dst + i) && i < frames) {
+      dst[i] = src[i * 2];
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i * 2);
+    out = (pcm_word*)(dst + i);
+    for (; i + 2 <= frames; i += 2) {
+      uint32_t w0 = in[0];
+      uint32_t w1 = in[1];
+      *out++ = PACK(FIRST(w0), FIRST(w1));
+      in += 2;
+    }
+  }
+
+  for (; i < frames; i++) {
+    dst[i] = src[i * 2];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_downmix(int16_t* dst, const int16_t* src, size_t frames) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  for (; i + 8 <= frames; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 8));
+    a = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(a, 16));
+    b = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16), _mm_srai_epi32(b, 16));
+    a = _mm_srai_epi32(a, 1);
+    b = _mm_srai_epi32(b, 1);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= frames; i += 8) {
+    int16x8x2_t v = vld2q_s16(src + i * 2);
+    vst1q_s16(dst + i, vhaddq_s16(v.val[0], v.val[1]));
+  }
+#endif
+
+  if (ALIGNED(src)) {
+    const pcm_word* in;
+    pcm_word* out;
+
+    if (!ALIGNED(dst + i) && i < frames) {
+      dst[i] = (int16_t)(((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1);
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i * 2);
+    out = (pcm_word*)(dst + i);
+    for (; i + 2 <= frames; i += 2) {
+      uint32_t w0 = in[0];
+      uint32_t w1 = in[1];
+      int16_t a = (int16_t)(((int32_t)FIRST(w0) + SECOND(w0)) >> 1);
+      int16_t b = (int16_t)(((int32_t)FIRST(w1) + SECOND(w1)) >> 1);
+      *out++ = PACK(a, b);
+      in += 2;
+    }
+  }
+
+  for (; i < frames; i++) {
+    dst[i] = (int16_t)(((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_gain(int16_t* dst, const int16_t* src, size_t samples, int16_t gain) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  __m128i g = _mm_set1_epi16(gain);
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_mullo_epi16(v, g);
+    __m128i hi = _mm_mulhi_epi16(v, g);
+    __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), PCM_GAIN_SHIFT);
+    __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), PCM_GAIN_SHIFT);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(PCM_NEON)
+  int16x4_t g = vdup_n_s16(gain);
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t v = vld1q_s16(src + i);
+    int32x4_t a = vmull_s16(vget_low_s16(v), g);
+    int32x4_t b = vmull_s16(vget_high_s16(v), g);
+    vst1q_s16(dst + i, vcombine_s16(vqshrn_n_s32(a, PCM_GAIN_SHIFT), vqshrn_n_s32(b, PCM_GAIN_SHIFT)));
+  }
+#endif
+
+  if (((uintptr_t)src & 3) == ((uintptr_t)dst & 3)) {
+    const pcm_word* in;
+    pcm_word* out;
+
+    if (!ALIGNED(src + i) && i < samples) {
+      dst[i] = scale(src[i], gain);
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i);
+    out = (pcm_word*)(dst + i);
+    for (; i + 2 <= samples; i += 2) {
+      uint32_t w = *in++;
+      *out++ = PACK(scale(FIRST(w), gain), scale(SECOND(w), gain));
+    }
+  }
+
+  for (; i < samples; i++) {
+    dst[i] = scale(src[i], gain);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_s16_to_s32(int32_t* dst, const int16_t* src, size_t samples) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(zero, v));
+    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(zero, v));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t v = vld1q_s16(src + i);
+    vst1q_s32(dst + i, vshll_n_s16(vget_low_s16(v), 16));
+    vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+  }
+#endif
+
+  {
+    const pcm_word* in;
+
+    if (!ALIGNED(src + i) && i < samples) {
+      dst[i] = WIDEN(src[i]);
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i);
+    for (; i + 2 <= samples; i += 2) {
+      uint32_t w = *in++;
+      dst[i] = WIDEN(FIRST(w));
+      dst[i + 1] = WIDEN(SECOND(w));
+    }
+  }
+
+  for (; i < samples; i++) {
+    dst[i] = WIDEN(src[i]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_s32_to_s16(int16_t* dst, const int32_t* src, size_t samples) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  for (; i + 8 <= samples; i += 8) {
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + i)), 16);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + i + 4)), 16);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    int16x4_t a = vshrn_n_s32(vld1q_s32(src + i), 16);
+    int16x4_t b = vshrn_n_s32(vld1q_s32(src + i + 4), 16);
+    vst1q_s16(dst + i, vcombine_s16(a, b));
+  }
+#endif
+
+  {
+    pcm_word* out;
+
+    if (!ALIGNED(dst + i) && i < samples) {
+      dst[i] = NARROW(src[i]);
+      i++;
+    }
+
+    out = (pcm_word*)(dst + i);
+    for (; i + 2 <= samples; i += 2) {
+      *out++ = PACK(NARROW(src[i]), NARROW(src[i + 1]));
+    }
+  }
+
+  for (; i < samples; i++) {
+    dst[i] = NARROW(src[i]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void pcm_swap(int16_t* dst, const int16_t* src, size_t samples) {
+  size_t i = 0;
+
+#if defined(PCM_SSE2)
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+  }
+#elif defined(PCM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    vst1q_s16(dst + i, vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(vld1q_s16(src + i)))));
+  }
+#endif
+
+  if (((uintptr_t)src & 3) == ((uintptr_t)dst & 3)) {
+    const pcm_word* in;
+    pcm_word* out;
+
+    if (!ALIGNED(src + i) && i < samples) {
+      dst[i] = (int16_t)(((uint16_t)src[i] >> 8) | ((uint16_t)src[i] << 8));
+      i++;
+    }
+
+    in = (const pcm_word*)(src + i);
+    out = (pcm_word*)(dst + i);
+    for (; i + 2 <= samples; i += 2) {
+      uint32_t w = *in++;
+      *out++ = ((w >> 8) & 0x00ff00ff) | ((w << 8) & 0xff00ff00);
+    }
+  }
+
+  for (; i < samples; i++) {
+    dst[i] = (int16_t)(((uint16_t)src[i] >> 8) | ((uint16_t)src[i] << 8));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const char* pcm_kernels(void) {
+#if defined(PCM_SSE2)
+  return "sse2";
+#elif defined(PCM_NEON)
+  return "neon";
+#else
+  return "word";
+#endif
+}
@@ -0,0 +1,56 @@
+/*
+
+PCM format conversion kernels
+
+Signed 16-bit native endian samples, interleaved when stereo. Every kernel
+works a 32-bit word at a time where the buffers allow it (two samples per
+load on MIPS32), uses SSE2 or NEON when the compiler targets them, and
+finishes any odd samples one at a time.  All paths give identical results.
+
+Kernels that shrink their data (decimate, downmix, s32 to s16), gain and
+swap may be run in place, dst == src.  Duplicate can grow its data in place if
+the mono samples sit behind where the stereo ones go, src >= dst + samples.
+
+*/
+
+#ifndef PCMCONV_H
+#define PCMCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// gain is fixed point with 12 fractional bits, so an int16_t covers -8x to 8x
+#define PCM_GAIN_SHIFT 12
+#define PCM_GAIN_UNITY (1 << PCM_GAIN_SHIFT)
+
+// mono to stereo, each of the samples copied to both channels of dst
+void pcm_duplicate(int16_t* dst, const int16_t* src, size_t samples);
+
+// stereo to mono, keeping the left channel of each of the frames
+void pcm_decimate(int16_t* dst, const int16_t* src, size_t frames);
+
+// stereo to mono, averaging the two channels of each of the frames
+void pcm_downmix(int16_t* dst, const int16_t* src, size_t frames);
+
+// scale samples by gain / PCM_GAIN_UNITY, saturating to the 16-bit range
+void pcm_gain(int16_t* dst, const int16_t* src, size_t samples, int16_t gain);
+
+// widen to the top of a 32-bit sample, and back again, dropping the low bits
+void pcm_s16_to_s32(int32_t* dst, const int16_t* src, size_t samples);
+void pcm_s32_to_s16(int16_t* dst, const int32_t* src, size_t samples);
+
+// swap the bytes of each sample, between native and little endian on the target
+void pcm_swap(int16_t* dst, const int16_t* src, size_t samples);
+
+// which of the vector paths was built in: "sse2", "neon" or "word"
+const char* pcm_kernels(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
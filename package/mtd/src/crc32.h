@@ -3,17 +3,19 @@
 
 #include <stdint.h>
 
-extern const uint32_t crc32_table[256];
+#include "cksum.h"
 
-/* Return a 32-bit CRC of the contents of the buffer. */
+/*
+ * The CRC register after the buffer, no inversion; cksum.c (copied in
+ * from tools/firmware-utils at prepare time) does the work.
+ */
 
 static inline uint32_t
 crc32(uint32_t val, const void *ss, int len)
 {
-	const unsigned char *s = ss;
-	while (--len >= 0)
-		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
-	return val;
+	if (len <= 0)
+		return val;
+	return cksum_crc32_update(val, ss, len);
 }
 
 static inline unsigned int crc32buf(char *buf, size_t len)
@@ -38,17 +38,22 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/reboot.h>
+#include <pthread.h>
 #include <linux/reboot.h>
 #include <mtd/mtd-user.h>
 #include "fis.h"
 #include "mtd.h"
+#include "crc32.h"
 
 #ifndef MTDREFRESH
 #define MTDREFRESH	_IO('M', 50)
 #endif
 
 #define MAX_ARGS 8
+#define FILE_ERASESIZE	(64 * 1024) /* for a regular file standing in for the device */
+#define IMAGE_SLOTS	4	/* erase blocks of the image read ahead of the flash */
 #define JFFS2_DEFAULT_DIR	"" /* directory name without /, empty means root dir */
 
 static char *buf = NULL;
@@ -57,8 +62,205 @@ static char *jffs2file = NULL, *jffs2dir = JFFS2_DEFAULT_DIR;
 static int buflen = 0;
 int quiet;
 int no_erase;
+int diff_write;
+int verify;
 int mtdsize = 0;
 int erasesize = 0;
+static int mtd_is_file = 0;
+static char *cmpbuf = NULL;
+
+static struct {
+	int skipped;
+	int erased;
+	int written;
+} blocks;
+
+/*
+ * The image is read by its own thread into a ring of erase block sized
+ * buffers, so a pipe from wget or gunzip keeps flowing while a block is
+ * being erased.  Times are kept per stage, to see where an upgrade goes.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int fd;
+	char *data;			/* IMAGE_SLOTS * erasesize */
+	int len[IMAGE_SLOTS];
+	unsigned int head;		/* slots the reader has filled */
+	unsigned int tail;		/* slots mtd_write has used up */
+	int pos;			/* bytes of the tail slot already used */
+	int eof;
+
+	double started;
+	size_t bytes;
+	double read_time;		/* in read() on the image */
+	double full_time;		/* reader waiting for the flash to catch up */
+	double empty_time;		/* flash waiting for the image */
+	double compare_time;
+	double erase_time;
+	double write_time;
+	double verify_time;
+} image;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Read up to len bytes, short only at the end of the image */
+static ssize_t image_fill(int fd, char *dst, ssize_t len)
+{
+	ssize_t r, got = 0;
+
+	while (got < len) {
+		r = read(fd, dst + got, len - got);
+		if (r < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			perror("read");
+			break;
+		}
+		if (r == 0)
+			break;
+		got += r;
+	}
+
+	return got;
+}
+
+static void *image_reader(void *arg)
+{
+	unsigned int slot;
+	ssize_t len;
+	double t;
+
+	do {
+		pthread_mutex_lock(&image.lock);
+		if (image.head - image.tail == IMAGE_SLOTS) {
+			t = now();
+			while (image.head - image.tail == IMAGE_SLOTS)
+				pthread_cond_wait(&image.cond, &image.lock);
+			image.full_time += now() - t;
+		}
+		pthread_mutex_unlock(&image.lock);
+
+		/* the slot at head is ours until head moves past it */
+		slot = image.head % IMAGE_SLOTS;
+		t = now();
+		len = image_fill(image.fd, image.data + slot * erasesize, erasesize);
+		image.read_time += now() - t;
+
+		pthread_mutex_lock(&image.lock);
+		image.len[slot] = len;
+		image.bytes += len;
+		if (len > 0)
+			image.head++;
+		if (len < erasesize)
+			image.eof = 1;
+		pthread_cond_broadcast(&image.cond);
+		pthread_mutex_unlock(&image.lock);
+	} while (len == erasesize);
+
+	return NULL;
+}
+
+static void image_start(int fd)
+{
+	image.started = now();
+	image.fd = fd;
+	image.data = malloc(IMAGE_SLOTS * erasesize);
+	if (!image.data)
+		return;
+
+	pthread_mutex_init(&image.lock, NULL);
+	pthread_cond_init(&image.cond, NULL);
+	if (pthread_create(&image.thread, NULL, image_reader, NULL)) {
+		/* mtd_write reads the image itself then */
+		free(image.data);
+		image.data = NULL;
+		return;
+	}
+	image.running = 1;
+}
+
+static void image_stop(void)
+{
+	if (!image.running)
+		return;
+
+	pthread_join(image.thread, NULL);
+	image.running = 0;
+	free(image.data);
+	image.data = NULL;
+}
+
+/* The next len bytes of the image, short only at its end */
+static ssize_t image_read(char *dst, ssize_t len)
+{
+	ssize_t n, got = 0;
+	unsigned int slot;
+	double t;
+
+	if (!image.running) {
+		t = now();
+		got = image_fill(image.fd, dst, len);
+		image.read_time += now() - t;
+		image.bytes += got;
+		return got;
+	}
+
+	pthread_mutex_lock(&image.lock);
+	while (got < len) {
+		if (image.head == image.tail && !image.eof) {
+			t = now();
+			while (image.head == image.tail && !image.eof)
+				pthread_cond_wait(&image.cond, &image.lock);
+			image.empty_time += now() - t;
+		}
+		if (image.head == image.tail)
+			break;
+
+		/* the slot at tail is ours until tail moves past it */
+		slot = image.tail % IMAGE_SLOTS;
+		n = MIN(image.len[slot] - image.pos, len - got);
+		pthread_mutex_unlock(&image.lock);
+
+		memcpy(dst + got, image.data + slot * erasesize + image.pos, n);
+		got += n;
+		image.pos += n;
+
+		pthread_mutex_lock(&image.lock);
+		if (image.pos == image.len[slot]) {
+			image.pos = 0;
+			image.tail++;
+			pthread_cond_broadcast(&image.cond);
+		}
+	}
+	pthread_mutex_unlock(&image.lock);
+
+	return got;
+}
+
+static void image_report(void)
+{
+	fprintf(stderr, "\nread %u KiB in %.1fs (%.0f KiB/s), waited %.1fs for the flash\n",
+		(unsigned int) (image.bytes >> 10), image.read_time,
+		image.read_time > 0 ? image.bytes / 1024.0 / image.read_time : 0,
+		image.full_time);
+	fprintf(stderr, "erase %.1fs (%d blocks), write %.1fs (%d blocks)",
+		image.erase_time, blocks.erased, image.write_time, blocks.written);
+	if (diff_write)
+		fprintf(stderr, ", compare %.1fs (%d skipped)", image.compare_time, blocks.skipped);
+	if (verify)
+		fprintf(stderr, ", verify %.1fs", image.verify_time);
+	fprintf(stderr, ", waited %.1fs for the image, %.1fs in all",
+		image.empty_time, now() - image.started);
+}
 
 int mtd_open(const char *mtd, bool block)
 {
@@ -98,6 +300,16 @@ int mtd_check_open(const char *mtd)
 	}
 
 	if(ioctl(fd, MEMGETINFO, &mtdInfo)) {
+		struct stat st;
+
+		/* a plain file can stand in for the device, for testing on a host */
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+			mtd_is_file = 1;
+			mtdsize = st.st_size;
+			erasesize = FILE_ERASESIZE;
+			return fd;
+		}
+
 		fprintf(stderr, "Could not get MTD device info from %s\n", mtd);
 		close(fd);
 		return -1;
@@ -112,6 +324,18 @@ int mtd_erase_block(int fd, int offset)
 {
 	struct erase_info_user mtdEraseInfo;
 
+	if (mtd_is_file) {
+		char *ff = malloc(erasesize);
+		int ret;
+
+		if (!ff)
+			return -1;
+		memset(ff, 0xff, erasesize);
+		ret = pwrite(fd, ff, erasesize, offset);
+		free(ff);
+		return (ret == erasesize) ? 0 : -1;
+	}
+
 	mtdEraseInfo.start = offset;
 	mtdEraseInfo.length = erasesize;
 	ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
@@ -238,8 +462,7 @@ mtd_erase(const char *mtd)
 		 mtdEraseInfo.start < mtdsize;
 		 mtdEraseInfo.start += erasesize) {
 
-		ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
-		if(ioctl(fd, MEMERASE, &mtdEraseInfo))
+		if (mtd_erase_block(fd, mtdEraseInfo.start))
 			fprintf(stderr, "Failed to erase block on %s at 0x%x\n", mtd, mtdEraseInfo.start);
 	}
 
@@ -275,6 +498,70 @@ mtd_refresh(const char *mtd)
 	return 0;
 }
 
+/*
+ * Does the erase block at the current position already hold len bytes of
+ * buf, followed by what an erase would leave?  Then it needs neither.
+ */
+static int
+mtd_block_unchanged(int fd, const char *buf, int len)
+{
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	int want = no_erase ? len : erasesize;
+	int i, same = 0;
+	double t = now();
+
+	if (pos < 0 || pread(fd, cmpbuf, want, pos) != want)
+		goto out;
+
+	if (memcmp(cmpbuf, buf, len) != 0)
+		goto out;
+
+	for (i = len; i < want; i++) {
+		if ((unsigned char) cmpbuf[i] != 0xff)
+			goto out;
+	}
+	same = 1;
+
+out:
+	image.compare_time += now() - t;
+	return same;
+}
+
+/*
+ * Read back what was written to this partition and check it against the
+ * CRC of the image data that went into it.
+ */
+static int
+mtd_verify(int fd, const char *mtd, off_t start, ssize_t len, uint32_t crc)
+{
+	uint32_t flash = 0xFFFFFFFF;
+	ssize_t done, r;
+	double t = now();
+
+	if (quiet < 2)
+		fprintf(stderr, "\nVerifying %s ... ", mtd);
+
+	for (done = 0; done < len; done += r) {
+		r = pread(fd, cmpbuf, MIN(erasesize, len - done), start + done);
+		if (r <= 0) {
+			fprintf(stderr, "read failed at 0x%x\n", (unsigned int) (start + done));
+			return -1;
+		}
+		flash = crc32(flash, cmpbuf, r);
+	}
+	image.verify_time += now() - t;
+
+	if (flash != crc) {
+		fprintf(stderr, "failed, crc32 0x%08x, expected 0x%08x\n", flash, crc);
+		return -1;
+	}
+
+	if (quiet < 2)
+		fprintf(stderr, "ok");
+
+	return 0;
+}
+
 static void
 indicate_writing(const char *mtd)
 {
@@ -291,10 +578,13 @@ mtd_write(int imagefd, const char *mtd, char *fis_layout, size_t part_offset)
 	char *next = NULL;
 	char *str = NULL;
 	int fd, result;
-	ssize_t r, w, e;
+	ssize_t w, e;
 	ssize_t skip = 0;
 	uint32_t offset = 0;
 	int jffs2_replaced = 0;
+	off_t start = 0;
+	uint32_t crc = 0;
+	double t;
 
 #ifdef FIS_SUPPORT
 	static struct fis_part new_parts[MAX_ARGS];
@@ -356,7 +646,16 @@ next:
 		mtd = str;
 	}
 
-	r = 0;
+	if ((diff_write || verify) && !cmpbuf)
+		cmpbuf = malloc(erasesize);
+
+	image_start(imagefd);
+
+	/* The jffs2 data gets written behind the loop's back */
+	if (verify && jffs2file) {
+		fprintf(stderr, "Can't verify when appending jffs2 data, skipping it\n");
+		verify = 0;
+	}
 
 resume:
 	next = strchr(mtd, ':');
@@ -379,24 +678,12 @@ resume:
 	indicate_writing(mtd);
 
 	w = e = 0;
+	start = lseek(fd, 0, SEEK_CUR);
+	crc = 0xFFFFFFFF;
 	for (;;) {
 		/* buffer may contain data already (from trx check or last mtd partition write attempt) */
-		while (buflen < erasesize) {
-			r = read(imagefd, buf + buflen, erasesize - buflen);
-			if (r < 0) {
-				if ((errno == EINTR) || (errno == EAGAIN))
-					continue;
-				else {
-					perror("read");
-					break;
-				}
-			}
-
-			if (r == 0)
-				break;
-
-			buflen += r;
-		}
+		if (buflen < erasesize)
+			buflen += image_read(buf + buflen, erasesize - buflen);
 
 		if (buflen == 0)
 			break;
@@ -435,6 +722,23 @@ resume:
 			mtd_parse_jffs2data(buf, jffs2dir);
 		}
 
+		/* a block that already holds this data needs neither an erase nor a write */
+		if (diff_write && !offset && !(w % erasesize) && (no_erase || w == e) &&
+		    mtd_block_unchanged(fd, buf, buflen)) {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[s]");
+
+			lseek(fd, buflen, SEEK_CUR);
+			crc = crc32(crc, buf, buflen);
+			w += buflen;
+			if (!no_erase)
+				e += erasesize;
+			blocks.skipped++;
+
+			buflen = 0;
+			continue;
+		}
+
 		/* need to erase the next block before writing data to it */
 		if(!no_erase)
 		{
@@ -443,12 +747,19 @@ resume:
 					fprintf(stderr, "\b\b\b[e]");
 
 
-				if (mtd_erase_block(fd, e) < 0) {
+				t = now();
+				result = mtd_erase_block(fd, e);
+				image.erase_time += now() - t;
+				if (result < 0) {
 					if (next) {
 						if (w < e) {
 							write(fd, buf + offset, e - w);
+							crc = crc32(crc, buf + offset, e - w);
 							offset = e - w;
+							w = e;
 						}
+						if (verify && mtd_verify(fd, mtd, start, w, crc) < 0)
+							exit(1);
 						w = 0;
 						e = 0;
 						close(fd);
@@ -463,13 +774,17 @@ resume:
 
 				/* erase the chunk */
 				e += erasesize;
+				blocks.erased++;
 			}
 		}
 
 		if (!quiet)
 			fprintf(stderr, "\b\b\b[w]");
 
-		if ((result = write(fd, buf + offset, buflen)) < buflen) {
+		t = now();
+		result = write(fd, buf + offset, buflen);
+		image.write_time += now() - t;
+		if (result < buflen) {
 			if (result < 0) {
 				fprintf(stderr, "Error writing image.\n");
 				exit(1);
@@ -478,7 +793,9 @@ resume:
 				exit(1);
 			}
 		}
+		crc = crc32(crc, buf + offset, buflen);
 		w += buflen;
+		blocks.written++;
 
 		buflen = 0;
 		offset = 0;
@@ -491,6 +808,13 @@ resume:
 	if (!quiet)
 		fprintf(stderr, "\b\b\b\b    ");
 
+	if (verify && mtd_verify(fd, mtd, start, w, crc) < 0)
+		exit(1);
+
+	image_stop();
+	if (quiet < 2)
+		image_report();
+
 done:
 	if (quiet < 2)
 		fprintf(stderr, "\n");
@@ -529,6 +853,9 @@ static void usage(void)
 	"        -q                      quiet mode (once: no [w] on writing,\n"
 	"                                           twice: no status messages)\n"
 	"        -n                      write without first erasing the blocks\n"
+	"        -c                      compare each block with the flash first and\n"
+	"                                skip the erase and write of unchanged ones\n"
+	"        -v                      read back and verify what was written\n"
 	"        -r                      reboot after successful command\n"
 	"        -f                      force write without trx checks\n"
 	"        -e <device>             erase <device> before executing the command\n"
@@ -587,12 +914,14 @@ int main (int argc, char **argv)
 	buflen = 0;
 	quiet = 0;
 	no_erase = 0;
+	diff_write = 0;
+	verify = 0;
 
 	while ((ch = getopt(argc, argv,
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frnqe:d:j:p:o:")) != -1)
+			"frncvqe:d:j:p:o:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
@@ -603,6 +932,12 @@ int main (int argc, char **argv)
 			case 'n':
 				no_erase = 1;
 				break;
+			case 'c':
+				diff_write = 1;
+				break;
+			case 'v':
+				verify = 1;
+				break;
 			case 'j':
 				jffs2file = optarg;
 				break;
@@ -0,0 +1,219 @@
+/*
+ * Times the parts of the configuration system that grow with the number
+ * of symbols: parsing the Kconfig tree, finding symbols by name and
+ * reading a .config back in.
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define LKC_DIRECT_LINK
+#include "lkc.h"
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double time_lookups(char **names, int cnt, int rounds, int *found)
+{
+	double t;
+	int i, r;
+
+	*found = 0;
+	t = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < cnt; i++)
+			if (sym_find(names[i]))
+				(*found)++;
+	return now() - t;
+}
+
+static void calc_all(void)
+{
+	struct symbol *sym;
+	int i;
+
+	for_all_symbols(i, sym)
+		sym_calc_value(sym);
+}
+
+struct value {
+	tristate tri, visible;
+	const char *str;
+};
+
+/*
+ * Flip up to cnt bool/tristate symbols one after the other, recomputing
+ * everything after each, first with only the dependents of the flipped
+ * symbol invalidated and then again from scratch, which must agree.
+ */
+static int time_changes(int cnt)
+{
+	struct symbol *sym, *s;
+	struct value *vals;
+	double t_inc = 0, t_full = 0, t;
+	long calc_inc = 0, calc_full = 0;
+	int i, j, n, changes = 0, wrong = 0;
+
+	n = 0;
+	for_all_symbols(i, sym)
+		n++;
+	vals = malloc(n * sizeof(*vals));
+
+	calc_all();
+	for_all_symbols(i, sym) {
+		tristate val;
+
+		if (changes >= cnt)
+			break;
+		if (sym->type != S_BOOLEAN && sym->type != S_TRISTATE)
+			continue;
+		val = sym_get_tristate_value(sym) == no ? yes : no;
+		if (!sym_tristate_within_range(sym, val))
+			continue;
+
+		calc_inc -= sym_calc_count;
+		t = now();
+		sym_set_tristate_value(sym, val);
+		calc_all();
+		t_inc += now() - t;
+		calc_inc += sym_calc_count;
+
+		n = 0;
+		for_all_symbols(j, s) {
+			vals[n].tri = s->curr.tri;
+			vals[n].visible = s->visible;
+			vals[n].str = sym_get_string_value(s);
+			n++;
+		}
+
+		calc_full -= sym_calc_count;
+		t = now();
+		sym_clear_all_valid();
+		calc_all();
+		t_full += now() - t;
+		calc_full += sym_calc_count;
+
+		n = 0;
+		for_all_symbols(j, s) {
+			if (vals[n].tri != s->curr.tri ||
+			    vals[n].visible != s->visible ||
+			    strcmp(vals[n].str, sym_get_string_value(s))) {
+				printf("*** %s differs from a full recompute "
+				       "after changing %s\n",
+				       s->name ? s->name : "<choice>",
+				       sym->name ? sym->name : "<choice>");
+				wrong++;
+			}
+			n++;
+		}
+		changes++;
+	}
+	free(vals);
+
+	if (!changes)
+		return 0;
+	printf("%d changes, incremental: %.1f recomputed, %.1f us each\n",
+	       changes, (double)calc_inc / changes, t_inc * 1e6 / changes);
+	printf("%d changes, everything: %.1f recomputed, %.1f us each\n",
+	       changes, (double)calc_full / changes, t_full * 1e6 / changes);
+	return wrong;
+}
+
+int main(int ac, char **av)
+{
+	struct symbol *sym;
+	char **names, **misses;
+	const char *config = NULL;
+	double t;
+	int rounds = 100, changes = 200;
+	int i, cnt, found, len, longest, used;
+	long probes;
+
+	i = 1;
+	while (ac > i + 1 && av[i][0] == '-') {
+		if (!strcmp(av[i], "-r"))
+			rounds = atoi(av[i + 1]);
+		else if (!strcmp(av[i], "-c"))
+			changes = atoi(av[i + 1]);
+		else
+			break;
+		i += 2;
+	}
+	if (ac <= i || rounds < 1) {
+		printf("%s [-r rounds] [-c changes] config [.config]\n", av[0]);
+		exit(1);
+	}
+	if (ac > i + 1)
+		config = av[i + 1];
+
+	t = now();
+	conf_parse(av[i]);
+	t = now() - t;
+	printf("parse %s: %.1f ms\n", av[i], t * 1e3);
+
+	cnt = 0;
+	for_all_symbols(i, sym)
+		cnt++;
+	names = malloc(cnt * sizeof(*names));
+	misses = malloc(cnt * sizeof(*misses));
+
+	cnt = 0;
+	for_all_symbols(i, sym) {
+		if (!sym->name || sym->flags & SYMBOL_CONST)
+			continue;
+		names[cnt] = strdup(sym->name);
+		misses[cnt] = malloc(strlen(sym->name) + 2);
+		sprintf(misses[cnt], "%s_", sym->name);
+		cnt++;
+	}
+
+	/* the expected number of entries looked at for a hit */
+	used = longest = 0;
+	probes = 0;
+	for (i = 0; i < symbol_hash_size; i++) {
+		len = 0;
+		for (sym = symbol_hash[i]; sym; sym = sym->next)
+			len++;
+		if (len)
+			used++;
+		if (len > longest)
+			longest = len;
+		probes += (long)len * (len + 1) / 2;
+	}
+	printf("%d symbols, %d buckets, %d in use, longest chain %d, "
+	       "%.2f compares per hit\n", cnt, symbol_hash_size, used,
+	       longest, cnt ? (double)probes / cnt : 0);
+
+	t = time_lookups(names, cnt, rounds, &found);
+	printf("sym_find, hits: %.1f ns each (%d found)\n",
+	       t * 1e9 / ((double)cnt * rounds), found / rounds);
+	t = time_lookups(misses, cnt, rounds, &found);
+	printf("sym_find, misses: %.1f ns each\n",
+	       t * 1e9 / ((double)cnt * rounds));
+
+	if (config) {
+		t = now();
+		for (i = 0; i < rounds / 10 + 1; i++) {
+			if (conf_read(config)) {
+				printf("*** Can't read %s\n", config);
+				exit(1);
+			}
+		}
+		t = (now() - t) / (rounds / 10 + 1);
+		printf("conf_read %s: %.1f ms\n", config, t * 1e3);
+	}
+
+	if (time_changes(changes))
+		return 1;
+
+	return 0;
+}
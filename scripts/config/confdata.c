@@ -431,9 +431,6 @@ int conf_write(const char *name)
 		     use_timestamp ? "# " : "",
 		     use_timestamp ? ctime(&now) : "");
 
-	if (!sym_change_count)
-		sym_clear_all_valid();
-
 	menu = rootmenu.list;
 	while (menu) {
 		sym = menu->sym;
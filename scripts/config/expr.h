@@ -66,6 +66,7 @@ enum symbol_type {
 struct symbol {
 	struct symbol *next;
 	char *name;
+	unsigned int hash;
 	char *help;
 	enum symbol_type type;
 	struct symbol_value curr, user;
@@ -75,9 +76,11 @@ struct symbol {
 	struct expr *dep, *dep2;
 	struct expr_value rev_dep;
 	struct expr_value rev_dep_inv;
+	struct symbol **dependents;	/* whose value is computed from ours */
+	int dependents_cnt;
 };
 
-#define for_all_symbols(i, sym) for (i = 0; i < SYMBOL_HASHSIZE; i++) for (sym = symbol_hash[i]; sym; sym = sym->next) if (sym->type != S_OTHER)
+#define for_all_symbols(i, sym) for (i = 0; i < symbol_hash_size; i++) for (sym = symbol_hash[i]; sym; sym = sym->next) if (sym->type != S_OTHER)
 
 #define SYMBOL_YES		0x0001
 #define SYMBOL_MOD		0x0002
@@ -94,10 +97,11 @@ struct symbol {
 #define SYMBOL_NEW		0x0800
 #define SYMBOL_AUTO		0x1000
 #define SYMBOL_CHECKED		0x2000
+#define SYMBOL_VISITED		0x4000
 #define SYMBOL_WARNED		0x8000
 
 #define SYMBOL_MAXLENGTH	256
-#define SYMBOL_HASHSIZE		257
+#define SYMBOL_HASHSIZE		1024	/* initial size, a power of two */
 
 enum prop_type {
 	P_UNKNOWN, P_PROMPT, P_COMMENT, P_MENU, P_DEFAULT, P_CHOICE, P_DESELECT, P_SELECT, P_RANGE, P_RESET
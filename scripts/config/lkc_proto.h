@@ -15,7 +15,8 @@ P(menu_get_root_menu,struct menu *,(struct menu *menu));
 P(menu_get_parent_menu,struct menu *,(struct menu *menu));
 
 /* symbol.c */
-P(symbol_hash,struct symbol *,[SYMBOL_HASHSIZE]);
+P(symbol_hash,struct symbol **,);
+P(symbol_hash_size,int,);
 P(sym_change_count,int,);
 
 P(sym_lookup,struct symbol *,(const char *name, int isconst));
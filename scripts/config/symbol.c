@@ -30,7 +30,12 @@ struct symbol symbol_yes = {
 	.flags = SYMBOL_VALID,
 };
 
+struct symbol **symbol_hash;
+int symbol_hash_size;
+static int symbol_count;
+
 int sym_change_count;
+int sym_calc_count;
 struct symbol *modules_sym;
 tristate modules_val;
 
@@ -298,6 +303,7 @@ void sym_calc_value(struct symbol *sym)
 	if (sym->flags & SYMBOL_VALID)
 		return;
 	sym->flags |= SYMBOL_VALID;
+	sym_calc_count++;
 
 	oldval = sym->curr;
 
@@ -404,13 +410,177 @@ void sym_calc_value(struct symbol *sym)
 		sym->flags &= ~SYMBOL_WRITE;
 }
 
+/*
+ * With KCONFIG_TRACE=file every change appends a line to file saying how
+ * many symbols it invalidated and how many were recomputed before the
+ * next change (or exit).
+ */
+static FILE *trace_file;
+static const char *trace_name;
+static int trace_invalid, trace_calc;
+
+static void sym_trace_flush(void)
+{
+	if (!trace_name)
+		return;
+	fprintf(trace_file, "%s: %d invalidated, %d recomputed\n",
+		trace_name, trace_invalid, sym_calc_count - trace_calc);
+	fflush(trace_file);
+	trace_name = NULL;
+}
+
+static void sym_trace_change(const char *name, int invalid)
+{
+	if (!trace_file)
+		return;
+	sym_trace_flush();
+	trace_name = name;
+	trace_invalid = invalid;
+	trace_calc = sym_calc_count;
+}
+
 void sym_clear_all_valid(void)
 {
 	struct symbol *sym;
-	int i;
+	int i, cnt = 0;
 
-	for_all_symbols(i, sym)
+	for_all_symbols(i, sym) {
 		sym->flags &= ~SYMBOL_VALID;
+		cnt++;
+	}
+	sym_trace_change("(all)", cnt);
+	sym_change_count++;
+	if (modules_sym)
+		sym_calc_value(modules_sym);
+}
+
+/*
+ * The reverse of the dependencies: sym->dependents lists the symbols
+ * whose visibility or value is computed from sym, so a change to sym
+ * only has to invalidate those, and theirs in turn, instead of every
+ * symbol there is.
+ */
+static int dependents_built;
+static struct symbol **invalid_queue;
+static int invalid_queue_size;
+
+static void sym_add_dependent(struct symbol *sym, struct symbol *dep)
+{
+	int cnt;
+
+	if (!sym || sym == dep || sym->flags & SYMBOL_CONST)
+		return;
+	cnt = sym->dependents_cnt;
+	/* all of dep's references are added in a row */
+	if (cnt && sym->dependents[cnt - 1] == dep)
+		return;
+	if (!(cnt & (cnt - 1)))
+		sym->dependents = realloc(sym->dependents,
+				(cnt ? 2 * cnt : 1) * sizeof(*sym->dependents));
+	sym->dependents[sym->dependents_cnt++] = dep;
+}
+
+static void sym_add_expr_dependents(struct expr *e, struct symbol *dep)
+{
+	if (!e)
+		return;
+	switch (e->type) {
+	case E_OR:
+	case E_AND:
+		sym_add_expr_dependents(e->left.expr, dep);
+		sym_add_expr_dependents(e->right.expr, dep);
+		break;
+	case E_NOT:
+		sym_add_expr_dependents(e->left.expr, dep);
+		break;
+	case E_CHOICE:
+		sym_add_expr_dependents(e->left.expr, dep);
+		sym_add_dependent(e->right.sym, dep);
+		break;
+	case E_EQUAL:
+	case E_UNEQUAL:
+	case E_RANGE:
+		sym_add_dependent(e->left.sym, dep);
+		sym_add_dependent(e->right.sym, dep);
+		break;
+	case E_SYMBOL:
+		sym_add_dependent(e->left.sym, dep);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Called once the menus are finalized, every expression sym_calc_value()
+ * looks at is in its final form by then.  Selects are picked up from the
+ * rev_dep of the selected symbol, a choice value depends on its choice
+ * through its P_CHOICE property and the choice on its values through the
+ * E_CHOICE list.
+ */
+void sym_build_dependents(void)
+{
+	struct symbol *sym;
+	struct property *prop;
+	const char *name;
+	int i;
+
+	for_all_symbols(i, sym) {
+		for (prop = sym->prop; prop; prop = prop->next) {
+			if (prop->type == P_SELECT || prop->type == P_DESELECT)
+				continue;
+			sym_add_expr_dependents(prop->visible.expr, sym);
+			sym_add_expr_dependents(prop->expr, sym);
+		}
+		sym_add_expr_dependents(sym->rev_dep.expr, sym);
+		sym_add_expr_dependents(sym->rev_dep_inv.expr, sym);
+	}
+	dependents_built = 1;
+
+	name = getenv("KCONFIG_TRACE");
+	if (name && *name && !trace_file) {
+		trace_file = fopen(name, "a");
+		if (trace_file)
+			atexit(sym_trace_flush);
+	}
+}
+
+/*
+ * Invalidate sym and everything computed from it, directly or not, after
+ * its user value changed.
+ */
+void sym_invalidate(struct symbol *sym)
+{
+	struct symbol *s, *dep;
+	int head, tail, i;
+
+	if (!dependents_built) {
+		sym_clear_all_valid();
+		return;
+	}
+
+	if (invalid_queue_size < symbol_count) {
+		invalid_queue_size = symbol_count;
+		invalid_queue = realloc(invalid_queue,
+				invalid_queue_size * sizeof(*invalid_queue));
+	}
+
+	sym->flags |= SYMBOL_VISITED;
+	invalid_queue[0] = sym;
+	for (head = 0, tail = 1; head < tail; head++) {
+		s = invalid_queue[head];
+		for (i = 0; i < s->dependents_cnt; i++) {
+			dep = s->dependents[i];
+			if (dep->flags & SYMBOL_VISITED)
+				continue;
+			dep->flags |= SYMBOL_VISITED;
+			invalid_queue[tail++] = dep;
+		}
+	}
+	for (i = 0; i < tail; i++)
+		invalid_queue[i]->flags &= ~(SYMBOL_VISITED | SYMBOL_VALID);
+
+	sym_trace_change(sym->name ? sym->name : "<choice>", tail);
 	sym_change_count++;
 	if (modules_sym)
 		sym_calc_value(modules_sym);
@@ -466,7 +636,7 @@ bool sym_set_tristate_value(struct symbol *sym, tristate val)
 
 	sym->user.tri = val;
 	if (oldval != val) {
-		sym_clear_all_valid();
+		sym_invalidate(sym);
 	}
 
 	return true;
@@ -624,7 +794,7 @@ bool sym_set_string_value(struct symbol *sym, const char *newval)
 
 	strcpy(val, newval);
 	free((void *)oldval);
-	sym_clear_all_valid();
+	sym_invalidate(sym);
 
 	return true;
 }
@@ -657,12 +827,75 @@ bool sym_is_changable(struct symbol *sym)
 	return sym->visible > sym->rev_dep.tri;
 }
 
+/*
+ * Symbols live in a chained hash table keyed on an FNV-1a hash of the
+ * name, kept in the symbol so chains are walked without a strcmp() per
+ * entry and the table can double without rehashing the names.  It grows
+ * once there are more symbols than buckets.
+ */
+static unsigned int sym_hash(const char *name)
+{
+	const unsigned char *p = (const unsigned char *)name;
+	unsigned int hash = 2166136261U;
+
+	while (*p) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void sym_hash_grow(void)
+{
+	struct symbol **table, *symbol, *next;
+	int size, i;
+
+	size = symbol_hash_size ? symbol_hash_size * 2 : SYMBOL_HASHSIZE;
+	table = calloc(size, sizeof(*table));
+
+	for (i = 0; i < symbol_hash_size; i++) {
+		for (symbol = symbol_hash[i]; symbol; symbol = next) {
+			next = symbol->next;
+			symbol->next = table[symbol->hash & (size - 1)];
+			table[symbol->hash & (size - 1)] = symbol;
+		}
+	}
+	free(symbol_hash);
+	symbol_hash = table;
+	symbol_hash_size = size;
+}
+
+/*
+ * Names are interned: one copy each, shared by the plain and the const
+ * symbol of that name, carved out of large blocks that are never freed.
+ */
+#define SYMBOL_NAME_BLOCK	16384
+
+static char *sym_intern(const char *name)
+{
+	static char *block;
+	static size_t left;
+	size_t len = strlen(name) + 1;
+	char *s;
+
+	if (len > SYMBOL_NAME_BLOCK / 4)
+		return strdup(name);
+	if (len > left) {
+		block = malloc(SYMBOL_NAME_BLOCK);
+		left = SYMBOL_NAME_BLOCK;
+	}
+	s = block;
+	memcpy(s, name, len);
+	block += len;
+	left -= len;
+	return s;
+}
+
 struct symbol *sym_lookup(const char *name, int isconst)
 {
 	struct symbol *symbol;
-	const char *ptr;
-	char *new_name;
-	int hash = 0;
+	char *new_name = NULL;
+	unsigned int hash = 0;
 
 	if (name) {
 		if (name[0] && !name[1]) {
@@ -672,33 +905,40 @@ struct symbol *sym_lookup(const char *name, int isconst)
 			case 'n': return &symbol_no;
 			}
 		}
-		for (ptr = name; *ptr; ptr++)
-			hash += *ptr;
-		hash &= 0xff;
-
-		for (symbol = symbol_hash[hash]; symbol; symbol = symbol->next) {
-			if (!strcmp(symbol->name, name)) {
-				if ((isconst && symbol->flags & SYMBOL_CONST) ||
-				    (!isconst && !(symbol->flags & SYMBOL_CONST)))
-					return symbol;
-			}
+		hash = sym_hash(name);
+
+		for (symbol = symbol_hash ? symbol_hash[hash & (symbol_hash_size - 1)] : NULL;
+		     symbol; symbol = symbol->next) {
+			if (symbol->hash != hash || !symbol->name ||
+			    strcmp(symbol->name, name))
+				continue;
+			if ((isconst && symbol->flags & SYMBOL_CONST) ||
+			    (!isconst && !(symbol->flags & SYMBOL_CONST)))
+				return symbol;
+			new_name = symbol->name;
 		}
-		new_name = strdup(name);
+		if (!new_name)
+			new_name = sym_intern(name);
 	} else {
-		new_name = NULL;
-		hash = 256;
+		/* choices have no name and are never looked up, spread them */
+		hash = symbol_count * 2654435761U;
 	}
 
 	symbol = malloc(sizeof(*symbol));
 	memset(symbol, 0, sizeof(*symbol));
 	symbol->name = new_name;
+	symbol->hash = hash;
 	symbol->type = S_UNKNOWN;
 	symbol->flags = SYMBOL_NEW;
 	if (isconst)
 		symbol->flags |= SYMBOL_CONST;
 
-	symbol->next = symbol_hash[hash];
-	symbol_hash[hash] = symbol;
+	if (symbol_count >= symbol_hash_size)
+		sym_hash_grow();
+	symbol_count++;
+
+	symbol->next = symbol_hash[hash & (symbol_hash_size - 1)];
+	symbol_hash[hash & (symbol_hash_size - 1)] = symbol;
 
 	return symbol;
 }
@@ -706,8 +946,7 @@ struct symbol *sym_lookup(const char *name, int isconst)
 struct symbol *sym_find(const char *name)
 {
 	struct symbol *symbol = NULL;
-	const char *ptr;
-	int hash = 0;
+	unsigned int hash;
 
 	if (!name)
 		return NULL;
@@ -719,12 +958,13 @@ struct symbol *sym_find(const char *name)
 		case 'n': return &symbol_no;
 		}
 	}
-	for (ptr = name; *ptr; ptr++)
-		hash += *ptr;
-	hash &= 0xff;
+	if (!symbol_hash)
+		return NULL;
+	hash = sym_hash(name);
 
-	for (symbol = symbol_hash[hash]; symbol; symbol = symbol->next) {
-		if (!strcmp(symbol->name, name) &&
+	for (symbol = symbol_hash[hash & (symbol_hash_size - 1)]; symbol; symbol = symbol->next) {
+		if (symbol->hash == hash && symbol->name &&
+		    !strcmp(symbol->name, name) &&
 		    !(symbol->flags & SYMBOL_CONST))
 				break;
 	}
@@ -29,8 +29,6 @@ static void zconf_error(const char *err, ...);
 static void zconferror(const char *err);
 static bool zconf_endtoken(struct kconf_id *id, int starttoken, int endtoken);
 
-struct symbol *symbol_hash[257];
-
 static struct menu *current_menu, *current_entry;
 
 #define YYDEBUG 0
@@ -485,6 +483,7 @@ void conf_parse(const char *name)
 	for_all_symbols(i, sym) {
 		sym_check_deps(sym);
         }
+	sym_build_dependents();
 
 	sym_change_count = 1;
 }
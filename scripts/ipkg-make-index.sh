@@ -8,6 +8,12 @@ if [ -z $pkg_dir ] || [ ! -d $pkg_dir ]; then
 	exit 1
 fi
 
+# tools/ipkg-index does the same in-process, in parallel and, given a cache
+# file in IPKG_INDEX_CACHE, without reading unchanged packages again
+if which ipkg-index >/dev/null 2>&1; then
+	exec ipkg-index ${IPKG_INDEX_CACHE:+-c "$IPKG_INDEX_CACHE"} "$pkg_dir"
+fi
+
 which md5sum >/dev/null 2>&1 || alias md5sum=md5
 
 for pkg in `find $pkg_dir -name '*.ipk' | sort`; do
@@ -32,7 +32,59 @@ sub clear_packages() {
 	%features = ();
 }
 
-sub parse_package_metadata($) {
+# A parsed copy of a metadata file is kept next to it, in Storable's binary
+# format, and used as long as the md5 of the file matches.  It is only used
+# when nothing has been parsed yet, as it replaces all of the tables at once.
+sub metadata_digest($) {
+	my $file = shift;
+	my $digest;
+
+	open my $fh, "<", $file or return undef;
+	binmode $fh;
+	eval { require Digest::MD5; $digest = Digest::MD5->new->addfile($fh)->hexdigest; };
+	close $fh;
+	return $digest;
+}
+
+sub metadata_cache_load($$) {
+	my $file = shift;
+	my $digest = shift;
+	my $data;
+
+	$digest and not %package or return undef;
+	eval { require Storable; $data = Storable::retrieve("$file.db"); } or return undef;
+	ref $data eq 'HASH' and $data->{digest} eq $digest or return undef;
+
+	%package = %{$data->{package}};
+	%srcpackage = %{$data->{srcpackage}};
+	%category = %{$data->{category}};
+	%subdir = %{$data->{subdir}};
+	%preconfig = %{$data->{preconfig}};
+	%features = %{$data->{features}};
+	return 1;
+}
+
+sub metadata_cache_store($$) {
+	my $file = shift;
+	my $digest = shift;
+
+	$digest or return;
+	eval {
+		require Storable;
+		Storable::nstore({
+			digest => $digest,
+			package => \%package,
+			srcpackage => \%srcpackage,
+			category => \%category,
+			subdir => \%subdir,
+			preconfig => \%preconfig,
+			features => \%features,
+		}, "$file.db.$$") and rename "$file.db.$$", "$file.db";
+	};
+	unlink "$file.db.$$";
+}
+
+sub parse_package_metadata_text($) {
 	my $file = shift;
 	my $pkg;
 	my $feature;
@@ -156,4 +208,15 @@ sub parse_package_metadata($) {
 	return 1;
 }
 
+sub parse_package_metadata($) {
+	my $file = shift;
+	my $fresh = !%package;
+	my $digest = metadata_digest($file);
+
+	metadata_cache_load($file, $digest) and return 1;
+	parse_package_metadata_text($file) or return undef;
+	$fresh and metadata_cache_store($file, $digest);
+	return 1;
+}
+
 1;
@@ -0,0 +1,268 @@
+/*
+ *  cksum-bench - check and time the shared checksum code
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <getopt.h>     /* for getopt() */
+#include <errno.h>
+#include <sys/time.h>
+
+#include "cksum.h"
+#include "md5.h"
+
+static char *progname;
+static char *ifname;
+static size_t buflen = 16 << 20;
+static int rounds = 4;
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+static void usage(int status)
+{
+	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
+
+	fprintf(stream, "Usage: %s [OPTIONS...]\n", progname);
+	fprintf(stream,
+"\n"
+"Options:\n"
+"  -i <file>       hash the file <file> instead of random data\n"
+"  -s <mb>         size of the random data in megabytes (default: 16)\n"
+"  -r <n>          time each one over <n> passes (default: 4)\n"
+"  -h              show this screen\n"
+	);
+
+	exit(status);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const char *name, double t)
+{
+	printf("  %-10s %8.1f MB/s\n", name,
+	       (double) buflen * rounds / (1 << 20) / t);
+}
+
+/* a bit at a time, to check the tables against */
+static uint32_t msb_bitwise(uint32_t c, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		c ^= (uint32_t) *p++ << 24;
+		for (i = 0; i < 8; i++)
+			c = (c & 0x80000000UL) ? (c << 1) ^ 0x04c11db7UL : c << 1;
+	}
+
+	return c;
+}
+
+static int read_file(unsigned char **bufp)
+{
+	FILE *f;
+	long len;
+	unsigned char *buf;
+
+	f = fopen(ifname, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\", %s", ifname);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(len ? len : 1);
+	if (buf == NULL) {
+		ERR("no memory for buffer");
+		fclose(f);
+		return -1;
+	}
+
+	if (len && fread(buf, len, 1, f) != 1) {
+		ERRS("unable to read from file \"%s\", %s", ifname);
+		free(buf);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	buflen = len;
+	*bufp = buf;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *impls[] = { "bytewise", "slice8", "pclmul" };
+	const char *best;
+	unsigned char *buf;
+	uint32_t ref, crc = 0, a, b;
+	MD5_CTX ctx;
+	unsigned char digest[16];
+	double t;
+	size_t i, half;
+	int n, r;
+	int res = EXIT_FAILURE;
+
+	progname = basename(argv[0]);
+
+	while ( 1 ) {
+		int c;
+
+		c = getopt(argc, argv, "i:s:r:h");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			ifname = optarg;
+			break;
+		case 's':
+			buflen = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (rounds < 1 || (!ifname && buflen == 0))
+		usage(EXIT_FAILURE);
+
+	if (ifname) {
+		if (read_file(&buf))
+			goto err;
+	} else {
+		buf = malloc(buflen);
+		if (buf == NULL) {
+			ERR("no memory for buffer");
+			goto err;
+		}
+		srand(1);
+		for (i = 0; i < buflen; i++)
+			buf[i] = rand();
+	}
+
+	best = cksum_crc32_impl();
+	printf("%lu bytes, %d passes, default crc32 is %s\n",
+	       (unsigned long) buflen, rounds, best);
+
+	/* the reference value, checked against a known one first */
+	cksum_crc32_select("bytewise");
+	if (cksum_crc32(0, "123456789", 9) != 0xcbf43926UL) {
+		ERR("crc32 of \"123456789\" is wrong");
+		goto err_free;
+	}
+	ref = cksum_crc32(0, buf, buflen);
+
+	printf("crc32:\n");
+	for (n = 0; n < sizeof(impls) / sizeof(impls[0]); n++) {
+		if (cksum_crc32_select(impls[n])) {
+			printf("  %-10s not available\n", impls[n]);
+			continue;
+		}
+
+		/* odd lengths and offsets, to hit all the tails */
+		for (i = 0; i < 256 && i < buflen; i++) {
+			size_t len = buflen - i < 4096 ? buflen - i : 4096 - i;
+
+			cksum_crc32_select("bytewise");
+			a = cksum_crc32(i, buf + i, len);
+			cksum_crc32_select(impls[n]);
+			if (cksum_crc32(i, buf + i, len) != a) {
+				ERR("%s disagrees at offset %lu length %lu",
+				    impls[n], (unsigned long) i,
+				    (unsigned long) len);
+				goto err_free;
+			}
+		}
+
+		t = now();
+		for (r = 0; r < rounds; r++)
+			crc = cksum_crc32(0, buf, buflen);
+		t = now() - t;
+
+		if (crc != ref) {
+			ERR("%s gave %08x, expected %08x", impls[n], crc, ref);
+			goto err_free;
+		}
+		report(impls[n], t);
+	}
+	cksum_crc32_select(best);
+
+	half = buflen / 3;
+	a = cksum_crc32(0, buf, half);
+	b = cksum_crc32(0, buf + half, buflen - half);
+	if (cksum_crc32_combine(a, b, buflen - half) != ref) {
+		ERR("crc32_combine disagrees");
+		goto err_free;
+	}
+
+	if (cksum_crc32_msb_update(~0, buf, buflen < 65536 ? buflen : 65536) !=
+	    msb_bitwise(~0, buf, buflen < 65536 ? buflen : 65536)) {
+		ERR("msb first crc32 disagrees");
+		goto err_free;
+	}
+
+	t = now();
+	for (r = 0; r < rounds; r++)
+		crc = cksum_crc32_msb_update(~0, buf, buflen);
+	t = now() - t;
+	report("msb", t);
+
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, buf, buflen);
+		MD5_Final(digest, &ctx);
+	}
+	t = now() - t;
+	printf("md5:\n");
+	report("rsa", t);
+
+	printf("crc32 %08x md5 ", ref);
+	for (i = 0; i < 16; i++)
+		printf("%02x", digest[i]);
+	printf("\n");
+
+	res = EXIT_SUCCESS;
+
+ err_free:
+	free(buf);
+ err:
+	return res;
+}
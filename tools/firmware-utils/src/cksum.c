@@ -0,0 +1,363 @@
+/*
+ *  The CRC32 code shared by firmware-utils, mtd and the other image tools.
+ *
+ *  Slicing-by-8 does eight bytes per step with eight 256 entry tables,
+ *  built on first use.  The data is read a byte at a time and put together
+ *  in a fixed order, so the same code is right on big endian targets and
+ *  never does an unaligned load.  On x86 hosts with PCLMULQDQ the bulk of a
+ *  buffer is folded 64 bytes at a time with carry-less multiplies instead,
+ *  after "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ *  Instruction" (Gopal et al., Intel, 2009).
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#include <string.h>
+
+#include "cksum.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CKSUM_PCLMUL	1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define CRC32_POLY	0xedb88320UL	/* reflected */
+#define CRC32_MSB_POLY	0x04c11db7UL
+
+enum {
+	IMPL_BYTEWISE,
+	IMPL_SLICE8,
+	IMPL_PCLMUL,
+};
+
+static uint32_t crc_lsb[8][256];
+static uint32_t crc_msb[8][256];
+static int impl = -1;
+
+static void cksum_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_lsb[0][i] = c;
+
+		c = (uint32_t) i << 24;
+		for (j = 0; j < 8; j++)
+			c = (c & 0x80000000UL) ? (c << 1) ^ CRC32_MSB_POLY : c << 1;
+		crc_msb[0][i] = c;
+	}
+
+	/* table k is the byte k places further from the end of the step */
+	for (j = 1; j < 8; j++) {
+		for (i = 0; i < 256; i++) {
+			c = crc_lsb[j - 1][i];
+			crc_lsb[j][i] = (c >> 8) ^ crc_lsb[0][c & 0xff];
+			c = crc_msb[j - 1][i];
+			crc_msb[j][i] = (c << 8) ^ crc_msb[0][c >> 24];
+		}
+	}
+
+	impl = IMPL_SLICE8;
+#ifdef CKSUM_PCLMUL
+	{
+		unsigned int a, b, cx, d;
+
+		if (__get_cpuid(1, &a, &b, &cx, &d) &&
+		    (cx & bit_PCLMUL) && (cx & bit_SSE4_1))
+			impl = IMPL_PCLMUL;
+	}
+#endif
+}
+
+static uint32_t crc32_bytewise(uint32_t c, const unsigned char *p, size_t len)
+{
+	while (len--)
+		c = crc_lsb[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const unsigned char *p, size_t len)
+{
+	uint32_t one, two;
+
+	while (len >= 8) {
+		one = c ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+		two = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+		c = crc_lsb[7][one & 0xff] ^
+		    crc_lsb[6][(one >> 8) & 0xff] ^
+		    crc_lsb[5][(one >> 16) & 0xff] ^
+		    crc_lsb[4][one >> 24] ^
+		    crc_lsb[3][two & 0xff] ^
+		    crc_lsb[2][(two >> 8) & 0xff] ^
+		    crc_lsb[1][(two >> 16) & 0xff] ^
+		    crc_lsb[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	return crc32_bytewise(c, p, len);
+}
+
+#ifdef CKSUM_PCLMUL
+/*
+ * Fold len bytes, a multiple of 16 and at least 64, into the register.
+ * The constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32)
+ * and x^64 mod P, bit reflected, then the Barrett constants for P.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t c, const unsigned char *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+	p += 64;
+	len -= 64;
+
+	/* four lanes of 128 bits, each folded 512 bits further on */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) (p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *) (p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *) (p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *) (p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* the four lanes down to one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t cksum_crc32_update(uint32_t reg, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (impl < 0)
+		cksum_init();
+
+	switch (impl) {
+	case IMPL_BYTEWISE:
+		return crc32_bytewise(reg, p, len);
+#ifdef CKSUM_PCLMUL
+	case IMPL_PCLMUL:
+		if (len >= 64) {
+			size_t n = len & ~(size_t) 15;
+
+			reg = crc32_pclmul(reg, p, n);
+			p += n;
+			len -= n;
+		}
+		return crc32_bytewise(reg, p, len);
+#endif
+	default:
+		return crc32_slice8(reg, p, len);
+	}
+}
+
+uint32_t cksum_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	return cksum_crc32_update(crc ^ 0xffffffffUL, buf, len) ^ 0xffffffffUL;
+}
+
+uint32_t cksum_crc32_msb_update(uint32_t c, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t one;
+
+	if (impl < 0)
+		cksum_init();
+
+	while (len >= 8) {
+		one = c ^ (((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+		c = crc_msb[7][one >> 24] ^
+		    crc_msb[6][(one >> 16) & 0xff] ^
+		    crc_msb[5][(one >> 8) & 0xff] ^
+		    crc_msb[4][one & 0xff] ^
+		    crc_msb[3][p[4]] ^
+		    crc_msb[2][p[5]] ^
+		    crc_msb[1][p[6]] ^
+		    crc_msb[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = (c << 8) ^ crc_msb[0][((c >> 24) ^ *p++) & 0xff];
+
+	return c;
+}
+
+/*
+ * Appending len zero bytes to the register is linear over GF(2), so it's a
+ * 32x32 bit matrix; squaring the one for a single zero bit gives the ones
+ * for 2, 4, 8... bits, and len is worked through a bit at a time.  The
+ * same approach as zlib's crc32_combine().
+ */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t cksum_crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b)
+{
+	uint32_t even[32], odd[32], row;
+	int n;
+
+	if (len_b == 0)
+		return crc_a;
+
+	/* one zero bit */
+	odd[0] = CRC32_POLY;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* two, then four zero bits; the loop starts at a byte */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	do {
+		gf2_matrix_square(even, odd);
+		if (len_b & 1)
+			crc_a = gf2_matrix_times(even, crc_a);
+		len_b >>= 1;
+		if (len_b == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len_b & 1)
+			crc_a = gf2_matrix_times(odd, crc_a);
+		len_b >>= 1;
+	} while (len_b);
+
+	return crc_a ^ crc_b;
+}
+
+const char *cksum_crc32_impl(void)
+{
+	if (impl < 0)
+		cksum_init();
+
+	switch (impl) {
+	case IMPL_BYTEWISE:
+		return "bytewise";
+	case IMPL_PCLMUL:
+		return "pclmul";
+	default:
+		return "slice8";
+	}
+}
+
+int cksum_crc32_select(const char *name)
+{
+	if (impl < 0)
+		cksum_init();
+
+	if (!strcmp(name, "bytewise"))
+		impl = IMPL_BYTEWISE;
+	else if (!strcmp(name, "slice8"))
+		impl = IMPL_SLICE8;
+#ifdef CKSUM_PCLMUL
+	else if (!strcmp(name, "pclmul")) {
+		unsigned int a, b, c, d;
+
+		if (!__get_cpuid(1, &a, &b, &c, &d) ||
+		    !(c & bit_PCLMUL) || !(c & bit_SSE4_1))
+			return -1;
+		impl = IMPL_PCLMUL;
+	}
+#endif
+	else
+		return -1;
+
+	return 0;
+}
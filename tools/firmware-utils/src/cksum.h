@@ -0,0 +1,52 @@
+/*
+ *  The CRC32 code shared by firmware-utils, mtd and the other image tools,
+ *  MD5 is in md5.c next to it.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#ifndef _CKSUM_H
+#define _CKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The reflected CRC32 (polynomial 0xedb88320) of zlib, ethernet and most
+ * firmware headers.
+ *
+ * cksum_crc32() works on finished values like zlib's crc32(): start with
+ * 0 and feed the previous result back in to carry on.
+ *
+ * cksum_crc32_update() works on the raw register, with no inversion going
+ * in or out, for the headers that start from something other than ~0 or
+ * don't invert the result.
+ */
+uint32_t cksum_crc32(uint32_t crc, const void *buf, size_t len);
+uint32_t cksum_crc32_update(uint32_t reg, const void *buf, size_t len);
+
+/*
+ * The finished CRC32 of A followed by B, from the finished CRC32s of A and
+ * of B and the length of B, without touching the data again.
+ */
+uint32_t cksum_crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
+/*
+ * The MSB first CRC32 (polynomial 0x04c11db7) of POSIX cksum and some
+ * vendor headers, on the raw register.
+ */
+uint32_t cksum_crc32_msb_update(uint32_t reg, const void *buf, size_t len);
+
+/*
+ * Which way the reflected CRC32 is computed: "pclmul" on x86 hosts that
+ * have carry-less multiply, "slice8" everywhere else.  cksum_crc32_select()
+ * forces one ("bytewise", "slice8" or "pclmul"), for cksum-bench, and
+ * returns -1 if it isn't available here.
+ */
+const char *cksum_crc32_impl(void);
+int cksum_crc32_select(const char *name);
+
+#endif /* _CKSUM_H */
@@ -0,0 +1,404 @@
+/*
+ *  Assembling firmware images out of pieces, shared by the image tools.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "fwimage.h"
+#include "cksum.h"
+#include "md5.h"
+
+#define FILL_LEN	(64 * 1024)
+#define IOV_BATCH	64
+
+int fwimage_file_open(struct fwimage_file *f, const char *name)
+{
+	struct stat st;
+	void *data;
+
+	memset(f, 0, sizeof(*f));
+	f->name = name;
+	f->fd = open(name, O_RDONLY);
+	if (f->fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for reading: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(f->fd, &st)) {
+		fprintf(stderr, "stat failed on \"%s\": %s\n",
+			name, strerror(errno));
+		goto err;
+	}
+
+	f->size = st.st_size;
+	if (!f->size)
+		return 0;
+
+	data = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "could not map \"%s\": %s\n",
+			name, strerror(errno));
+		goto err;
+	}
+	f->data = data;
+
+	return 0;
+
+ err:
+	close(f->fd);
+	f->fd = -1;
+	return -1;
+}
+
+void fwimage_file_close(struct fwimage_file *f)
+{
+	if (f->data)
+		munmap((void *) f->data, f->size);
+	if (f->fd >= 0)
+		close(f->fd);
+	f->data = NULL;
+	f->fd = -1;
+}
+
+void fwimage_init(struct fwimage *img)
+{
+	memset(img, 0, sizeof(*img));
+}
+
+void fwimage_free(struct fwimage *img)
+{
+	free(img->pieces);
+	fwimage_init(img);
+}
+
+static struct fwimage_piece *fwimage_piece(struct fwimage *img, size_t len)
+{
+	struct fwimage_piece *p;
+
+	if (img->count == img->size) {
+		int size = img->size ? 2 * img->size : 16;
+
+		p = realloc(img->pieces, size * sizeof(*p));
+		if (!p) {
+			fprintf(stderr, "no memory for the image layout\n");
+			return NULL;
+		}
+		img->pieces = p;
+		img->size = size;
+	}
+
+	p = &img->pieces[img->count++];
+	memset(p, 0, sizeof(*p));
+	p->fd = -1;
+	p->len = len;
+	img->len += len;
+
+	return p;
+}
+
+int fwimage_add(struct fwimage *img, const void *data, size_t len)
+{
+	struct fwimage_piece *p;
+
+	if (!len)
+		return 0;
+
+	p = fwimage_piece(img, len);
+	if (!p)
+		return -1;
+	p->data = data;
+
+	return 0;
+}
+
+int fwimage_add_file(struct fwimage *img, const struct fwimage_file *f)
+{
+	struct fwimage_piece *p;
+
+	if (!f->size)
+		return 0;
+
+	p = fwimage_piece(img, f->size);
+	if (!p)
+		return -1;
+	p->data = f->data;
+	p->fd = f->fd;
+	p->ofs = 0;
+
+	return 0;
+}
+
+int fwimage_add_fill(struct fwimage *img, uint8_t fill, size_t len)
+{
+	struct fwimage_piece *p;
+
+	if (!len)
+		return 0;
+
+	p = fwimage_piece(img, len);
+	if (!p)
+		return -1;
+	p->fill = fill;
+
+	return 0;
+}
+
+int fwimage_pad_to(struct fwimage *img, uint8_t fill, size_t ofs)
+{
+	if (ofs <= img->len)
+		return 0;
+
+	return fwimage_add_fill(img, fill, ofs - img->len);
+}
+
+/* FILL_LEN bytes of fill, shared by everything padding with it */
+static const uint8_t *fill_buf(uint8_t fill)
+{
+	static uint8_t *bufs[256];
+
+	if (!bufs[fill]) {
+		bufs[fill] = malloc(FILL_LEN);
+		if (!bufs[fill])
+			return NULL;
+		memset(bufs[fill], fill, FILL_LEN);
+	}
+
+	return bufs[fill];
+}
+
+int fwimage_walk(const struct fwimage *img, size_t ofs, size_t len,
+		 fwimage_fn fn, void *ctx)
+{
+	const struct fwimage_piece *p;
+	const uint8_t *fill;
+	size_t n, l;
+	int i;
+
+	for (i = 0; i < img->count && len; i++) {
+		p = &img->pieces[i];
+		if (ofs >= p->len) {
+			ofs -= p->len;
+			continue;
+		}
+
+		n = p->len - ofs < len ? p->len - ofs : len;
+		len -= n;
+
+		if (p->data) {
+			fn(ctx, p->data + ofs, n);
+			ofs = 0;
+			continue;
+		}
+
+		fill = fill_buf(p->fill);
+		if (!fill) {
+			fprintf(stderr, "no memory for padding\n");
+			return -1;
+		}
+		for (; n; n -= l) {
+			l = n < FILL_LEN ? n : FILL_LEN;
+			fn(ctx, fill, l);
+		}
+		ofs = 0;
+	}
+
+	return 0;
+}
+
+static void crc32_fn(void *ctx, const void *buf, size_t len)
+{
+	uint32_t *crc = ctx;
+
+	*crc = cksum_crc32(*crc, buf, len);
+}
+
+int fwimage_crc32(const struct fwimage *img, uint32_t *crc,
+		  size_t ofs, size_t len)
+{
+	return fwimage_walk(img, ofs, len, crc32_fn, crc);
+}
+
+static void md5_fn(void *ctx, const void *buf, size_t len)
+{
+	size_t n;
+
+	/* MD5_Update() takes an unsigned int */
+	for (; len; len -= n, buf = (const uint8_t *) buf + n) {
+		n = len < (1 << 30) ? len : (1 << 30);
+		MD5_Update(ctx, (unsigned char *) buf, (unsigned int) n);
+	}
+}
+
+int fwimage_md5(const struct fwimage *img, size_t ofs, size_t len,
+		uint8_t *digest)
+{
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	if (fwimage_walk(img, ofs, len, md5_fn, &ctx))
+		return -1;
+	MD5_Final(digest, &ctx);
+
+	return 0;
+}
+
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (cnt && n >= (ssize_t) iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Lets the kernel copy a file piece, without it passing through user
+ * space at all.  Returns 1 if it couldn't, for writev() to do it.
+ */
+static int copy_range(int out, const struct fwimage_piece *p)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+	static int unsupported;
+	loff_t in_ofs = p->ofs;
+	size_t left = p->len;
+	ssize_t n;
+
+	if (unsupported)
+		return 1;
+
+	while (left) {
+		n = syscall(__NR_copy_file_range, p->fd, &in_ofs, out, NULL,
+			    left, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (left != p->len)
+				return -1;
+			/* not for these files, or not in this kernel */
+			if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+				      errno == EINVAL || errno == EOPNOTSUPP ||
+				      errno == EBADF))
+				unsupported = 1;
+			return n < 0 && !unsupported ? -1 : 1;
+		}
+		left -= n;
+	}
+
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+int fwimage_write(const struct fwimage *img, const char *name)
+{
+	struct iovec iov[IOV_BATCH];
+	const struct fwimage_piece *p;
+	const uint8_t *fill;
+	size_t n, l;
+	int fd, cnt = 0, i, ret;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for writing: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < img->count; i++) {
+		p = &img->pieces[i];
+
+		if (p->fd >= 0 && p->len >= FILL_LEN) {
+			if (cnt && write_iov(fd, iov, cnt))
+				goto err;
+			cnt = 0;
+
+			ret = copy_range(fd, p);
+			if (ret < 0)
+				goto err;
+			if (!ret)
+				continue;
+		}
+
+		if (p->data) {
+			if (cnt == IOV_BATCH) {
+				if (write_iov(fd, iov, cnt))
+					goto err;
+				cnt = 0;
+			}
+			iov[cnt].iov_base = (void *) p->data;
+			iov[cnt].iov_len = p->len;
+			cnt++;
+			continue;
+		}
+
+		fill = fill_buf(p->fill);
+		if (!fill) {
+			errno = ENOMEM;
+			goto err;
+		}
+		for (n = p->len; n; n -= l) {
+			l = n < FILL_LEN ? n : FILL_LEN;
+			if (cnt == IOV_BATCH) {
+				if (write_iov(fd, iov, cnt))
+					goto err;
+				cnt = 0;
+			}
+			iov[cnt].iov_base = (void *) fill;
+			iov[cnt].iov_len = l;
+			cnt++;
+		}
+	}
+
+	if (cnt && write_iov(fd, iov, cnt))
+		goto err;
+
+	if (close(fd)) {
+		fd = -1;
+		goto err;
+	}
+
+	return 0;
+
+ err:
+	fprintf(stderr, "unable to write \"%s\": %s\n", name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	unlink(name);
+	return -1;
+}
@@ -0,0 +1,92 @@
+/*
+ *  Assembling firmware images out of pieces, shared by the image tools.
+ *
+ *  The input files are mapped instead of read, and an image is a list of
+ *  pieces: parts of the mapped files, small buffers of the tool such as
+ *  headers, and runs of padding.  The checksums are computed and the output
+ *  is written straight from that list, so the payloads are never copied
+ *  into a buffer of the image's size.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FWIMAGE_H
+#define _FWIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct fwimage_file {
+	const char *name;
+	int fd;
+	const uint8_t *data;
+	size_t size;
+};
+
+struct fwimage_piece {
+	const uint8_t *data;	/* NULL for padding */
+	size_t len;
+	int fd;			/* file data is mapped from, or -1 */
+	off_t ofs;		/* where in fd */
+	uint8_t fill;
+};
+
+struct fwimage {
+	struct fwimage_piece *pieces;
+	int count;
+	int size;
+	size_t len;		/* of the image so far */
+};
+
+/*
+ * Maps name read-only.  Prints an error and returns -1 if that fails;
+ * an empty file is fine and has data == NULL.
+ */
+int fwimage_file_open(struct fwimage_file *f, const char *name);
+void fwimage_file_close(struct fwimage_file *f);
+
+void fwimage_init(struct fwimage *img);
+void fwimage_free(struct fwimage *img);
+
+/*
+ * Append to the image.  Only the pointer is kept, so data may still be
+ * changed (a header filled in once the checksums are known) until the
+ * image is written, and has to stay around until then.
+ */
+int fwimage_add(struct fwimage *img, const void *data, size_t len);
+int fwimage_add_file(struct fwimage *img, const struct fwimage_file *f);
+int fwimage_add_fill(struct fwimage *img, uint8_t fill, size_t len);
+
+/* pads with fill up to ofs, an image already that long is left alone */
+int fwimage_pad_to(struct fwimage *img, uint8_t fill, size_t ofs);
+
+/*
+ * Hands [ofs, ofs + len) of the image to fn piece by piece, to compute
+ * checksums of it without a copy.  Prints an error and returns -1 if there
+ * is no memory for the padding.
+ */
+typedef void (*fwimage_fn)(void *ctx, const void *buf, size_t len);
+int fwimage_walk(const struct fwimage *img, size_t ofs, size_t len,
+		 fwimage_fn fn, void *ctx);
+
+/*
+ * cksum_crc32() of [ofs, ofs + len) of the image, carried on from *crc,
+ * and its MD5.  Both return -1 if the walk fails.
+ */
+int fwimage_crc32(const struct fwimage *img, uint32_t *crc,
+		  size_t ofs, size_t len);
+int fwimage_md5(const struct fwimage *img, size_t ofs, size_t len,
+		uint8_t *digest);
+
+/*
+ * Writes the image to name, with copy_file_range() for the file pieces
+ * where the kernel supports it and writev() for everything else.  Prints
+ * an error, removes name and returns -1 if that fails.
+ */
+int fwimage_write(const struct fwimage *img, const char *name);
+
+#endif /* _FWIMAGE_H */
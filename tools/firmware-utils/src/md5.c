@@ -138,6 +138,19 @@ unsigned int inLen;
   mdContext->i[1] += ((UINT4)inLen >> 29);
 
   while (inLen--) {
+    /* whole blocks straight from the caller's buffer */
+    if (mdi == 0 && inLen >= 0x3F) {
+      for (i = 0, ii = 0; i < 16; i++, ii += 4)
+        in[i] = (((UINT4)inBuf[ii+3]) << 24) |
+                (((UINT4)inBuf[ii+2]) << 16) |
+                (((UINT4)inBuf[ii+1]) << 8) |
+                ((UINT4)inBuf[ii]);
+      Transform (mdContext->buf, in);
+      inBuf += 0x40;
+      inLen -= 0x3F;
+      continue;
+    }
+
     /* add new character to buffer, increment mdi */
     mdContext->in[mdi++] = *inBuf++;
 
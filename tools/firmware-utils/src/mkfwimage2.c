@@ -24,13 +24,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <zlib.h>
-#include <sys/mman.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include "fw.h"
+#include "cksum.h"
+#include "fwimage.h"
 
 #undef VERSION
 #define VERSION "1.2-OpenWrt.1"
@@ -75,57 +75,61 @@ static void write_header(void* mem, const char* version)
 
 	memcpy(header->magic, im.magic, MAGIC_LENGTH);
 	strncpy(header->version, version, sizeof(header->version));
-	header->crc = htonl(crc32(0L, (unsigned char *)header,
+	header->crc = htonl(cksum_crc32(0L, (unsigned char *)header,
 				sizeof(header_t) - 2 * sizeof(u_int32_t)));
 	header->pad = 0L;
 }
 
-static void write_signature(void* mem, u_int32_t sig_offset)
+static int write_signature(signature_t* sign, struct fwimage* img)
 {
+	u_int32_t crc = 0L;
+
 	/* write signature */
-	signature_t* sign = (signature_t*)(mem + sig_offset);
 	memset(sign, 0, sizeof(signature_t));
 
+	if (fwimage_crc32(img, &crc, 0, img->len))
+		return -1;
+
 	memcpy(sign->magic, MAGIC_END, MAGIC_LENGTH);
-	sign->crc = htonl(crc32(0L,(unsigned char *)mem, sig_offset));
+	sign->crc = htonl(crc);
 	sign->pad = 0L;
+
+	return 0;
 }
 
-static int write_part(void* mem, part_data_t* d)
+static int write_part(struct fwimage* img, part_t* p, part_crc_t* crc,
+		      struct fwimage_file* f, part_data_t* d)
 {
-	char* addr;
-	int fd;
-	part_t* p = mem;
-	part_crc_t* crc = mem + sizeof(part_t) + d->stats.st_size;
+	size_t ofs = img->len;
+	u_int32_t sum = 0L;
 
-	fd = open(d->filename, O_RDONLY);
-	if (fd < 0) {
+	if (fwimage_file_open(f, d->filename)) {
 		ERROR("Failed opening file '%s'\n", d->filename);
 		return -1;
 	}
 
-	if ((addr=(char*)mmap(0, d->stats.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-		ERROR("Failed mmaping memory for file '%s'\n", d->filename);
-		close(fd);
-		return -2;
-	}
-
-	memcpy(mem + sizeof(part_t), addr, d->stats.st_size);
-	munmap(addr, d->stats.st_size);
-
-	memset(p->name, 0, sizeof(p->name));
+	memset(p, 0, sizeof(part_t));
 	strncpy(p->magic, MAGIC_PART, MAGIC_LENGTH);
 	strncpy(p->name, d->partition_name, sizeof(p->name));
 	p->index = htonl(d->partition_index);
-	p->data_size = htonl(d->stats.st_size);
+	p->data_size = htonl(f->size);
 	p->part_size = htonl(d->partition_length);
 	p->baseaddr = htonl(d->partition_baseaddr);
 	p->memaddr = htonl(d->partition_memaddr);
 	p->entryaddr = htonl(d->partition_entryaddr);
 
-	crc->crc = htonl(crc32(0L, mem, d->stats.st_size + sizeof(part_t)));
+	if (fwimage_add(img, p, sizeof(part_t)) || fwimage_add_file(img, f))
+		return -2;
+
+	if (fwimage_crc32(img, &sum, ofs, sizeof(part_t) + f->size))
+		return -2;
+
+	crc->crc = htonl(sum);
 	crc->pad = 0L;
 
+	if (fwimage_add(img, crc, sizeof(part_crc_t)))
+		return -2;
+
 	return 0;
 }
 
@@ -318,59 +322,55 @@ static int image_layout_verify(void)
 
 static int build_image(void)
 {
-	char* mem;
-	char* ptr;
-	u_int32_t mem_size;
-	FILE* f;
-	int i;
-
-	/* build in-memory buffer */
-	mem_size = sizeof(header_t) + sizeof(signature_t);
+	header_t header;
+	part_t parts[MAX_SECTIONS];
+	part_crc_t crcs[MAX_SECTIONS];
+	struct fwimage_file files[MAX_SECTIONS];
+	signature_t sign;
+	struct fwimage img;
+	int i, ret = 0;
+
+	fwimage_init(&img);
 	for (i = 0; i < im.part_count; ++i) {
-		part_data_t* d = &im.parts[i];
-		mem_size += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
-	}
-
-	mem = (char*)calloc(mem_size, 1);
-	if (mem == NULL) {
-		ERROR("Cannot allocate memory chunk of size '%u'\n", mem_size);
-		return -1;
+		files[i].fd = -1;
+		files[i].data = NULL;
 	}
 
 	/* write header */
-	write_header(mem, im.version);
-	ptr = mem + sizeof(header_t);
+	write_header(&header, im.version);
+	if (fwimage_add(&img, &header, sizeof(header_t))) {
+		ret = -1;
+		goto out;
+	}
 
 	/* write all parts */
 	for (i = 0; i < im.part_count; ++i) {
 		part_data_t* d = &im.parts[i];
-		int rc;
-		if ((rc = write_part(ptr, d)) != 0) {
+		if (write_part(&img, &parts[i], &crcs[i], &files[i], d) != 0) {
 			ERROR("ERROR: failed writing part %u '%s'\n", i, d->partition_name);
-			return -1;
+			ret = -1;
+			goto out;
 		}
-		ptr += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 
-
 	/* write signature */
-	write_signature(mem, mem_size - sizeof(signature_t));
-
-	/* write in-memory buffer into file */
-	if ((f = fopen(im.outputfile, "w")) == NULL) {
-		ERROR("Can not create output file: '%s'\n", im.outputfile);
-		return -10;
+	if (write_signature(&sign, &img) ||
+	    fwimage_add(&img, &sign, sizeof(signature_t))) {
+		ret = -1;
+		goto out;
 	}
 
-	if (fwrite(mem, mem_size, 1, f) != 1) {
-		ERROR("Could not write %d bytes into file: '%s'\n",
-				mem_size, im.outputfile);
-		return -11;
+	if (fwimage_write(&img, im.outputfile) != 0) {
+		ERROR("Could not write %lu bytes into file: '%s'\n",
+				(unsigned long) img.len, im.outputfile);
+		ret = -11;
 	}
 
-	free(mem);
-	fclose(f);
-	return 0;
+ out:
+	fwimage_free(&img);
+	for (i = 0; i < im.part_count; ++i)
+		fwimage_file_close(&files[i]);
+	return ret;
 }
 
 int main(int argc, char* argv[])
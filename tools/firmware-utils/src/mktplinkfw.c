@@ -26,6 +26,7 @@
 #include <netinet/in.h>
 
 #include "md5.h"
+#include "fwimage.h"
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
@@ -598,10 +599,8 @@ static int check_options(void)
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static int fill_header(struct fw_header *hdr, struct fwimage *img)
 {
-	struct fw_header *hdr = (struct fw_header *)buf;
-
 	memset(hdr, 0, sizeof(struct fw_header));
 
 	hdr->version = htonl(HEADER_VERSION_V1);
@@ -629,17 +628,15 @@ static void fill_header(char *buf, int len)
 	hdr->ver_mid = htons(fw_ver_mid);
 	hdr->ver_lo = htons(fw_ver_lo);
 
-	get_md5(buf, len, hdr->md5sum1);
+	return fwimage_md5(img, 0, img->len, hdr->md5sum1);
 }
 
-static int pad_jffs2(char *buf, int currlen)
+static int pad_jffs2(struct fwimage *img)
 {
-	int len;
 	uint32_t pad_mask;
 
-	len = currlen;
 	pad_mask = (64 * 1024);
-	while ((len < layout->fw_max_len) && (pad_mask != 0)) {
+	while ((img->len < layout->fw_max_len) && (pad_mask != 0)) {
 		uint32_t mask;
 		int i;
 
@@ -649,111 +646,72 @@ static int pad_jffs2(char *buf, int currlen)
 				break;
 		}
 
-		len = ALIGN(len, mask);
+		if (fwimage_pad_to(img, 0xff, ALIGN(img->len, mask)))
+			return -1;
 
 		for (i = 10; i < 32; i++) {
 			mask = 1 << i;
-			if ((len & (mask - 1)) == 0)
+			if ((img->len & (mask - 1)) == 0)
 				pad_mask &= ~mask;
 		}
 
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
-
-		len += sizeof(jffs2_eof_mark);
-	}
-
-	return len;
-}
-
-static int write_fw(char *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
+		if (fwimage_add(img, jffs2_eof_mark, sizeof(jffs2_eof_mark)))
+			return -1;
 	}
 
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
+	return 0;
 }
 
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
+	struct fw_header hdr;
+	struct fwimage img;
+	struct fwimage_file kernel, rootfs;
+	uint32_t ofs;
 	int ret = EXIT_FAILURE;
-	int writelen = 0;
 
-	buflen = layout->fw_max_len;
+	fwimage_init(&img);
+	kernel.fd = rootfs.fd = -1;
+	kernel.data = rootfs.data = NULL;
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
+	if (fwimage_file_open(&kernel, kernel_info.file_name))
+		goto out;
+	if (!combined && fwimage_file_open(&rootfs, rootfs_info.file_name))
 		goto out;
-	}
-
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
 
-	writelen = sizeof(struct fw_header) + kernel_len;
+	/* the header is only filled in once the image around it is known */
+	if (fwimage_add(&img, &hdr, sizeof(hdr)) ||
+	    fwimage_add_file(&img, &kernel))
+		goto out;
 
 	if (!combined) {
 		if (rootfs_align)
-			p = buf + writelen;
+			ofs = sizeof(struct fw_header) + kernel_len;
 		else
-			p = buf + rootfs_ofs;
+			ofs = rootfs_ofs;
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+		if (fwimage_pad_to(&img, 0xff, ofs) ||
+		    fwimage_add_file(&img, &rootfs))
+			goto out;
 
-		if (rootfs_align)
-			writelen += rootfs_info.file_size;
-		else
-			writelen = rootfs_ofs + rootfs_info.file_size;
-
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+		if (add_jffs2_eof && pad_jffs2(&img))
+			goto out;
 	}
 
-	if (!strip_padding)
-		writelen = buflen;
+	if (!strip_padding && fwimage_pad_to(&img, 0xff, layout->fw_max_len))
+		goto out;
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	if (fill_header(&hdr, &img) || fwimage_write(&img, ofname))
+		goto out;
+
+	DBG("firmware file \"%s\" completed", ofname);
 
 	ret = EXIT_SUCCESS;
 
- out_free_buf:
-	free(buf);
  out:
+	fwimage_free(&img);
+	fwimage_file_close(&rootfs);
+	fwimage_file_close(&kernel);
 	return ret;
 }
 
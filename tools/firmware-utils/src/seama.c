@@ -49,6 +49,7 @@
 #include <arpa/inet.h>
 
 #include "md5.h"
+#include "fwimage.h"
 #include "seama.h"
 
 #define PROGNAME			"seama"
@@ -164,24 +165,6 @@ static size_t calculate_digest(FILE * fh, size_t size, uint8_t * digest)
 	return bytes_read;
 }
 
-#define READ_BUFF_SIZE 8*1024
-static size_t copy_file(FILE * to, FILE * from)
-{
-	size_t i, fsize = 0;
-	uint8_t buf[READ_BUFF_SIZE];
-
-	while (!feof(from) && !ferror(from))
-	{
-		i = fread(buf, sizeof(uint8_t), READ_BUFF_SIZE, from);
-		if (i > 0)
-		{
-			fsize += i;
-			fwrite(buf, sizeof(uint8_t), i, to);
-		}
-	}
-	return fsize;
-}
-
 static int verify_seama(const char * fname, int msg)
 {
 	FILE * fh = NULL;
@@ -270,9 +253,8 @@ static int verify_seama(const char * fname, int msg)
 	return ret;
 }
 
-static size_t write_seama_header(FILE * fh, char * meta[], size_t msize, size_t size)
+static void fill_seama_header(seamahdr_t * shdr, char * meta[], size_t msize, size_t size)
 {
-	seamahdr_t shdr;
 	size_t i;
 	uint16_t metasize = 0;
 
@@ -283,38 +265,25 @@ static size_t write_seama_header(FILE * fh, char * meta[], size_t msize, size_t
 	verbose("SEAMA META : %d bytes\n", metasize);
 
 	/* Fill up the header, all the data endian should be network byte order. */
-	shdr.magic		= htonl(SEAMA_MAGIC);
-	shdr.reserved	= 0;
-	shdr.metasize	= htons(metasize);
-	shdr.size		= htonl(size);
-
-	/* Write the header */
-	return fwrite(&shdr, sizeof(seamahdr_t), 1, fh);
+	shdr->magic		= htonl(SEAMA_MAGIC);
+	shdr->reserved	= 0;
+	shdr->metasize	= htons(metasize);
+	shdr->size		= htonl(size);
 }
 
-static size_t write_checksum(FILE * fh, uint8_t * checksum)
+static int add_meta_data(struct fwimage * img, char * meta[], size_t size)
 {
-	return fwrite(checksum, sizeof(uint8_t), 16, fh);
-}
-
-static size_t write_meta_data(FILE * fh, char * meta[], size_t size)
-{
-	size_t i,j;
+	size_t i;
 	size_t ret = 0;
 
 	for (i=0; i<size; i++)
 	{
 		verbose("SEAMA META data : %s\n", meta[i]);
-		j = fwrite(meta[i], sizeof(char), strlen(meta[i])+1, fh);
-		if (j != strlen(meta[i])+1) return 0;
-		ret += j;
+		if (fwimage_add(img, meta[i], strlen(meta[i])+1) < 0) return -1;
+		ret += strlen(meta[i])+1;
 	}
 	//+++ let meta data end on 4 alignment by siyou. 2010/3/1 03:58pm
-	j = ((ret+3)/4)*4;
-	for ( ; ret < j; ret++)
-		fwrite("", sizeof(char), 1, fh);
-
-	return ret;
+	return fwimage_add_fill(img, 0, ((ret+3)/4)*4 - ret);
 }
 
 /*******************************************************************/
@@ -326,8 +295,9 @@ static void dump_seama(const char * fname)
 
 static void seal_files(const char * file)
 {
-	FILE * fh;
-	FILE * ifh;
+	struct fwimage img;
+	struct fwimage_file files[MAX_IMAGE];
+	seamahdr_t shdr;
 	size_t i;
 
 	/* Each image should be seama. */
@@ -340,64 +310,66 @@ static void seal_files(const char * file)
 		}
 	}
 
-	/* Open file for write */
-	fh = fopen(file, "w+");
-	if (fh)
+	fwimage_init(&img);
+	for (i=0; i<o_isize; i++)
 	{
-		/* Write the header. */
-		write_seama_header(fh, o_meta, o_msize, 0);
-		write_meta_data(fh, o_meta, o_msize);
+		files[i].fd = -1;
+		files[i].data = NULL;
+	}
 
-		/* Write image files */
-		for (i=0; i<o_isize; i++)
-		{
-			ifh = fopen(o_images[i], "r+");
-			if (ifh)
-			{
-				copy_file(fh, ifh);
-				fclose(ifh);
-			}
-		}
+	/* The header. */
+	fill_seama_header(&shdr, o_meta, o_msize, 0);
+	if (fwimage_add(&img, &shdr, sizeof(shdr)) < 0 ||
+		add_meta_data(&img, o_meta, o_msize) < 0)
+		goto out;
 
-		fclose(fh);
+	/* The image files */
+	for (i=0; i<o_isize; i++)
+	{
+		if (fwimage_file_open(&files[i], o_images[i]) < 0) continue;
+		if (fwimage_add_file(&img, &files[i]) < 0) goto out;
 	}
+
+	fwimage_write(&img, file);
+
+out:
+	for (i=0; i<o_isize; i++) fwimage_file_close(&files[i]);
+	fwimage_free(&img);
 }
 
 static void pack_files(void)
 {
-	FILE * fh;
-	FILE * ifh;
-	size_t i, fsize;
+	struct fwimage img;
+	struct fwimage_file ifile;
+	seamahdr_t shdr;
+	size_t i;
 	char filename[512];
 	uint8_t digest[16];
 
 	for (i=0; i<o_isize; i++)
 	{
-		/* Open the input file. */
-		ifh = fopen(o_images[i], "r+");
-		if (ifh)
+		/* Map the input file. */
+		if (fwimage_file_open(&ifile, o_images[i]) < 0)
 		{
-			fsize = calculate_digest(ifh, 0, digest);
-			verbose("file size (%s) : %d\n", o_images[i], fsize);
-			rewind(ifh);
-
-			/* Open the output file. */
-			sprintf(filename, "%s.seama", o_images[i]);
-			fh = fopen(filename, "w+");
-			if (fh)
-			{
-				write_seama_header(fh, o_meta, o_msize, fsize);
-				write_checksum(fh, digest);
-				write_meta_data(fh, o_meta, o_msize);
-				copy_file(fh, ifh);
-				fclose(fh);
-			}
-			fclose(ifh);
+			printf("Unable to open image file '%s'\n",o_images[i]);
+			continue;
 		}
-		else
+		verbose("file size (%s) : %d\n", o_images[i], (int)ifile.size);
+
+		fwimage_init(&img);
+		fill_seama_header(&shdr, o_meta, o_msize, ifile.size);
+		if (fwimage_add(&img, &shdr, sizeof(shdr)) == 0 &&
+			fwimage_add(&img, digest, sizeof(digest)) == 0 &&
+			add_meta_data(&img, o_meta, o_msize) == 0 &&
+			fwimage_add_file(&img, &ifile) == 0 &&
+			/* The digest covers the image file only. */
+			fwimage_md5(&img, img.len - ifile.size, ifile.size, digest) == 0)
 		{
-			printf("Unable to open image file '%s'\n",o_images[i]);
+			sprintf(filename, "%s.seama", o_images[i]);
+			fwimage_write(&img, filename);
 		}
+		fwimage_free(&img);
+		fwimage_file_close(&ifile);
 	}
 }
 
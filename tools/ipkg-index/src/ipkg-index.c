@@ -0,0 +1,700 @@
+/*
+ *  ipkg-index - write the Packages index for a directory of .ipk files
+ *
+ *  Does what scripts/ipkg-make-index.sh does, without the processes per
+ *  package: the control file is taken out of each package in-process, the
+ *  packages are read by several threads at once, and the entries of the
+ *  packages which didn't change since the last run can be taken from a
+ *  cache file instead of reading the packages again.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "md5.h"
+
+#define CACHE_MAGIC	"ipkg-index-cache 2"
+#define MAX_CONTROL	(16 << 20)	/* control.tar.gz and control */
+#define MD5_CHUNK	(1 << 20)
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#endif
+
+struct pkg {
+	char *path;		/* as find(1) would print it */
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;	/* a rebuild within the second must miss too */
+	ino_t ino;
+	const char *entry;	/* the Packages entry, from the cache or made */
+	size_t entry_len;
+	char *buf;		/* entry, if made here */
+};
+
+struct gz {
+	z_stream z;
+	int end;
+};
+
+static char *progname;
+static char *cachename;
+static int jobs;
+
+static struct pkg *pkgs;
+static int npkgs;
+static int next_pkg;
+static int failed;
+static pthread_mutex_t pkg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+static void usage(int status)
+{
+	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
+
+	fprintf(stream, "Usage: %s [OPTIONS...] <package_directory>\n", progname);
+	fprintf(stream,
+"\n"
+"Options:\n"
+"  -c <file>       keep the entries in <file>, and take those of packages\n"
+"                  with the same path, size, mtime and inode from it next time\n"
+"  -j <n>          read <n> packages at once (default: number of CPUs)\n"
+"  -h              show this screen\n"
+	);
+
+	exit(status);
+}
+
+/*
+ * gzip streams inflated out of memory, read from like a file
+ */
+static int gz_open(struct gz *g, const void *buf, size_t len)
+{
+	memset(g, 0, sizeof(*g));
+	if (inflateInit2(&g->z, 16 + MAX_WBITS) != Z_OK)
+		return -1;
+	g->z.next_in = (Bytef *) buf;
+	g->z.avail_in = len;
+	return 0;
+}
+
+static void gz_close(struct gz *g)
+{
+	inflateEnd(&g->z);
+}
+
+static int gz_read(struct gz *g, void *buf, size_t len)
+{
+	int ret;
+
+	g->z.next_out = buf;
+	g->z.avail_out = len;
+	while (g->z.avail_out && !g->end) {
+		ret = inflate(&g->z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			g->end = 1;
+		else if (ret != Z_OK)
+			return -1;
+	}
+
+	return len - g->z.avail_out;
+}
+
+static int gz_skip(struct gz *g, size_t len)
+{
+	char buf[4096];
+	size_t n;
+
+	while (len) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (gz_read(g, buf, n) != n)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int member_is(const char *member, const char *name)
+{
+	if (!strncmp(member, "./", 2))
+		member += 2;
+	return !strcmp(member, name);
+}
+
+/*
+ * Looks for the file name in the tar stream g, leaving g at its contents.
+ * Returns its size, or -1 if it isn't there.
+ */
+static long tar_find(struct gz *g, const char *name)
+{
+	unsigned char hdr[512];
+	char member[512], num[13];
+	long size;
+
+	while (gz_read(g, hdr, sizeof(hdr)) == sizeof(hdr) && hdr[0]) {
+		memcpy(num, hdr + 124, 12);
+		num[12] = 0;
+		size = strtol(num, NULL, 8);
+		if (size < 0)
+			return -1;
+
+		if (!memcmp(hdr + 257, "ustar", 5) && hdr[345])
+			snprintf(member, sizeof(member), "%.155s/%.100s",
+				 hdr + 345, hdr);
+		else
+			snprintf(member, sizeof(member), "%.100s", hdr);
+
+		if ((hdr[156] == '0' || hdr[156] == 0) &&
+		    member_is(member, name))
+			return size;
+
+		if (gz_skip(g, (size + 511) & ~511L))
+			return -1;
+	}
+
+	return -1;
+}
+
+/* takes the file name out of the tar.gz in buf, into a new buffer */
+static char *targz_extract(const void *buf, size_t len, const char *name,
+			   size_t *outlen)
+{
+	struct gz g;
+	char *out = NULL;
+	long size;
+
+	if (gz_open(&g, buf, len))
+		return NULL;
+
+	size = tar_find(&g, name);
+	if (size < 0 || size > MAX_CONTROL)
+		goto out;
+
+	out = malloc(size + 1);
+	if (!out)
+		goto out;
+	if (gz_read(&g, out, size) != size) {
+		free(out);
+		out = NULL;
+		goto out;
+	}
+	out[size] = 0;
+	*outlen = size;
+
+ out:
+	gz_close(&g);
+	return out;
+}
+
+/* control.tar.gz from an ar(1) archive, as opkg-build -a makes them */
+static const void *ar_find(const unsigned char *buf, size_t len,
+			   const char *name, size_t *outlen)
+{
+	size_t pos = 8, size;
+	char member[17], num[11], *p;
+
+	while (pos + 60 <= len) {
+		const unsigned char *hdr = buf + pos;
+
+		memcpy(member, hdr, 16);
+		member[16] = 0;
+		for (p = member + 15; p >= member && (*p == ' ' || *p == '/'); p--)
+			*p = 0;
+		memcpy(num, hdr + 48, 10);
+		num[10] = 0;
+		size = strtoul(num, NULL, 10);
+
+		pos += 60;
+		if (size > len - pos)
+			return NULL;
+		if (member_is(member, name)) {
+			*outlen = size;
+			return buf + pos;
+		}
+		pos += (size + 1) & ~1UL;
+	}
+
+	return NULL;
+}
+
+static char *ipk_control(const unsigned char *buf, size_t len, size_t *outlen)
+{
+	const void *ctrl;
+	char *ctrl_buf = NULL, *control;
+	size_t ctrl_len;
+
+	if (len > 8 && !memcmp(buf, "!<arch>\n", 8)) {
+		ctrl = ar_find(buf, len, "control.tar.gz", &ctrl_len);
+		if (!ctrl)
+			return NULL;
+	} else {
+		ctrl = ctrl_buf = targz_extract(buf, len, "control.tar.gz",
+						&ctrl_len);
+		if (!ctrl)
+			return NULL;
+	}
+
+	control = targz_extract(ctrl, ctrl_len, "control", outlen);
+	free(ctrl_buf);
+	return control;
+}
+
+/*
+ * The control file with Filename, Size and MD5Sum put in front of the
+ * Description, then an empty line.
+ */
+static int pkg_entry(struct pkg *p, const char *control, size_t len,
+		     const unsigned char *digest)
+{
+	const char *filename = p->path, *line, *nl, *end = control + len;
+	char fields[PATH_MAX + 128];
+	size_t fields_len, size;
+	char *out;
+	int i, n;
+
+	if (!strncmp(filename, "./", 2))
+		filename += 2;
+	fields_len = snprintf(fields, sizeof(fields),
+			      "Filename: %s\nSize: %lld\nMD5Sum: ",
+			      filename, (long long) p->size);
+	for (i = 0; i < 16; i++)
+		fields_len += sprintf(fields + fields_len, "%02x", digest[i]);
+	fields[fields_len++] = '\n';
+
+	n = 0;
+	for (line = control; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		if (!strncmp(line, "Description:", 12))
+			n++;
+		if (!nl)
+			break;
+	}
+
+	size = len + n * fields_len + 1;
+	out = malloc(size);
+	if (!out)
+		return -1;
+
+	p->buf = out;
+	for (line = control; line < end; ) {
+		size_t l;
+
+		nl = memchr(line, '\n', end - line);
+		l = nl ? nl + 1 - line : end - line;
+
+		if (!strncmp(line, "Description:", 12)) {
+			memcpy(out, fields, fields_len);
+			out += fields_len;
+		}
+		memcpy(out, line, l);
+		out += l;
+		line += l;
+	}
+	*out++ = '\n';
+
+	p->entry = p->buf;
+	p->entry_len = out - p->buf;
+	return 0;
+}
+
+static int pkg_read(struct pkg *p)
+{
+	unsigned char digest[16];
+	unsigned char *map;
+	MD5_CTX ctx;
+	char *control;
+	size_t len, n;
+	int fd, ret = -1;
+
+	fd = open(p->path, O_RDONLY);
+	if (fd < 0) {
+		ERRS("could not open \"%s\", %s", p->path);
+		return -1;
+	}
+
+	if (p->size == 0) {
+		ERR("\"%s\" is empty", p->path);
+		goto err_close;
+	}
+
+	map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ERRS("could not map \"%s\", %s", p->path);
+		goto err_close;
+	}
+
+	MD5_Init(&ctx);
+	for (len = 0; len < (size_t) p->size; len += n) {
+		n = (size_t) p->size - len < MD5_CHUNK ?
+			(size_t) p->size - len : MD5_CHUNK;
+		MD5_Update(&ctx, map + len, (unsigned int) n);
+	}
+	MD5_Final(digest, &ctx);
+
+	control = ipk_control(map, p->size, &len);
+	if (!control) {
+		ERR("no control file in \"%s\"", p->path);
+		goto err_unmap;
+	}
+
+	ret = pkg_entry(p, control, len, digest);
+	if (ret)
+		ERR("no memory for the entry of \"%s\"", p->path);
+	free(control);
+
+ err_unmap:
+	munmap(map, p->size);
+ err_close:
+	close(fd);
+	return ret;
+}
+
+static void *pkg_worker(void *arg)
+{
+	struct pkg *p;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pkg_lock);
+		i = next_pkg++;
+		pthread_mutex_unlock(&pkg_lock);
+		if (i >= npkgs)
+			break;
+
+		p = &pkgs[i];
+		if (p->entry)
+			continue;
+
+		fprintf(stderr, "Generating index for package %s\n", p->path);
+		if (pkg_read(p)) {
+			pthread_mutex_lock(&pkg_lock);
+			failed++;
+			pthread_mutex_unlock(&pkg_lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int pkg_add(const char *path, const struct stat *st)
+{
+	static int size;
+	const char *name = strrchr(path, '/');
+
+	name = name ? name + 1 : path;
+	if (!strncmp(name, "kernel_", 7) || !strncmp(name, "libc_", 5))
+		return 0;
+
+	if (npkgs == size) {
+		struct pkg *new;
+
+		size = size ? 2 * size : 256;
+		new = realloc(pkgs, size * sizeof(*pkgs));
+		if (!new) {
+			ERR("no memory for the package list");
+			return -1;
+		}
+		pkgs = new;
+	}
+
+	memset(&pkgs[npkgs], 0, sizeof(*pkgs));
+	pkgs[npkgs].path = strdup(path);
+	pkgs[npkgs].size = st->st_size;
+	pkgs[npkgs].mtime = st->st_mtime;
+	pkgs[npkgs].mtime_nsec = ST_MTIME_NSEC(st);
+	pkgs[npkgs].ino = st->st_ino;
+	if (!pkgs[npkgs].path) {
+		ERR("no memory for the package list");
+		return -1;
+	}
+	npkgs++;
+
+	return 0;
+}
+
+/* like find dir -name '*.ipk' */
+static int scan_dir(const char *dir)
+{
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	size_t len;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(dir);
+	if (!d) {
+		ERRS("could not open directory \"%s\", %s", dir);
+		return -1;
+	}
+
+	while (!ret && (de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+		    sizeof(path)) {
+			ERR("path too long in \"%s\"", dir);
+			ret = -1;
+			break;
+		}
+		if (lstat(path, &st)) {
+			ERRS("could not stat \"%s\", %s", path);
+			ret = -1;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			ret = scan_dir(path);
+			continue;
+		}
+
+		len = strlen(de->d_name);
+		if (len < 4 || strcmp(de->d_name + len - 4, ".ipk"))
+			continue;
+
+		/* a link to a package counts as the package */
+		if (S_ISLNK(st.st_mode) && stat(path, &st))
+			continue;
+		if (!S_ISREG(st.st_mode))
+			continue;
+		ret = pkg_add(path, &st);
+	}
+
+	closedir(d);
+	return ret;
+}
+
+static int pkg_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pkg *) a)->path,
+		      ((const struct pkg *) b)->path);
+}
+
+/*
+ * The cache starts with a line naming the directory it is for, then has
+ * a "<size> <mtime> <mtime nsec> <inode> <length> <path>" line and the
+ * entry of each package.
+ */
+static char *cache_buf;
+
+static void cache_load(const char *dir)
+{
+	struct pkg key, *p;
+	char *pos, *end, *nl;
+	long long size, mtime, nsec;
+	unsigned long long ino;
+	unsigned long len;
+	FILE *f;
+	long flen;
+	int n;
+
+	f = fopen(cachename, "r");
+	if (!f)
+		return;
+
+	fseek(f, 0, SEEK_END);
+	flen = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	cache_buf = malloc(flen + 1);
+	if (!cache_buf || fread(cache_buf, 1, flen, f) != flen) {
+		fclose(f);
+		return;
+	}
+	fclose(f);
+	cache_buf[flen] = 0;
+	end = cache_buf + flen;
+
+	nl = memchr(cache_buf, '\n', flen);
+	if (!nl)
+		return;
+	*nl = 0;
+	if (strncmp(cache_buf, CACHE_MAGIC " ", strlen(CACHE_MAGIC " ")) ||
+	    strcmp(cache_buf + strlen(CACHE_MAGIC " "), dir))
+		return;
+
+	for (pos = nl + 1; pos < end; pos = nl + 1 + len) {
+		nl = memchr(pos, '\n', end - pos);
+		if (!nl)
+			break;
+		*nl = 0;
+		if (sscanf(pos, "%lld %lld %lld %llu %lu %n", &size, &mtime,
+			   &nsec, &ino, &len, &n) < 5 ||
+		    len > end - nl - 1)
+			break;
+
+		key.path = pos + n;
+		p = bsearch(&key, pkgs, npkgs, sizeof(*pkgs), pkg_cmp);
+		if (p && p->size == size && p->mtime == mtime &&
+		    p->mtime_nsec == nsec && p->ino == ino) {
+			p->entry = nl + 1;
+			p->entry_len = len;
+		}
+	}
+}
+
+static int cache_store(const char *dir)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", cachename, (int) getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		ERRS("could not create \"%s\", %s", tmp);
+		return -1;
+	}
+
+	fprintf(f, "%s %s\n", CACHE_MAGIC, dir);
+	for (i = 0; i < npkgs; i++) {
+		struct pkg *p = &pkgs[i];
+
+		if (!p->entry)
+			continue;
+		fprintf(f, "%lld %lld %ld %llu %lu %s\n", (long long) p->size,
+			(long long) p->mtime, p->mtime_nsec,
+			(unsigned long long) p->ino,
+			(unsigned long) p->entry_len, p->path);
+		fwrite(p->entry, 1, p->entry_len, f);
+	}
+
+	if (fclose(f) || rename(tmp, cachename)) {
+		ERRS("could not write \"%s\", %s", cachename);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[PATH_MAX], absdir[PATH_MAX];
+	pthread_t *threads;
+	size_t len;
+	int i, n;
+	int res = EXIT_FAILURE;
+
+	progname = basename(argv[0]);
+
+	while ( 1 ) {
+		int c;
+
+		c = getopt(argc, argv, "c:j:h");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			cachename = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(EXIT_FAILURE);
+
+	/* find prints "dir/name" for both "dir" and "dir/" */
+	snprintf(dir, sizeof(dir), "%s", argv[optind]);
+	len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/')
+		dir[--len] = 0;
+	if (!realpath(dir, absdir)) {
+		ERRS("could not find \"%s\", %s", dir);
+		goto err;
+	}
+
+	if (scan_dir(!strcmp(dir, "/") ? "" : dir))
+		goto err;
+	qsort(pkgs, npkgs, sizeof(*pkgs), pkg_cmp);
+
+	if (cachename)
+		cache_load(absdir);
+
+	if (jobs < 1)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > npkgs)
+		jobs = npkgs;
+	if (jobs < 1)
+		jobs = 1;
+
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		ERR("no memory for threads");
+		goto err;
+	}
+	for (n = 0; n < jobs; n++)
+		if (pthread_create(&threads[n], NULL, pkg_worker, NULL))
+			break;
+	if (n == 0)
+		pkg_worker(NULL);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < npkgs; i++)
+		if (pkgs[i].entry)
+			fwrite(pkgs[i].entry, 1, pkgs[i].entry_len, stdout);
+	if (fflush(stdout)) {
+		ERRS("could not write the index, %s");
+		goto err;
+	}
+
+	/* only costs the next run its time */
+	if (cachename)
+		cache_store(absdir);
+
+	if (failed) {
+		ERR("%d packages could not be read", failed);
+		goto err;
+	}
+
+	res = EXIT_SUCCESS;
+
+ err:
+	return res;
+}
@@ -92,7 +92,7 @@
 #include <sys/wait.h>	// WEXITSTATUS, etc.
 
 // custom includes
-#include "md5.h"	// MD5 routines
+#include "md5.h"	// MD5 routines, shared with firmware-utils
 #include "upgrade.h"	// Linksys definitions from firmware 2.0.19 (unchanged up to 2.0.20)
 
 
@@ -614,8 +614,8 @@ int create_zip_file(char *zip_filename, char *bin_filename) {
 int create_img_file(FILE *f_out, char *out_filename, char *zip_filename) {
 	int exitcode = 0;
 
-	md5_state_t state;
-	md5_byte_t digest[16];
+	MD5_CTX state;
+	unsigned char digest[16];
 
 	int i;
 	int size;
@@ -630,7 +630,7 @@ int create_img_file(FILE *f_out, char *out_filename, char *zip_filename) {
 	memset(&img_hdr[480], 0, 16);
 
 	// prepare md5 checksum calculation
-	md5_init(&state);
+	MD5_Init(&state);
 
 	// add img header
 	lprintf(DEBUG_LVL2, " adding img header\n");
@@ -641,7 +641,7 @@ int create_img_file(FILE *f_out, char *out_filename, char *zip_filename) {
 			printf("output file %s: %s\n", out_filename, strerror(exitcode));
 			break;
 		}
-		md5_append(&state, (const md5_byte_t *)&img_hdr[i], 1);
+		MD5_Update(&state, (unsigned char *)&img_hdr[i], 1);
 	}
 
 	// adding zip file
@@ -661,7 +661,7 @@ int create_img_file(FILE *f_out, char *out_filename, char *zip_filename) {
 					printf("output file %s: %s\n", out_filename, strerror(exitcode));
 					break;
 				}
-				md5_append(&state, (const md5_byte_t *)buffer, 1);
+				MD5_Update(&state, (unsigned char *)buffer, 1);
 			}
 			if (ferror(f_in)) {
 				exitcode = ferror(f_in);
@@ -679,14 +679,14 @@ int create_img_file(FILE *f_out, char *out_filename, char *zip_filename) {
 			exitcode = ferror(f_out);
 			printf("output file %s: %s\n", out_filename, strerror(exitcode));
 		}
-		md5_append(&state, (const md5_byte_t *)img_eof, 1);
+		MD5_Update(&state, (unsigned char *)img_eof, 1);
 	}
 
 	// append salt to md5 checksum
-	md5_append(&state, (const md5_byte_t *)"A^gU*<>?RFY@#DR&Z", 17);
+	MD5_Update(&state, (unsigned char *)"A^gU*<>?RFY@#DR&Z", 17);
 
 	// finish md5 checksum calculation
-	md5_finish(&state, digest);
+	MD5_Final(digest, &state);
 
 	// write md5 checksum into img header
 	if (!exitcode) {